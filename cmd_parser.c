@@ -8,6 +8,13 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <poll.h>
+#include <sched.h>
 
 #include "cmd_parser.h"
 #include "cmd_parser_priv.h"
@@ -29,6 +36,7 @@
 #define     CMD_PARSER_STATE_6              6
 #define     CMD_PARSER_STATE_7              7
 #define     CMD_PARSER_STATE_8              8
+#define     CMD_PARSER_STATE_9              9
 
 // FSM go to previous state
 #define     CMD_PARSER_PREVIOUS_STATE       50
@@ -39,15 +47,112 @@
 // state waiting for input data
 #define     CMD_PARSER_STATE_AGAIN          0x80
 
+// default size of the input ring
+#define     CMD_PARSER_IN_BUF_LEN           1024
+
+// default size of the output buffer
+#define     CMD_PARSER_OUT_BUF_LEN          4096
+
+// initial size of the buffer of a script read from a pipe
+#define     CMD_PARSER_BATCH_BUF_LEN        65536
+
+// Room for each history entry when no byte budget is given
+#define     CMD_PARSER_HISTORY_REC_LEN      64
+
+// Initial number of buckets of the history indexes
+#define     CMD_PARSER_INDEX_BUCKETS        1024
+
+// Number of references to dropped commands tolerated in a history index
+#define     CMD_PARSER_INDEX_STALE          4096
+
+// Number of commands above which a node of the prefix trie of the history
+// lists them in its children as well
+#define     CMD_PARSER_PREFIX_BURST         16
+
+// Signature and version of the history file
+#define     CMD_PARSER_LOG_MAGIC            "CMDPHIST"
+#define     CMD_PARSER_LOG_VERSION          2
+
+// The history file grows by chunks of this size (at least)
+#define     CMD_PARSER_LOG_CHUNK            65536
+
+// Number of commands appended to the history file between two syncs
+#define     CMD_PARSER_LOG_SYNC             16
+
+// Number of commands of the history file loaded at once while idle
+#define     CMD_PARSER_LOG_LOAD_CHUNK       256
+
+// Number of the newest candidates ranked for a suggestion
+#define     CMD_PARSER_SUGGEST_RANK         1024
+
+// Size of the ranking table of the suggestions (twice the candidates)
+#define     CMD_PARSER_SUGGEST_BUCKETS      2048
+
+// Age (in commands) which halves the score of an occurrence
+#define     CMD_PARSER_SUGGEST_HALF         32
+
+// Signature of the shared history
+#define     CMD_PARSER_SHM_MAGIC            "CMDPSHM2"
+
+// State of the shared history once it is set up
+#define     CMD_PARSER_SHM_READY            1
+
+// Number of milliseconds to wait for the creator of the shared history
+#define     CMD_PARSER_SHM_WAIT             1000
+
+// Number of times a writer of the shared history yields the CPU to an older
+// writer still filling its slot (then the older one is supposed dead)
+#define     CMD_PARSER_SHM_SPIN             1000
+
+// Maximum length of the pattern of the reverse search
+#define     CMD_PARSER_SEARCH_LEN           256
+
+// Telnet commands (RFC 854)
+#define     CMD_PARSER_TELNET_SE            240
+#define     CMD_PARSER_TELNET_SB            250
+#define     CMD_PARSER_TELNET_WILL          251
+#define     CMD_PARSER_TELNET_WONT          252
+#define     CMD_PARSER_TELNET_DO            253
+#define     CMD_PARSER_TELNET_DONT          254
+#define     CMD_PARSER_TELNET_IAC           255
+
+// Telnet options
+#define     CMD_PARSER_TELNET_ECHO          1
+#define     CMD_PARSER_TELNET_SGA           3
+#define     CMD_PARSER_TELNET_NAWS          31
+#define     CMD_PARSER_TELNET_LINEMODE      34
+
+// MODE subnegotiation of the telnet line mode (RFC 1184)
+#define     CMD_PARSER_TELNET_LM_MODE       1
+#define     CMD_PARSER_TELNET_LM_EDIT       0x01
+#define     CMD_PARSER_TELNET_LM_ACK        0x04
+
+// States of the telnet input
+#define     CMD_PARSER_TELNET_DATA          0
+#define     CMD_PARSER_TELNET_CMD           1
+#define     CMD_PARSER_TELNET_OPTION        2
+#define     CMD_PARSER_TELNET_SUB           3
+#define     CMD_PARSER_TELNET_SUB_IAC       4
+
+// chars out of the ASCII set in a word
+#define     CMD_PARSER_NON_ASCII_MASK       UINT64_C(0x8080808080808080)
+
 // cmd is blank or not
 #define     CMD_IS_BLANK(c)                 (' ' == (c) || '\t' == (c))
 
 // check if it's in ASCII range
 #define     CMD_IN_ASCII_RANGE(x)           ((unsigned char)((x) <= 127 ? ((x) - 0x40) : (x)))
 
+// chars located after the gap of the command line
+#define     CMD_PARSER_TAIL(p)              ((p)->cmd + (p)->cmdSz - ((p)->lineSz - (p)->gapPos))
 
-// write out data
-static int cmdParserWrite(cmdParserInstance_t *pCtx, const void *buf, size_t len)
+// char at a given position of the command line
+#define     CMD_PARSER_CHAR(p, i)           ((unsigned)(i) < (p)->gapPos ? (p)->cmd[(i)] :     \
+                                             (p)->cmd[(i) + (p)->cmdSz - (p)->lineSz])
+
+
+// write out data on the output descriptor
+static int cmdParserSend(cmdParserInstance_t *pCtx, const void *buf, size_t len)
 {
     int rc;
     int l = 0;
@@ -55,6 +160,22 @@ static int cmdParserWrite(cmdParserInstance_t *pCtx, const void *buf, size_t len
 
     assert(NULL != pCtx);
 
+    pCtx->stats.outWrites++;
+
+    // The instance fed by the user displays nothing by itself
+    if(pCtx->user.onEvent)
+    {
+        cmdParserEvent_t ev;
+
+        ev.type = CMD_PARSER_EVENT_OUTPUT;
+        ev.data = (const unsigned char *)buf;
+        ev.len  = len;
+        pCtx->user.onEvent(pCtx->user.ctx, &ev);
+        pCtx->stats.outBytes += len;
+
+        return len;
+    }
+
     do
     {
         rc = write(pCtx->user.fdOut, ((const unsigned char *)buf) + l, len -l);
@@ -62,6 +183,7 @@ static int cmdParserWrite(cmdParserInstance_t *pCtx, const void *buf, size_t len
         {
             assert(((unsigned)l + rc) <= len);
             l += rc;
+            pCtx->stats.outBytes += rc;
         }
     
     } while(((unsigned)l != len) && ((rc >=0) || (EINTR == errno)));
@@ -77,6 +199,139 @@ static int cmdParserWrite(cmdParserInstance_t *pCtx, const void *buf, size_t len
     return l;
 }
 
+// flush the output buffer
+static int cmdParserFlushOut(cmdParserInstance_t *pCtx)
+{
+    int rc;
+
+    if(!(pCtx->outLen))
+    {
+        return 0;
+    }
+
+    rc = cmdParserSend(pCtx, pCtx->outBuf, pCtx->outLen);
+
+    // Even on error, the data are dropped to not block the next edits
+    pCtx->outLen = 0;
+
+    return (rc < 0) ? -1 : 0;
+}
+
+// append data into the output buffer as they are
+static int cmdParserWriteRaw(cmdParserInstance_t *pCtx, const void *buf, size_t len)
+{
+    assert(NULL != pCtx);
+
+    // Make room in the buffer if necessary
+    if((pCtx->outLen + len) > pCtx->outBufSz)
+    {
+        if(0 != cmdParserFlushOut(pCtx))
+        {
+            return -1;
+        }
+
+        // Too big to be buffered
+        if(len > pCtx->outBufSz)
+        {
+            return cmdParserSend(pCtx, buf, len);
+        }
+    }
+
+    memcpy(pCtx->outBuf + pCtx->outLen, buf, len);
+    pCtx->outLen += len;
+
+    return len;
+}
+
+// append data into the output buffer in the telnet encoding: the IAC are
+// doubled and the end of lines are CR LF (or CR NUL for a lone CR)
+static int cmdParserWriteNvt(cmdParserInstance_t *pCtx, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    unsigned char       *out;
+    size_t              i;
+
+    for(i = 0; i < len; i++)
+    {
+        // Room for an encoded char
+        if(((pCtx->outLen + 2) > pCtx->outBufSz) && (0 != cmdParserFlushOut(pCtx)))
+        {
+            return -1;
+        }
+
+        out = pCtx->outBuf + pCtx->outLen;
+        if(CMD_PARSER_TELNET_IAC == p[i])
+        {
+            *(out++) = CMD_PARSER_TELNET_IAC;
+        }
+        else if(('\n' == p[i]) && (!i || ('\r' != p[i - 1])))
+        {
+            *(out++) = '\r';
+        }
+
+        *(out++) = p[i];
+
+        if(('\r' == p[i]) && (((i + 1) == len) || ('\n' != p[i + 1])))
+        {
+            *(out++) = '\0';
+        }
+
+        pCtx->outLen = out - pCtx->outBuf;
+    }
+
+    return len;
+}
+
+// append data into the output buffer
+static int cmdParserWrite(cmdParserInstance_t *pCtx, const void *buf, size_t len)
+{
+    if(pCtx->user.telnet)
+    {
+        return cmdParserWriteNvt(pCtx, buf, len);
+    }
+
+    return cmdParserWriteRaw(pCtx, buf, len);
+}
+
+// length of an ANSI control sequence: ESC [ <n> <cmd>
+static unsigned int cmdParserCsiLen(unsigned int n, char cmd)
+{
+    unsigned int l = 3;
+
+    // The parameter is omitted when it is the default one
+    if(n == (unsigned)(('K' == cmd) ? 0 : 1))
+    {
+        return l;
+    }
+
+    do
+    {
+        l++;
+        n /= 10;
+    } while(n);
+
+    return l;
+}
+
+// write an ANSI control sequence: ESC [ <n> <cmd>
+static int cmdParserWriteCsi(cmdParserInstance_t *pCtx, unsigned int n, char cmd)
+{
+    char buf[16];
+    int  l;
+
+    // The parameter is omitted when it is the default one
+    if(n == (unsigned)(('K' == cmd) ? 0 : 1))
+    {
+        l = snprintf(buf, sizeof(buf), "\x1b[%c", cmd);
+    }
+    else
+    {
+        l = snprintf(buf, sizeof(buf), "\x1b[%u%c", n, cmd);
+    }
+
+    return cmdParserWrite(pCtx, buf, l);
+}
+
 // read input data
 static int cmdParserRead(cmdParserInstance_t *pCtx, unsigned char *buf, unsigned int len)
 {
@@ -85,6 +340,23 @@ static int cmdParserRead(cmdParserInstance_t *pCtx, unsigned char *buf, unsigned
 
     assert(NULL != pCtx);
 
+    // The instance fed by the user reads what it handed over
+    if(pCtx->user.onEvent)
+    {
+        if(!(pCtx->feedLen))
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        rc = (len < pCtx->feedLen) ? len : pCtx->feedLen;
+        memcpy(buf, pCtx->feedBuf, rc);
+        pCtx->feedBuf += rc;
+        pCtx->feedLen -= rc;
+
+        return rc;
+    }
+
     do
     {
         rc = read(pCtx->user.fdIn, buf, len);
@@ -114,1050 +386,4276 @@ static int cmdParserRead(cmdParserInstance_t *pCtx, unsigned char *buf, unsigned
     return rc;
 }
 
-// move curosr
-static int cmdParserMoveCursor(cmdParserInstance_t *pCtx, int offset, int where)
+// send a telnet negotiation: IAC <verb> <option>
+static void cmdParserTelnetSend(cmdParserInstance_t *pCtx, unsigned char verb, unsigned char opt)
 {
-    int rc;
-    unsigned char c[2];
+    unsigned char buf[3];
 
-    // calculate offset from current cursor position
-    switch(where)
+    buf[0] = CMD_PARSER_TELNET_IAC;
+    buf[1] = verb;
+    buf[2] = opt;
+    (void)cmdParserWriteRaw(pCtx, buf, sizeof(buf));
+}
+
+// ask for or acknowledge a mode of the telnet line mode
+static void cmdParserTelnetSendMode(cmdParserInstance_t *pCtx, unsigned char mask)
+{
+    unsigned char buf[7];
+
+    buf[0] = CMD_PARSER_TELNET_IAC;
+    buf[1] = CMD_PARSER_TELNET_SB;
+    buf[2] = CMD_PARSER_TELNET_LINEMODE;
+    buf[3] = CMD_PARSER_TELNET_LM_MODE;
+    buf[4] = mask;
+    buf[5] = CMD_PARSER_TELNET_IAC;
+    buf[6] = CMD_PARSER_TELNET_SE;
+    (void)cmdParserWriteRaw(pCtx, buf, sizeof(buf));
+}
+
+// echo the input unless the telnet client edits the lines by itself (it
+// then sends whole lines)
+static void cmdParserTelnetEcho(cmdParserInstance_t *pCtx)
+{
+    cmdParserTelnet_t *pTn = &(pCtx->telnet);
+
+    pCtx->echoOn = pCtx->echoWanted;
+    if(pCtx->user.telnet && (!(pTn->willEcho) || pTn->linemodeEdit))
     {
-        case CMD_PARSER_MOVE_SET:
+        pCtx->echoOn = 0;
+    }
+}
+
+// answer a telnet negotiation (only the state changes are answered to
+// not loop with the client)
+static void cmdParserTelnetOption(cmdParserInstance_t *pCtx, unsigned char verb, unsigned char opt)
+{
+    cmdParserTelnet_t *pTn = &(pCtx->telnet);
+
+    switch(verb)
+    {
+        case CMD_PARSER_TELNET_DO:
         {
-            if(offset < 0)
+            if(CMD_PARSER_TELNET_ECHO == opt)
             {
-                offset = 0;
+                if(!(pTn->willEcho))
+                {
+                    pTn->willEcho = 1;
+                    cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_WILL, opt);
+                }
+            }
+            else if(CMD_PARSER_TELNET_SGA == opt)
+            {
+                if(!(pTn->willSga))
+                {
+                    pTn->willSga = 1;
+                    cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_WILL, opt);
+                }
+            }
+            else
+            {
+                cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_WONT, opt);
             }
-            offset = -(pCtx->cursor - offset);
         }
         break;
 
-        case CMD_PARSER_MOVE_CUR:
+        case CMD_PARSER_TELNET_DONT:
         {
-            // nothing to do
+            if((CMD_PARSER_TELNET_ECHO == opt) && pTn->willEcho)
+            {
+                pTn->willEcho = 0;
+                cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_WONT, opt);
+            }
+            else if((CMD_PARSER_TELNET_SGA == opt) && pTn->willSga)
+            {
+                pTn->willSga = 0;
+                cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_WONT, opt);
+            }
         }
         break;
 
-        case CMD_PARSER_MOVE_END:
+        case CMD_PARSER_TELNET_WILL:
         {
-            assert(pCtx->lineSz >= (unsigned)(pCtx->cursor));
-            offset = pCtx->lineSz - offset - pCtx->cursor;
+            if(CMD_PARSER_TELNET_NAWS == opt)
+            {
+                if(!(pTn->doNaws))
+                {
+                    pTn->doNaws = 1;
+                    cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_DO, opt);
+                }
+            }
+            else if(CMD_PARSER_TELNET_LINEMODE == opt)
+            {
+                // The lines are edited here unless the client insists
+                if(!(pTn->doLinemode))
+                {
+                    pTn->doLinemode = 1;
+                    cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_DO, opt);
+                    cmdParserTelnetSendMode(pCtx, 0);
+                }
+            }
+            else
+            {
+                cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_DONT, opt);
+            }
         }
         break;
 
-        default:
+        case CMD_PARSER_TELNET_WONT:
         {
-            assert(0);
+            if((CMD_PARSER_TELNET_NAWS == opt) && pTn->doNaws)
+            {
+                pTn->doNaws = 0;
+                pTn->cols   = 0;
+                pTn->rows   = 0;
+                cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_DONT, opt);
+            }
+            else if((CMD_PARSER_TELNET_LINEMODE == opt) && pTn->doLinemode)
+            {
+                pTn->doLinemode   = 0;
+                pTn->linemodeEdit = 0;
+                cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_DONT, opt);
+            }
         }
+        break;
     }
 
-    // forward
-    if(offset > 0)
+    cmdParserTelnetEcho(pCtx);
+}
+
+// process a telnet subnegotiation: window size or mode of the line mode
+static void cmdParserTelnetSub(cmdParserInstance_t *pCtx)
+{
+    cmdParserTelnet_t *pTn = &(pCtx->telnet);
+    unsigned char     mask;
+
+    if((CMD_PARSER_TELNET_NAWS == pTn->sb[0]) && (5 == pTn->sbLen))
     {
-        if((unsigned)(pCtx->cursor + offset) >= pCtx->lineSz)
+        pTn->cols = (pTn->sb[1] << 8) | pTn->sb[2];
+        pTn->rows = (pTn->sb[3] << 8) | pTn->sb[4];
+        return;
+    }
+
+    if((CMD_PARSER_TELNET_LINEMODE == pTn->sb[0]) && (3 == pTn->sbLen) && (CMD_PARSER_TELNET_LM_MODE == pTn->sb[1]))
+    {
+        mask = pTn->sb[2];
+        if(!(mask & CMD_PARSER_TELNET_LM_ACK))
         {
-            assert((unsigned)(pCtx->cursor) <= pCtx->lineSz);
-            offset = pCtx->lineSz - pCtx->cursor;
+            cmdParserTelnetSendMode(pCtx, mask | CMD_PARSER_TELNET_LM_ACK);
         }
 
-        printf("\nline_sz = %u, curosr = %d, offset = %d\n", pCtx->lineSz, pCtx->cursor, offset);
+        pTn->linemodeEdit = !!(mask & CMD_PARSER_TELNET_LM_EDIT);
+        cmdParserTelnetEcho(pCtx);
+    }
+}
+
+// remove the telnet protocol from the input (in place) and return the
+// number of chars left for the state machine
+static unsigned int cmdParserTelnetIn(cmdParserInstance_t *pCtx, unsigned char *buf, unsigned int len)
+{
+    cmdParserTelnet_t *pTn = &(pCtx->telnet);
+    unsigned int      i;
+    unsigned int      n = 0;
+    unsigned char     c;
 
-        if(pCtx->echoOn)
+    for(i = 0; i < len; i++)
+    {
+        c = buf[i];
+
+        switch(pTn->state)
         {
-            unsigned int l = (unsigned)offset;
-            unsigned int l1;
-            unsigned int i;
+            case CMD_PARSER_TELNET_DATA:
+            {
+                if(CMD_PARSER_TELNET_IAC == c)
+                {
+                    pTn->state = CMD_PARSER_TELNET_CMD;
+                    break;
+                }
+
+                // The end of line is CR LF or CR NUL: the CR is enough
+                if(pTn->cr)
+                {
+                    pTn->cr = 0;
+                    if(('\n' == c) || ('\0' == c))
+                    {
+                        break;
+                    }
+                }
+
+                pTn->cr  = ('\r' == c);
+                buf[n++] = c;
+            }
+            break;
 
-            i = pCtx->cursor;
-            while(l)
+            case CMD_PARSER_TELNET_CMD:
             {
-                c[0] = pCtx->cmd[i];
+                pTn->state = CMD_PARSER_TELNET_DATA;
+
+                // A 0xFF char (IAC IAC) is dropped as the state machine
+                // takes it for the end of the input
+                if((c >= CMD_PARSER_TELNET_WILL) && (c <= CMD_PARSER_TELNET_DONT))
+                {
+                    pTn->verb  = c;
+                    pTn->state = CMD_PARSER_TELNET_OPTION;
+                }
+                else if(CMD_PARSER_TELNET_SB == c)
+                {
+                    pTn->sbLen = 0;
+                    pTn->state = CMD_PARSER_TELNET_SUB;
+                }
+
+                // The other commands (NOP, GA, AYT...) are ignored
+            }
+            break;
 
-        		// If accented character (cf. man iso_8859-1)
-        		if (c[0] > 0x7f)
-        		{
-          			if (c[0] >= 0xc0)
-          			{
-            			c[1] = c[0] - 0x40;
-            			c[0] = 0xc3;
-          			}
-          			else
-          			{
-            			c[1] = c[0];
-            			c[0] = 0xc2;
-          			}
-          			l1 = 2;
-        		}
-        		else
-        		{
-          			l1 = 1;
-        		}
-        		rc = cmdParserWrite(pCtx, c, l1);
-        		if (l1 != (unsigned)rc)
-        		{
-          			return -1;
-        		}
+            case CMD_PARSER_TELNET_OPTION:
+            {
+                cmdParserTelnetOption(pCtx, pTn->verb, c);
+                pTn->state = CMD_PARSER_TELNET_DATA;
+            }
+            break;
 
-        		l--;
-        		i++;
+            case CMD_PARSER_TELNET_SUB:
+            case CMD_PARSER_TELNET_SUB_IAC:
+            {
+                if((CMD_PARSER_TELNET_SUB == pTn->state) && (CMD_PARSER_TELNET_IAC == c))
+                {
+                    pTn->state = CMD_PARSER_TELNET_SUB_IAC;
+                    break;
+                }
+
+                if((CMD_PARSER_TELNET_SUB_IAC == pTn->state) && (CMD_PARSER_TELNET_IAC != c))
+                {
+                    if(CMD_PARSER_TELNET_SE == c)
+                    {
+                        cmdParserTelnetSub(pCtx);
+                    }
+                    pTn->state = CMD_PARSER_TELNET_DATA;
+                    break;
+                }
+
+                // Data of the subnegotiation (the longer ones are of no use)
+                if(pTn->sbLen < sizeof(pTn->sb))
+                {
+                    pTn->sb[pTn->sbLen] = c;
+                }
+                pTn->sbLen++;
+                pTn->state = CMD_PARSER_TELNET_SUB;
             }
+            break;
         }
+    }
 
-		pCtx->cursor += offset;
+    return n;
+}
 
-		return 0;
-    }
+// The command line is stored in a gap buffer. The gap is moved to the
+// position of an edition only when the line is modified, so moving the
+// cursor costs nothing and inserting/removing at the cursor is O(1):
+//
+//            +-------------------------------------------+
+//            | a | b | c |   |   |   |   |   | d | e | f |
+//            +-------------------------------------------+
+//                        ^                   ^
+//                        |                   |
+//                      gapPos              tail
+//
+//          line = "abcdef", lineSz = 6, tail = cmd + cmdSz - (lineSz - gapPos)
+//
+// The line is made contiguous (gap at the end) only when it is handed over
+// to the user.
 
-	// backward
-  	if(offset < 0)
-  	{
-   		// If we try to go below the beginning of line, adjust to begining of line
-    	if((pCtx->cursor + offset) < 0)
-    	{
-      		offset += (pCtx->cursor + offset);
-      		pCtx->cursor = 0;
-    	}
-    	else
-    	{
-      		pCtx->cursor += offset;
-    	}
 
-    	if(pCtx->echoOn)
-    	{
-      		c[0] = '\b';
+// move the gap of the command line at a given position
+static void cmdParserGapMove(cmdParserInstance_t *pCtx, unsigned int pos)
+{
+    unsigned int gapLen = pCtx->cmdSz - pCtx->lineSz;
 
-      		while(offset)
-      		{
-        		rc = cmdParserWrite(pCtx, c, 1);
-        		if(1 != rc)
-        		{
-          			return -1;
-        		}
+    assert(pos <= pCtx->lineSz);
 
-        		// We increment offset as it is negative
-        		offset ++;
-      		} 
-    	} 
+    if(pos < pCtx->gapPos)
+    {
+        memmove(pCtx->cmd + pos + gapLen, pCtx->cmd + pos, pCtx->gapPos - pos);
+    }
+    else if(pos > pCtx->gapPos)
+    {
+        memmove(pCtx->cmd + pCtx->gapPos, pCtx->cmd + pCtx->gapPos + gapLen, pos - pCtx->gapPos);
+    }
 
-    	return 0;
-  	}
+    pCtx->gapPos = pos;
+}
 
-	// no need to move cursor
-	return 0;
+// make the command line contiguous and NUL terminated
+static unsigned char *cmdParserLineFlat(cmdParserInstance_t *pCtx)
+{
+    cmdParserGapMove(pCtx, pCtx->lineSz);
+
+    // There is always room for the NUL as the line is at most cmdSz - 1 long
+    pCtx->cmd[pCtx->lineSz] = '\0';
+
+    return pCtx->cmd;
 }
 
+// save the command line being edited
+static void cmdParserSaveLine(cmdParserInstance_t *pCtx)
+{
+    memcpy(pCtx->savedCmd, pCtx->cmd, pCtx->gapPos);
+    memcpy(pCtx->savedCmd + pCtx->gapPos, CMD_PARSER_TAIL(pCtx), pCtx->lineSz - pCtx->gapPos);
+    pCtx->savedCmd[pCtx->lineSz] = '\0';
+    pCtx->savedSz = pCtx->lineSz;
+}
 
-// remove characters from currect position to end of line
-static int cmdParserTruncate(cmdParserInstance_t *pCtx)
+// make room in the command line for 'len' more chars (the buffers are
+// doubled up to the optional hard limit)
+static int cmdParserLineReserve(cmdParserInstance_t *pCtx, unsigned int len)
 {
-	unsigned int i, l;
-	int          rc;
+    unsigned int   need = pCtx->lineSz + len + 1;
+    unsigned int   size = pCtx->cmdSz;
+    unsigned int   tailLen;
+    unsigned char *p;
 
-  	if((unsigned)(pCtx->cursor) < pCtx->lineSz)
-  	{
-    	// Erase the end of the line
-   		for(i = pCtx->cursor; i < pCtx->lineSz; i++)
-    	{
-      		pCtx->cmd[i] = ' ';
-    	}
+    if(need <= pCtx->cmdSz)
+    {
+        return 0;
+    }
 
-    	l = pCtx->lineSz - pCtx->cursor;
+    if((need < pCtx->lineSz) || (pCtx->user.lineMaxLen && (need > pCtx->user.lineMaxLen)))
+    {
+        errno = ENOSPC;
+        return -1;
+    }
 
-    	// Echo the blanks
-    	if(pCtx->echoOn)
-    	{
-      		rc = cmdParserWrite(pCtx, &(pCtx->cmd[pCtx->cursor]), l);
-      		if(rc < 0)
-      		{
-        		return -1;
-      		}
-    	}
+    while(size < need)
+    {
+        size = (size > (UINT_MAX / 2)) ? need : (2 * size);
+    }
+    if(pCtx->user.lineMaxLen && (size > pCtx->user.lineMaxLen))
+    {
+        size = pCtx->user.lineMaxLen;
+    }
 
-    	pCtx->cursor += l;
-    	cmdParserMoveCursor(pCtx, -l, CMD_PARSER_MOVE_CUR);
+    // The saved line and the translated line follow the size of the line
+    p = (unsigned char *)realloc(pCtx->savedCmd, size);
+    if(!p)
+    {
+        return -1;
+    }
+    pCtx->savedCmd = p;
 
-    	// Update the size of the line
-    	pCtx->lineSz -= l;
-    	pCtx->cmd[pCtx->lineSz] = '\0';
-  	}
+    if(!(pCtx->user.utf8))
+    {
+        p = (unsigned char *)realloc(pCtx->result, 2 * size);
+        if(!p)
+        {
+            return -1;
+        }
+        pCtx->result = p;
+    }
 
-  	return 0;
-}
+    p = (unsigned char *)realloc(pCtx->cmd, size);
+    if(!p)
+    {
+        return -1;
+    }
+    pCtx->cmd = p;
 
+    // Move the right side of the gap at the end of the new buffer
+    tailLen = pCtx->lineSz - pCtx->gapPos;
+    memmove(pCtx->cmd + size - tailLen, pCtx->cmd + pCtx->cmdSz - tailLen, tailLen);
+    pCtx->cmdSz = size;
 
-// shift the part of the cmd located the right side of the cursor
-static int cmdParserShiftLine(cmdParserInstance_t *pCtx, int direction)
+    return 0;
+}
+
+// give back the memory used by a long command line
+static void cmdParserLineShrink(cmdParserInstance_t *pCtx)
 {
-	unsigned int  i, j, l, l1;
-	int           val;
-	int           rc;
-	unsigned char c[2];
+    unsigned char *p;
 
-  	// Shift right
-  	if(direction > 0)
-  	{
-    	assert((unsigned)(pCtx->lineSz) < (pCtx->user.lineLen - 1));
+    assert(0 == pCtx->lineSz);
 
-    	for(i = pCtx->lineSz; i > (unsigned)(pCtx->cursor); i --)
-    	{
-      		pCtx->cmd[i] = pCtx->cmd[i - 1];
-    	}
+    if(pCtx->cmdSz <= pCtx->user.lineLen)
+    {
+        return;
+    }
 
-    	pCtx->cmd[i] = ' ';
+    // The buffers stay bigger if the reallocation fails
+    p = (unsigned char *)realloc(pCtx->cmd, pCtx->user.lineLen);
+    if(!p)
+    {
+        return;
+    }
+    pCtx->cmd = p;
+    pCtx->cmdSz = pCtx->user.lineLen;
 
-    	pCtx->lineSz++;
-    	pCtx->cmd[pCtx->lineSz] = '\0';
+    p = (unsigned char *)realloc(pCtx->savedCmd, pCtx->user.lineLen);
+    if(p)
+    {
+        pCtx->savedCmd = p;
+    }
 
-    	// Echo
-    	if(pCtx->echoOn)
-    	{
-      		l = pCtx->lineSz - pCtx->cursor;
-      		j = i;
-     		while(l)
-      		{
-        		c[0] = pCtx->cmd[j];
+    if(!(pCtx->user.utf8))
+    {
+        p = (unsigned char *)realloc(pCtx->result, 2 * pCtx->user.lineLen);
+        if(p)
+        {
+            pCtx->result = p;
+        }
+    }
+}
 
-        		// If accented character (cf. man iso_8859-1)
-        		if(c[0] > 0x7f)
-        		{
-          			if(c[0] >= 0xc0)
-          			{
-            			c[1] = c[0] - 0x40;
-            			c[0] = 0xc3;
-          			}
-          			else
-          			{
-            			c[1] = c[0];
-            			c[0] = 0xc2;
-          			}
-          			l1 = 2;
-        		}
-        		else
-        		{
-          			l1 = 1;
-        		}
-        		rc = cmdParserWrite(pCtx, c, l1);
-        		if(l1 != (unsigned)rc)
-        		{
-          			return -1;
-        		}
 
-        		l--;
-        		j++;
-      		}
-    	}
+// Display width of the chars of the command line (UTF-8 mode)
+//
+// A char is a code point followed by the zero width code points (combining
+// marks...) displayed along with it. The cursor and the gap are always on
+// a char boundary.
+
+// range of code points
+typedef struct {
+    unsigned int first;
+    unsigned int last;
+} cmdParserRange_t;
+
+// code points not taking any column (combining marks, zero width chars)
+static const cmdParserRange_t cmdParserZeroWidth[] =
+{
+  { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x05bf, 0x05bf },
+  { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 }, { 0x05c7, 0x05c7 }, { 0x0610, 0x061a },
+  { 0x064b, 0x065f }, { 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+  { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0711, 0x0711 }, { 0x0730, 0x074a },
+  { 0x07a6, 0x07b0 }, { 0x07eb, 0x07f3 }, { 0x0816, 0x0819 }, { 0x081b, 0x0823 },
+  { 0x0825, 0x0827 }, { 0x0829, 0x082d }, { 0x0859, 0x085b }, { 0x08d3, 0x08e1 },
+  { 0x08e3, 0x0902 }, { 0x093a, 0x093a }, { 0x093c, 0x093c }, { 0x0941, 0x0948 },
+  { 0x094d, 0x094d }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 }, { 0x0981, 0x0981 },
+  { 0x09bc, 0x09bc }, { 0x09c1, 0x09c4 }, { 0x09cd, 0x09cd }, { 0x09e2, 0x09e3 },
+  { 0x0a01, 0x0a02 }, { 0x0a3c, 0x0a3c }, { 0x0a41, 0x0a51 }, { 0x0a70, 0x0a71 },
+  { 0x0a81, 0x0a82 }, { 0x0abc, 0x0abc }, { 0x0ac1, 0x0ac8 }, { 0x0acd, 0x0acd },
+  { 0x0b01, 0x0b01 }, { 0x0b3c, 0x0b3c }, { 0x0b3f, 0x0b3f }, { 0x0b41, 0x0b44 },
+  { 0x0b4d, 0x0b4d }, { 0x0bc0, 0x0bc0 }, { 0x0bcd, 0x0bcd }, { 0x0c3e, 0x0c40 },
+  { 0x0c46, 0x0c56 }, { 0x0cbc, 0x0cbc }, { 0x0ccc, 0x0ccd }, { 0x0d41, 0x0d44 },
+  { 0x0d4d, 0x0d4d }, { 0x0dca, 0x0dca }, { 0x0dd2, 0x0dd6 }, { 0x0e31, 0x0e31 },
+  { 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e }, { 0x0eb1, 0x0eb1 }, { 0x0eb4, 0x0ebc },
+  { 0x0ec8, 0x0ecd }, { 0x0f18, 0x0f19 }, { 0x0f35, 0x0f35 }, { 0x0f37, 0x0f37 },
+  { 0x0f39, 0x0f39 }, { 0x0f71, 0x0f7e }, { 0x0f80, 0x0f84 }, { 0x0f86, 0x0f87 },
+  { 0x0f8d, 0x0fbc }, { 0x102d, 0x1030 }, { 0x1032, 0x1037 }, { 0x1039, 0x103a },
+  { 0x1160, 0x11ff }, { 0x135d, 0x135f }, { 0x1712, 0x1714 }, { 0x17b4, 0x17b5 },
+  { 0x17b7, 0x17bd }, { 0x17c6, 0x17c6 }, { 0x17c9, 0x17d3 }, { 0x180b, 0x180e },
+  { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e },
+  { 0x2060, 0x2064 }, { 0x20d0, 0x20f0 }, { 0x2cef, 0x2cf1 }, { 0x2de0, 0x2dff },
+  { 0x302a, 0x302d }, { 0x3099, 0x309a }, { 0xa66f, 0xa672 }, { 0xa674, 0xa67d },
+  { 0xa69e, 0xa69f }, { 0xa6f0, 0xa6f1 }, { 0xa802, 0xa802 }, { 0xa806, 0xa806 },
+  { 0xa80b, 0xa80b }, { 0xa825, 0xa826 }, { 0xfb1e, 0xfb1e }, { 0xfe00, 0xfe0f },
+  { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0x1d167, 0x1d169 }, { 0x1d173, 0x1d182 },
+  { 0x1d185, 0x1d18b }, { 0x1d1aa, 0x1d1ad }, { 0xe0001, 0xe0001 }, { 0xe0020, 0xe007f },
+  { 0xe0100, 0xe01ef }
+};
 
-    	// Move back the cursor to its current position
-    	val = pCtx->cursor;
-    	pCtx->cursor = pCtx->lineSz;
-    	cmdParserMoveCursor(pCtx, -(pCtx->lineSz - val), CMD_PARSER_MOVE_CUR);
-  	}
-  	else
-  	{
-    	// Shift left
-    	if((direction < 0) && ((unsigned)(pCtx->cursor) < pCtx->lineSz))
-    	{
-      		for(i = pCtx->cursor; i < (pCtx->lineSz - 1); i ++)
-      		{
-        		pCtx->cmd[i] = pCtx->cmd[i + 1];
-      		}
+// code points taking two columns (East Asian wide and full width chars, emoji)
+static const cmdParserRange_t cmdParserDoubleWidth[] =
+{
+  { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec },
+  { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 },
+  { 0x2648, 0x2653 }, { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+  { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 }, { 0x26ce, 0x26ce },
+  { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea }, { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 },
+  { 0x26fa, 0x26fa }, { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+  { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e }, { 0x2753, 0x2755 },
+  { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf },
+  { 0x2b1b, 0x2b1c }, { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x303e },
+  { 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+  { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 },
+  { 0xfe30, 0xfe6f }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 },
+  { 0x17000, 0x18aff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0cf },
+  { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a }, { 0x1f200, 0x1f251 }, { 0x1f300, 0x1f64f },
+  { 0x1f680, 0x1f6ff }, { 0x1f7e0, 0x1f7eb }, { 0x1f90c, 0x1f9ff }, { 0x1fa70, 0x1faff },
+  { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd }
+};
 
-      		// Put a white space on the last char of the line to erase it
-      		// at display time
-      		pCtx->cmd[i] = ' ';
+#define CMD_PARSER_NB_RANGES(t)      (sizeof(t) / sizeof((t)[0]))
 
-      		// Echo
-      		if(pCtx->echoOn)
-      		{
-        		l = pCtx->lineSz - pCtx->cursor;
-        		j = pCtx->cursor;
-        		while(l)
-        		{
-          			c[0] = pCtx->cmd[j];
+// check if a code point is in a table of ranges
+static int cmdParserInRanges(unsigned int cp, const cmdParserRange_t *r, unsigned int nb)
+{
+    unsigned int lo = 0;
+    unsigned int hi = nb;
+    unsigned int mid;
 
-          			// If accented character (cf. man iso_8859-1)
-          			if(c[0] > 0x7f)
-          			{
-            			if(c[0] >= 0xc0)
-            			{
-              				c[1] = c[0] - 0x40;
-              				c[0] = 0xc3;
-            			}
-            			else
-            			{
-              				c[1] = c[0];
-              				c[0] = 0xc2;
-            			}
-            			l1 = 2;
-          			}
-          			else
-          			{
-            			l1 = 1;
-          			}
+    if((cp < r[0].first) || (cp > r[nb - 1].last))
+    {
+        return 0;
+    }
 
-          			rc = cmdParserWrite(pCtx, c, l1);
-          			if(l1 != (unsigned)rc)
-          			{
-            			return -1;
-          			}
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(cp > r[mid].last)
+        {
+            lo = mid + 1;
+        }
+        else if(cp < r[mid].first)
+        {
+            hi = mid;
+        }
+        else
+        {
+            return 1;
+        }
+    }
 
-          			l--;
-          			j++;
-        		}
-      		}
+    return 0;
+}
 
-			// Move back the cursor to its current position
-      		val = pCtx->cursor;
-      		pCtx->cursor = pCtx->lineSz;
-      		cmdParserMoveCursor(pCtx, -(pCtx->lineSz - val), CMD_PARSER_MOVE_CUR);
+// number of columns taken by a code point
+static unsigned int cmdParserCpWidth(unsigned int cp)
+{
+    if(cp < 0x300)
+    {
+        return 1;
+    }
 
-      		pCtx->lineSz--;
-      		pCtx->cmd[pCtx->lineSz] = '\0';
-    	}
-  	}
+    if(cmdParserInRanges(cp, cmdParserZeroWidth, CMD_PARSER_NB_RANGES(cmdParserZeroWidth)))
+    {
+        return 0;
+    }
 
- 	 return 0;
-}
+    if(cmdParserInRanges(cp, cmdParserDoubleWidth, CMD_PARSER_NB_RANGES(cmdParserDoubleWidth)))
+    {
+        return 2;
+    }
 
+    return 1;
+}
 
-// get or unget one character
-static int cmdParserGetUngetChar(cmdParserInstance_t *pCtx, unsigned char *c)
+// expected length of an UTF-8 sequence from its first byte (0 if invalid)
+static unsigned int cmdParserUtf8Len(unsigned char c)
 {
-	int rc;
+    if(c < 0x80)
+    {
+        return 1;
+    }
 
-  	if(!c)
-  	{
-    	errno = EINVAL;
-    	return -1;
-  	}
+    if((c >= 0xc2) && (c <= 0xdf))
+    {
+        return 2;
+    }
 
-  	if (*c)
-  	{
-    	pCtx->storedUngetChar = *c;
-    	return 0;
-  	}
+    if((c >= 0xe0) && (c <= 0xef))
+    {
+        return 3;
+    }
 
-  	if(pCtx->storedUngetChar)
-  	{
-    	*c = pCtx->storedUngetChar;
-    	pCtx->storedUngetChar = 0;
-    	return 0;
-  	}
+    if((c >= 0xf0) && (c <= 0xf4))
+    {
+        return 4;
+    }
 
- 	rc = cmdParserRead(pCtx, c, 1);
-	if (1 == rc)
-  	{
-    	return 0;
-  	}
+    return 0;
+}
 
-  	if(0 == rc)
-  	{
-    	CMD_PARSER_ERR(pCtx, "INPUT closed\n");
-  	}
-  	else
-  	{
-    	assert(rc < 0);
+// decode the UTF-8 char at 'p' (an invalid byte counts as one char)
+static unsigned int cmdParserUtf8Decode(const unsigned char *p, const unsigned char *end, unsigned int *cp)
+{
+    unsigned int l = cmdParserUtf8Len(*p);
+    unsigned int i;
 
-    	if(EAGAIN != errno)
-    	{
-      		CMD_PARSER_ERR(pCtx, "Error '%s' (%d) on read()\n", strerror(errno), errno);
-    	}
-  	}
+    if(!l || (l > (unsigned)(end - p)))
+    {
+        *cp = *p;
+        return 1;
+    }
 
-  	return -1;
-}
+    *cp = (1 == l) ? *p : (*p & (0x7f >> l));
+    for(i = 1; i < l; i++)
+    {
+        if(0x80 != (p[i] & 0xc0))
+        {
+            *cp = *p;
+            return 1;
+        }
 
+        *cp = (*cp << 6) | (p[i] & 0x3f);
+    }
 
-//Get a character
-static int cmdParserGetChar(cmdParserInstance_t *pCtx, unsigned char *c)
-{
-	*c = 0;
-	return cmdParserGetUngetChar(pCtx, c);	
+    return l;
 }
 
-
-//Put a character back into the input stream
-static int cmdParserUngetChar(cmdParserInstance_t *pCtx, unsigned char *c)
+// number of columns taken by a span of chars
+static unsigned int cmdParserSpanWidth(cmdParserInstance_t *pCtx, const unsigned char *p, unsigned int len)
 {
-	return cmdParserGetUngetChar(pCtx, c);	
-}
+    const unsigned char *end = p + len;
+    unsigned int         cp;
+    unsigned int         w = 0;
 
+    if(!(pCtx->user.utf8))
+    {
+        return len;
+    }
 
-//
-static int cmdParserBeep(cmdParserInstance_t *pCtx)
-{
-	unsigned char c = 0x7;
-	int           rc;
+    while(p < end)
+    {
+        // ASCII chars take one column
+        if(*p < 0x80)
+        {
+            w++;
+            p++;
+            continue;
+        }
 
-  	rc = cmdParserWrite(pCtx, &c, 1);
-  	if(rc < 0)
-  	{
-    	return -1;
-  	}
+        p += cmdParserUtf8Decode(p, end, &cp);
+        w += cmdParserCpWidth(cp);
+    }
 
-  	return 0;
+    return w;
 }
 
+// chars of the command line from a position up to the gap or the end of line
+static const unsigned char *cmdParserLinePtr(cmdParserInstance_t *pCtx, unsigned int pos, unsigned int *len)
+{
+    if(pos < pCtx->gapPos)
+    {
+        *len = pCtx->gapPos - pos;
+        return pCtx->cmd + pos;
+    }
+
+    *len = pCtx->lineSz - pos;
+    return pCtx->cmd + pos + pCtx->cmdSz - pCtx->lineSz;
+}
 
-//check if cmd is empty or not
-static int cmdParserIsEmpty(unsigned char *cmd)
+// number of columns taken by a part of the command line
+static unsigned int cmdParserLineWidth(cmdParserInstance_t *pCtx, unsigned int from, unsigned int len)
 {
-	unsigned char *p;
+    const unsigned char *p;
+    unsigned int         l;
+    unsigned int         w = 0;
 
-  	assert(cmd);
+    if(!(pCtx->user.utf8))
+    {
+        return len;
+    }
 
-  	p = cmd;
-  	while(*p && *p != '\n')
-  	{
-    	if(!CMD_IS_BLANK(*p))
-    	{
-     		return 0;
-    	}
+    // A char is never split by the gap
+    while(len)
+    {
+        p = cmdParserLinePtr(pCtx, from, &l);
+        if(l > len)
+        {
+            l = len;
+        }
 
-    	p++;
-  	}
+        w += cmdParserSpanWidth(pCtx, p, l);
+        from += l;
+        len -= l;
+    }
 
- 	return 1;
+    return w;
 }
 
-// history cmds is a table in a circular way
-// need to consider two cases
-// case1: history table is not full(sz < len)
-//            +-------------------------------------------+
-//            | X | X | X | X | X | X | X |   |   |   |   |
-//            +-------------------------------------------+
-//                    ^                   ^
-//                    |                   |
-//                   cur                insert
-//
-//     		oldest record = histo[0]
-//     		newest record = histo[insert - 1]
-//        	0 <= cur < insert
-//
-//
-// case2: The history table is full (sz = len)
-//            +-------------------------------------------+
-//            | X | X | X | X | X | X | X | X | X | X | X |
-//            +-------------------------------------------+
-//                    ^                   ^
-//                    |                   |
-//                   cur                insert
-//
-//			oldest record = histo[insert]
-//			newest record = histo[insert - 1]
-//			-(len - insert) <= cur < insert
-//
-//
-//  Actually, the previous two cases can be generalized as followed:
-//
-//     -(sz - insert) <= cur < insert
-//
-//
-//     In case 1, sz = insert, so:
-//
-//        -(sz - insert) <= cur < insert
-//  <==>  -(insert - insert) <= cur < insert
-//  <==>  0 <= cur < insert
-//
-//
-//     In case 2, sz = len:
-//
-//        -(sz - insert) <= cur < insert
-//  <==>  -(len - insert) <= cur < insert
-//
-//
-// UP operation (assuming sz > 0):
-//       if (cur > -(sz - insert))
-//         cur = cur - 1
-//       if (cur < 0)
-//         display histo[sz + cur]
-//       else
-//         display histo[cur]
-//
-// DOWN operation (assuming sz > 0):
-//       if (cur < (insert - 1))
-//         cur = cur + 1
-//       if (cur < 0)
-//         display histo[sz + cur]
-//       else
-//         display histo[cur]
-//
-//
-// Insert operation:
-//
-//  histo[insert] = new record
-//  insert = (insert + 1) % len
+// check if a char begins at 'p' (and not a combining char which belongs to
+// the previous one)
+static int cmdParserIsCharStart(cmdParserInstance_t *pCtx, const unsigned char *p, const unsigned char *end)
+{
+    unsigned int cp;
 
+    if(!(pCtx->user.utf8) || (p >= end) || (*p < 0x80))
+    {
+        return 1;
+    }
 
-//go upward in history cmds
-static int cmdParserHistoryUp(cmdParserInstance_t *pCtx, const unsigned char **cmd)
+    if(0x80 == (*p & 0xc0))
+    {
+        return 0;
+    }
+
+    cmdParserUtf8Decode(p, end, &cp);
+
+    return (0 != cmdParserCpWidth(cp));
+}
+
+// check if a char of the command line begins at a position
+static int cmdParserIsLineCharStart(cmdParserInstance_t *pCtx, unsigned int pos)
 {
-    int i;
+    const unsigned char *p;
+    unsigned int         l;
 
-	*cmd = NULL;
+    if(pos >= pCtx->lineSz)
+    {
+        return 1;
+    }
 
-  	if(!(pCtx->historySz))
-  	{
-    	return 2;
-  	}
+    p = cmdParserLinePtr(pCtx, pos, &l);
 
-  	if(pCtx->historyCur > (-((signed)(pCtx->historySz) - (signed)(pCtx->historyInsert))))
-  	{
-    	pCtx->historyCur = pCtx->historyCur - 1;
-  	}
-  	else
-  	{
-    	return 1;
-  	}
+    return cmdParserIsCharStart(pCtx, p, p + l);
+}
 
-  	if(pCtx->historyCur < 0)
-  	{
-    	i = pCtx->historySz + pCtx->historyCur;
-  	}
-  	else
-  	{
-    	i = pCtx->historyCur;
-  	}
+// number of bytes of the char of the command line located at a position
+static unsigned int cmdParserNextLen(cmdParserInstance_t *pCtx, unsigned int pos)
+{
+    unsigned int l = 0;
 
-  	// Point on the UP entry in the history
-  	*cmd = pCtx->history + (i * pCtx->user.lineLen);
+    do
+    {
+        l++;
+    } while(((pos + l) < pCtx->lineSz) && !cmdParserIsLineCharStart(pCtx, pos + l));
 
-	return 0;
+    return ((pos + l) <= pCtx->lineSz) ? l : 0;
 }
 
-//go downward in history cmds
-static int cmdParserHistoryDown(cmdParserInstance_t *pCtx, const unsigned char **cmd)
+// number of bytes of the char of the command line located before a position
+static unsigned int cmdParserPrevLen(cmdParserInstance_t *pCtx, unsigned int pos)
 {
-	int   i;
+    unsigned int l = 0;
 
-  	*cmd = NULL;
+    while(l < pos)
+    {
+        l++;
+        if(cmdParserIsLineCharStart(pCtx, pos - l))
+        {
+            break;
+        }
+    }
 
-  	if(!(pCtx->historySz))
-  	{
-    	return 2;
-  	}
+    return l;
+}
 
-  	if(pCtx->historyCur < ((signed)(pCtx->historyInsert) - 1))
-  	{
-    	pCtx->historyCur = pCtx->historyCur + 1;
-  	}
-  	else
-  	{
-    	pCtx->historyCur = pCtx->historyInsert;
-    	return 1;
-  	}
 
+// UTF-8 encoding of the iso_8859-1 chars out of the ASCII set (cf. man iso_8859-1)
+#define CMD_PARSER_LATIN1(c)      { ((c) >= 0xc0) ? 0xc3 : 0xc2, ((c) >= 0xc0) ? (c) - 0x40 : (c) }
+#define CMD_PARSER_LATIN1_8(c)    CMD_PARSER_LATIN1(c),     CMD_PARSER_LATIN1(c + 1), \
+                                  CMD_PARSER_LATIN1(c + 2), CMD_PARSER_LATIN1(c + 3), \
+                                  CMD_PARSER_LATIN1(c + 4), CMD_PARSER_LATIN1(c + 5), \
+                                  CMD_PARSER_LATIN1(c + 6), CMD_PARSER_LATIN1(c + 7)
 
-  	if(pCtx->historyCur < 0)
-  	{
-    	i = pCtx->historySz + pCtx->historyCur;
-  	}
-  	else
-  	{
-    	i = pCtx->historyCur;
-  	}
+static const unsigned char cmdParserLatin1[128][2] =
+{
+  CMD_PARSER_LATIN1_8(0x80), CMD_PARSER_LATIN1_8(0x88), CMD_PARSER_LATIN1_8(0x90), CMD_PARSER_LATIN1_8(0x98),
+  CMD_PARSER_LATIN1_8(0xa0), CMD_PARSER_LATIN1_8(0xa8), CMD_PARSER_LATIN1_8(0xb0), CMD_PARSER_LATIN1_8(0xb8),
+  CMD_PARSER_LATIN1_8(0xc0), CMD_PARSER_LATIN1_8(0xc8), CMD_PARSER_LATIN1_8(0xd0), CMD_PARSER_LATIN1_8(0xd8),
+  CMD_PARSER_LATIN1_8(0xe0), CMD_PARSER_LATIN1_8(0xe8), CMD_PARSER_LATIN1_8(0xf0), CMD_PARSER_LATIN1_8(0xf8)
+};
 
-  	// Point on the DOWN entry in the history
-  	*cmd = pCtx->history + (i * pCtx->user.lineLen);
+// end of the run of ASCII chars starting at 'p' (checked 8 at a time)
+static const unsigned char *cmdParserAsciiRun(const unsigned char *p, const unsigned char *end)
+{
+    uint64_t w;
 
-  	return 0;
+    while((end - p) >= (int)sizeof(w))
+    {
+        memcpy(&w, p, sizeof(w));
+        if(w & CMD_PARSER_NON_ASCII_MASK)
+        {
+            break;
+        }
+
+        p += sizeof(w);
+    }
+
+    while((p < end) && (*p <= 0x7f))
+    {
+        p++;
+    }
+
+    return p;
 }
 
-//get the oldest record cmd
-static const unsigned char *cmdParserHistoryOldest(cmdParserInstance_t *pCtx)
+// display a span of chars of the command line in UTF-8
+static int cmdParserEchoSpan(cmdParserInstance_t *pCtx, const unsigned char *p, unsigned int len)
 {
-	int   oldest;
+    const unsigned char *end = p + len;
+    const unsigned char *q;
+    unsigned int         room;
 
-  	if(0 == pCtx->historySz)
-  	{
-    	assert(0 == pCtx->historyInsert);
-    	return NULL;
-  	}
+    // The line is already encoded in UTF-8
+    if(pCtx->user.utf8)
+    {
+        return (cmdParserWrite(pCtx, p, len) < 0) ? -1 : 0;
+    }
 
-  	// Index of the oldest record
-  	oldest = -((signed)(pCtx->historySz) - pCtx->historyInsert);
+    while(p < end)
+    {
+        // Make room for at least one encoded char
+        if(((pCtx->outBufSz - pCtx->outLen) < 2) && (0 != cmdParserFlushOut(pCtx)))
+        {
+            return -1;
+        }
 
-  	// Update the current index with the relative value
-  	pCtx->historyCur = oldest;
+        room = pCtx->outBufSz - pCtx->outLen;
 
-  	if(oldest < 0)
-  	{
-    	oldest += pCtx->historySz;
-  	}
+        // Copy the run of ASCII chars
+        q = cmdParserAsciiRun(p, ((unsigned)(end - p) > room) ? p + room : end);
+        if(q != p)
+        {
+            memcpy(pCtx->outBuf + pCtx->outLen, p, q - p);
+            pCtx->outLen += q - p;
+            p = q;
+            continue;
+        }
 
-  	// Command in the oldest record
-  	return (const unsigned char *)(pCtx->history + (oldest * pCtx->user.lineLen));	
-}
+        // Char out of ASCII set
+        memcpy(pCtx->outBuf + pCtx->outLen, cmdParserLatin1[*p - 0x80], 2);
+        pCtx->outLen += 2;
+        p++;
+    }
 
+    return 0;
+}
 
-//get the newest cmd
-static const unsigned char *cmdParserHistoryNewest(cmdParserInstance_t *pCtx)
+// display a part of the command line
+static int cmdParserEchoLine(cmdParserInstance_t *pCtx, unsigned int from, unsigned int len)
 {
-	int   newest;
+    unsigned int l = 0;
 
-  	if(0 == pCtx->historySz)
-  	{
-    	assert(0 == pCtx->historyInsert);
-    	return NULL;
-  	}
+    // Part before the gap
+    if(from < pCtx->gapPos)
+    {
+        l = ((from + len) <= pCtx->gapPos) ? len : pCtx->gapPos - from;
+        if(0 != cmdParserEchoSpan(pCtx, pCtx->cmd + from, l))
+        {
+            return -1;
+        }
+    }
 
-  	// Index of the newest record = index of the record just before
-  	// the insertion point
-  	newest = pCtx->historyInsert - 1;
+    // Part after the gap
+    from += l;
+    return cmdParserEchoSpan(pCtx, pCtx->cmd + from + pCtx->cmdSz - pCtx->lineSz, len - l);
+}
 
-  	// Update the current index with the relative value
-  	pCtx->historyCur = newest;
 
-  	if(newest < 0)
-  	{
-    	newest += pCtx->historySz;
-  	}
+// number of bytes to display a part of the command line (the count stops
+// as soon as it is greater than 'max')
+static unsigned int cmdParserEchoLen(cmdParserInstance_t *pCtx, unsigned int from, unsigned int len, unsigned int max)
+{
+    unsigned int l = 0;
+    unsigned int i;
 
-  	// Command line in the newest record
-  	return (const unsigned char *)(pCtx->history + (newest * pCtx->user.lineLen));
+    if(pCtx->user.utf8)
+    {
+        return len;
+    }
+
+    for(i = from; (i < from + len) && (l <= max); i++)
+    {
+        l += (CMD_PARSER_CHAR(pCtx, i) > 0x7f) ? 2 : 1;
+    }
+
+    return l;
 }
 
-//add cmd into history table
-static void cmdParserHistoryAdd(cmdParserInstance_t *pCtx)
+// move the cursor of the terminal back to the current position (which
+// is 'n' columns on its left) with the shortest sequence
+static int cmdParserEchoBack(cmdParserInstance_t *pCtx, unsigned int n)
 {
-	unsigned char *p;
-
-  	// We don't add the command line if the history is not activated
-  	if(!(pCtx->historyOn))
-  	{
-    	return;
-  	}
+    static const unsigned char backspaces[] = "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b";
+    unsigned int               col;
+    unsigned int               l;
+    int                        rc;
 
-  	// We don't add the command line in the history if it is empty
-  	if(cmdParserIsEmpty(pCtx->cmd))
-  	{
-    	return;
-  	}
+    if(!n)
+    {
+        return 0;
+    }
 
-  	// We don't add the command line in the history if it is the same as
-  	// the newest one
-  	if(pCtx->historySz && !strcmp((const char *)cmdParserHistoryNewest(pCtx), (const char *)(pCtx->cmd)))
-  	{
-    	return;
-  	}
+    if(!(pCtx->user.dumbTerminal))
+    {
+        // Go to column 0 and forward if the prompt width is known
+        if(pCtx->promptWidth >= 0)
+        {
+            col = pCtx->promptWidth + pCtx->cursorCol;
+            l = 1 + (col ? cmdParserCsiLen(col, 'C') : 0);
+            if((l < n) && (l < cmdParserCsiLen(n, 'D')))
+            {
+                if(1 != cmdParserWrite(pCtx, "\r", 1))
+                {
+                    return -1;
+                }
 
-  	// Point on the insertion slot
-  	p = pCtx->history + pCtx->user.lineLen * pCtx->historyInsert;
+                rc = col ? cmdParserWriteCsi(pCtx, col, 'C') : 0;
+                return (rc < 0) ? -1 : 0;
+            }
+        }
 
-  	// Copy the command in the history
-  	strncpy((char *)p, (char *)(pCtx->cmd), pCtx->user.lineLen);
-  	p[pCtx->user.lineLen - 1] = '\0';
+        if(cmdParserCsiLen(n, 'D') < n)
+        {
+            rc = cmdParserWriteCsi(pCtx, n, 'D');
+            return (rc < 0) ? -1 : 0;
+        }
+    }
 
-  	// Increment the insertion index
-  	pCtx->historyInsert = (pCtx->historyInsert + 1) % pCtx->user.historyLen;
+    // One backspace per column
+    for(; n; n -= rc)
+    {
+        rc = cmdParserWrite(pCtx, backspaces, (n < sizeof(backspaces) - 1) ? n : sizeof(backspaces) - 1);
+        if(rc < 0)
+        {
+            return -1;
+        }
+    }
 
-  	// Increment the number of recorded lines
-  	if(pCtx->historySz < pCtx->user.historyLen)
-  	{
-    	pCtx->historySz++;
-  	}
-  	else
-  	{
-    	assert(pCtx->historySz == pCtx->user.historyLen);
-  	}
+    return 0;
 }
 
 
-// reset cmd hsitory table
-static void cmdParserHistoryReset(cmdParserInstance_t *pCtx)
+// move curosr
+static int cmdParserMoveCursor(cmdParserInstance_t *pCtx, int offset, int where)
 {
-	// Reset the current index to the insertion index
-	pCtx->historyCur = pCtx->historyInsert;
-}
+    unsigned int w;
+    int          rc;
 
+    // calculate offset from current cursor position
+    switch(where)
+    {
+        case CMD_PARSER_MOVE_SET:
+        {
+            if(offset < 0)
+            {
+                offset = 0;
+            }
+            offset = -(pCtx->cursor - offset);
+        }
+        break;
 
-// list history cmds
-void cmdParserHistoryList(cmdParser_t *pInst, void (* list)(unsigned char *item, unsigned int index))
-{
-	cmdParserInstance_t  *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
-	const unsigned char *p;
-	unsigned int         idx, i;
-	int                  rc;
+        case CMD_PARSER_MOVE_CUR:
+        {
+            // nothing to do
+        }
+        break;
 
-  	errno = 0;
+        case CMD_PARSER_MOVE_END:
+        {
+            assert(pCtx->lineSz >= (unsigned)(pCtx->cursor));
+            offset = pCtx->lineSz - offset - pCtx->cursor;
+        }
+        break;
 
-  	if(!pCtx || !list)
-  	{
-    	errno = EINVAL;
-    	return;
-  	}
+        default:
+        {
+            assert(0);
+        }
+    }
 
-  	// If the history is empty
-  	if(0 == pCtx->historySz)
-  	{
-    	list(NULL, (unsigned)-1);
-    	return;
-  	}
+    // forward
+    if(offset > 0)
+    {
+        if((unsigned)(pCtx->cursor + offset) >= pCtx->lineSz)
+        {
+            assert((unsigned)(pCtx->cursor) <= pCtx->lineSz);
+            offset = pCtx->lineSz - pCtx->cursor;
+        }
+
+        w = cmdParserLineWidth(pCtx, pCtx->cursor, offset);
+
+        if(pCtx->echoOn)
+        {
+            unsigned int l1;
+
+            // Move over the chars with a control sequence if it is shorter
+            // than displaying them again
+            l1 = cmdParserCsiLen(w, 'C');
+            if(!w)
+            {
+                rc = 0;
+            }
+            else if(!(pCtx->user.dumbTerminal) && (l1 < cmdParserEchoLen(pCtx, pCtx->cursor, offset, l1)))
+            {
+                rc = cmdParserWriteCsi(pCtx, w, 'C');
+            }
+            else
+            {
+                rc = cmdParserEchoLine(pCtx, pCtx->cursor, offset);
+            }
+
+            if(rc < 0)
+            {
+                return -1;
+            }
+        }
+
+		pCtx->cursor += offset;
+		pCtx->cursorCol += w;
+
+		return 0;
+    }
 
-  	// Point on the oldest item
-  	p = cmdParserHistoryOldest(pCtx);
-  	i = 0;
-  	while(i < pCtx->historySz)
+	// backward
+  	if(offset < 0)
   	{
-    	idx = (p - pCtx->history) / pCtx->user.lineLen;
-    	if(p)
-   		{
-      		strcpy((char *)(pCtx->cmd), (const char *)p);
+   		// If we try to go below the beginning of line, adjust to begining of line
+    	if((pCtx->cursor + offset) < 0)
+    	{
+      		offset = -(pCtx->cursor);
     	}
-    	list(pCtx->cmd, idx);
-    	rc = cmdParserHistoryDown(pCtx, &p);
-		if(0 != rc)
-		{
-			// do nothing
-		}
-    	i++;
+
+    	w = cmdParserLineWidth(pCtx, pCtx->cursor + offset, -offset);
+    	pCtx->cursor += offset;
+    	pCtx->cursorCol -= w;
+
+    	if(pCtx->echoOn)
+    	{
+      		return cmdParserEchoBack(pCtx, w);
+    	} 
+
+    	return 0;
   	}
 
-  	list(NULL, -1);
+	// no need to move cursor
+	return 0;
 }
 
-//get history cmd
-unsigned char *cmdParserHistoryGet(cmdParser_t *pInst, unsigned int idx)
+
+// erase the end of the line from the cursor position ('l' columns on a dumb
+// terminal)
+static int cmdParserEchoBlanks(cmdParserInstance_t *pCtx, unsigned int l)
 {
-    cmdParserInstance_t  *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
-	unsigned char      *p;
+	static const unsigned char blanks[] = "                ";
+	unsigned int  l1;
+	int           rc;
 
-  	if(!pCtx)
+  	if(!(pCtx->echoOn))
   	{
-    	errno = EINVAL;
-    	return NULL;
+    	return 0;
   	}
 
-  	// Validate the index
-  	if(idx > pCtx->historySz)
+  	// Erase to end of line
+  	if(!(pCtx->user.dumbTerminal))
   	{
-    	errno = EINVAL;
-    	return NULL;
+    	rc = cmdParserWriteCsi(pCtx, 0, 'K');
+    	return (rc < 0) ? -1 : 0;
   	}
 
-  	// If the history is empty
-  	if(0 == pCtx->historySz)
+  	for(l1 = l; l1; l1 -= rc)
   	{
-    	errno = ENOENT;
-    	return NULL;
+    	rc = cmdParserWrite(pCtx, blanks, (l1 < sizeof(blanks) - 1) ? l1 : sizeof(blanks) - 1);
+    	if(rc < 0)
+    	{
+      		return -1;
+    	}
   	}
 
-  	// The index is the real index of the item in the history table
-  	// We must make sure that it is not out of bounds
+  	return cmdParserEchoBack(pCtx, l);
+}
 
-  	// If 'idx' is little than 'insert', it is valid
-  	// If 'idx' is equal to 'insert', it is valid only if the history
-  	// wrapped
-  	// If 'idx' is greater than 'insert', it must be little than 'sz'
-  	if(((idx == pCtx->historyInsert) && (pCtx->historySz != pCtx->user.historyLen)) ||
-      (idx >= pCtx->historySz))
-  	{
-    	errno = ENOENT;
-    	return NULL;
-  	}
 
-  	p = pCtx->history + (idx * pCtx->user.lineLen);
+// remove characters from currect position to end of line
+static int cmdParserTruncate(cmdParserInstance_t *pCtx)
+{
+	unsigned int l, w;
 
-  	strcpy((char *)(pCtx->cmd), (const char *)p);
+  	if((unsigned)(pCtx->cursor) < pCtx->lineSz)
+  	{
+    	l = pCtx->lineSz - pCtx->cursor;
+    	w = cmdParserLineWidth(pCtx, pCtx->cursor, l);
 
- 	// Update the size of the command line
-  	pCtx->lineSz = strlen((char *)(pCtx->cmd));
+    	// Drop the end of the line
+    	cmdParserGapMove(pCtx, pCtx->cursor);
+    	pCtx->lineSz -= l;
+    	if(pCtx->shownSz > pCtx->lineSz)
+    	{
+      		pCtx->shownSz = pCtx->lineSz;
+    	}
 
-  	return pCtx->cmd;
-}
+    	// Erase it on the screen
+    	return cmdParserEchoBlanks(pCtx, w);
+  	}
 
-//reset cmd
-static void cmdParserResetLine(cmdParserInstance_t *pCtx)
-{
-	pCtx->lineSz = 0;
-	pCtx->cursor = 0;
-	pCtx->cmd[0] = '\0';
+  	return 0;
 }
 
-//get ctl mgs
-static int cmdParserGetCtrlMsg(cmdParserInstance_t *pCtx)
-{
-	unsigned int  i;
-	int           rc;
-	unsigned char c, len;
-
-  	assert(0 == pCtx->lineSz);
-
-  	pCtx->cmd[0] = CMD_PARSER_CTRL_MSG;
-  	pCtx->lineSz ++;
-
-  	// Get the size of the message
-  	rc = cmdParserGetChar(pCtx, &len);
-  	if(0 != rc)
-  	{
-    	return -1;
-  	}
-
-  	// Check that we don't overflow the buffer
-  	if(len > (pCtx->user.lineLen - 2))
-  	{
-    	CMD_PARSER_ERR(pCtx, "Control message too long: %u (max is %u)\n", len, pCtx->user.lineLen);
-    	return -1;
-  	}
 
-  	pCtx->cmd[1] = len;
-  	pCtx->lineSz ++;
+// shift the part of the cmd located the right side of the cursor
+//   direction > 0 : a char has just been inserted before the cursor
+//   direction < 0 : the char under the cursor is removed
+static int cmdParserShiftLine(cmdParserInstance_t *pCtx, int direction)
+{
+	unsigned int         blank = 0;
+	unsigned int         l, w;
+	int                  rc;
 
-  	// Get the data of the message
-  	for(i = 0; i < len; i ++)
+  	if(direction < 0)
   	{
-    	rc = cmdParserGetChar(pCtx, &c);
-    	if (0 != rc)
+    	if((unsigned)(pCtx->cursor) >= pCtx->lineSz)
     	{
-      		return -1;
+      		return 0;
     	}
 
-    	pCtx->cmd[i + 2] = c;
-    	pCtx->lineSz ++;
-  	} 
-
- 	return 0;
-}
+    	// Remove the first char after the gap
+    	l = cmdParserNextLen(pCtx, pCtx->cursor);
+    	w = cmdParserLineWidth(pCtx, pCtx->cursor, l);
+    	cmdParserGapMove(pCtx, pCtx->cursor);
+    	pCtx->lineSz -= l;
 
+    	// The terminal shifts the right side of the line by itself
+    	if(!(pCtx->user.dumbTerminal))
+    	{
+      		if(pCtx->echoOn)
+      		{
+        		if(w && (cmdParserWriteCsi(pCtx, w, 'P') < 0))
+        		{
+          			return -1;
+        		}
 
-// get a character into cmd
-#define	CMD_PARSER_ACCEPT_CHAR(p, c)		_cmdParserAcceptChar((p), (c), __LINE__)
-static int _cmdParserAcceptChar(cmdParserInstance_t *pCtx, const unsigned char c, int lineno)
-{
-	int rc;
+        		pCtx->shownSz = pCtx->lineSz;
+      		}
 
-	//printf("\n%d#Accepting <0x%x, %c>\n", lineno, c, c);
-	(void)lineno;
+      		return 0;
+    	}
 
-  	// We don't use isprint() to check if it is a printable char otherwise,
-  	// latin chars with accent which are greater than 128 (ASCII set) would
-  	// not be printed
-  	if(((unsigned)(pCtx->lineSz) < pCtx->user.lineLen))
-	{
-    	assert((unsigned)(pCtx->cursor) <= pCtx->lineSz);
+    	// Put white spaces after the last char of the line to erase it
+    	// at display time
+    	blank = w;
+  	}
+  	else
+  	{
+    	// The inserted char is just before the gap
+    	assert(pCtx->gapPos == (unsigned)(pCtx->cursor));
+  	}
 
-    	// Make room in the line if necessary
-    	if((unsigned)(pCtx->cursor) < pCtx->lineSz)
-    	{
-      		cmdParserShiftLine(pCtx, 1);
-      		pCtx->cmd[pCtx->cursor] = c;
-      		pCtx->cursor++;
-    	}
-    	else
+  	// Echo
+  	if(pCtx->echoOn)
+  	{
+    	rc = cmdParserEchoSpan(pCtx, CMD_PARSER_TAIL(pCtx), pCtx->lineSz - pCtx->cursor);
+    	if(rc < 0)
     	{
-      		pCtx->cmd[pCtx->cursor] = c;
-      		pCtx->cursor ++;
-      		pCtx->lineSz ++;
-      		pCtx->cmd[pCtx->lineSz] = '\0';
+      		return -1;
     	}
 
-    	//printf("<0x%x>\n", c);
-
-    	// Echo if activated
-    	if(pCtx->echoOn)
+    	for(w = 0; w < blank; w++)
     	{
-    		unsigned int l1;
-    		unsigned char buf[2];
-
-      		// If accented character (cf. man iso_8859-1)
-      		if(c > 0x7f)
-      		{
-        		if(c >= 0xc0)
-        		{
-          			buf[0] = 0xc3;
-          			buf[1] = c - 0x40;
-        		}
-        		else
-        		{
-          			buf[0] = 0xc2;
-          			buf[1] = c;
-        		}
-        		l1 = 2;
-      		}
-      		else
-      		{
-        		buf[0] = c;
-        		l1 = 1;
-      		}
-      		rc = cmdParserWrite(pCtx, buf, l1);
-      		if(l1 != (unsigned)rc)
+      		rc = cmdParserWrite(pCtx, " ", 1);
+      		if(1 != rc)
       		{
         		return -1;
       		}
     	}
-  	}
-  	else
-  	{
-    	cmdParserBeep(pCtx);
+
+    	pCtx->shownSz = pCtx->lineSz;
+
+    	// Move back the cursor to its current position
+    	w = cmdParserLineWidth(pCtx, pCtx->cursor, pCtx->lineSz - pCtx->cursor);
+    	return cmdParserEchoBack(pCtx, w + blank);
   	}
 
   	return 0;
 }
 
-//Replace current display cmd by a new one and setting cursor at a given position
-static void cmdParserReplaceLine(cmdParserInstance_t *pCtx, const unsigned char *newCmd, unsigned char newCursor)
+
+// refill the input ring with as many chars as available in one read()
+static int cmdParserFill(cmdParserInstance_t *pCtx)
 {
-	unsigned int  l_old, l_new, l1;
-	unsigned int  i;
-	unsigned char c[2];
+    int rc;
 
-  	// Copy the new command in the command line buffer
-  	if (newCmd)
-  	{
-    	strncpy((char *)(pCtx->cmd), (const char *)newCmd, pCtx->user.lineLen);
-    	pCtx->cmd[pCtx->user.lineLen - 1] = '\0';
-  	}
+    assert(0 == pCtx->inCount);
 
-  	// Store the length of the current command line
-  	l_old = pCtx->lineSz;
+    // Display the pending output before waiting for input
+    cmdParserFlushOut(pCtx);
 
-  	// Move the cursor back to column 0
-  	cmdParserMoveCursor(pCtx, 0, CMD_PARSER_MOVE_SET);
+    // The ring is empty: restart at its beginning to read in one shot
+    pCtx->inHead = 0;
 
-  	// Update the length of the new line
-  	l_new = strlen((char *)(pCtx->cmd));
+    for(;;)
+    {
+        pCtx->stats.inReads++;
+        rc = cmdParserRead(pCtx, pCtx->inBuf, pCtx->inBufSz);
+        if(rc <= 0)
+        {
+            break;
+        }
+        pCtx->stats.inBytes += rc;
 
-  	// Display the new command 
-  	for(i = 0; i < l_new; i ++)
-  	{
-    	c[0] = pCtx->cmd[i];
+        // Only the data of the telnet protocol go to the state machine
+        if(pCtx->user.telnet)
+        {
+            rc = cmdParserTelnetIn(pCtx, pCtx->inBuf, rc);
+            if(!rc)
+            {
+                // Answer the negotiations before waiting for more
+                cmdParserFlushOut(pCtx);
+                continue;
+            }
+        }
 
-    	// If accented character (cf. man iso_8859-1)
-    	if(c[0] > 0x7f)
-    	{
-      		if(c[0] >= 0xc0)
-      		{
-        		c[1] = c[0] - 0x40;
-        		c[0] = 0xc3;
-      		}
-      		else
-      		{
-        		c[1] = c[0];
-        		c[0] = 0xc2;
-      		}
-      		l1 = 2;
-    	}
-    	else
-    	{
-      		l1 = 1;
-    	}
+        pCtx->inCount = rc;
+        return 0;
+    }
 
-    	cmdParserWrite(pCtx, c, l1);
-  	}
+    if(0 == rc)
+    {
+        CMD_PARSER_ERR(pCtx, "INPUT closed\n");
+    }
+    else
+    {
+        assert(rc < 0);
 
-  	// Update the cursor position
-  	pCtx->cursor = l_new;
+        if(EAGAIN != errno)
+        {
+            CMD_PARSER_ERR(pCtx, "Error '%s' (%d) on read()\n", strerror(errno), errno);
+        }
+    }
 
-  	// If the previous line was longer than the current one
-  	if(l_new < l_old)
-  	{
-    	// Make believe that the line was 'l_old' long to be able to truncate it
-    	pCtx->lineSz = l_old;
+    return -1;
+}
 
-    	// Erase the remaining chars from the previous command line if any (from current
-    	// cursor position (which is end of new line)
-    	cmdParserTruncate(pCtx);
 
-    	// pCtx->lineSz has been updated
-  	}
-  	else
-  	{
-    	// Set the size of the line
-    	pCtx->lineSz = l_new;
-  	}
+//Get a character
+static int cmdParserGetChar(cmdParserInstance_t *pCtx, unsigned char *c)
+{
+    *c = 0;
 
-  	// Put the cursor at the requested position
-  	cmdParserMoveCursor(pCtx, newCursor, CMD_PARSER_MOVE_SET);
+    if(!(pCtx->inCount) && (0 != cmdParserFill(pCtx)))
+    {
+        return -1;
+    }
+
+    *c = pCtx->inBuf[pCtx->inHead];
+    pCtx->inHead = (pCtx->inHead + 1) % pCtx->inBufSz;
+    pCtx->inCount--;
+
+    return 0;
 }
 
 
-// manage a function key
-static void cmdParserHandleFk(cmdParserInstance_t *pCtx, unsigned int fn)
+//Put a character back into the input stream
+static int cmdParserUngetChar(cmdParserInstance_t *pCtx, unsigned char *c)
 {
-	unsigned int           cursor;
-	const unsigned char   *p;
+    // A char is only put back after it has been got, so there is room
+    if(pCtx->inCount >= pCtx->inBufSz)
+    {
+        CMD_PARSER_ERR(pCtx, "Input ring full, char 0x%x lost\n", *c);
+        errno = ENOSPC;
+        return -1;
+    }
 
-  	if(pCtx->functionKey)
-  	{
-    	cursor = pCtx->cursor;
-    	p = pCtx->functionKey((void *)&(pCtx->user.ctx), fn, pCtx->cmd, &cursor);
+    pCtx->inHead = (pCtx->inHead + pCtx->inBufSz - 1) % pCtx->inBufSz;
+    pCtx->inBuf[pCtx->inHead] = *c;
+    pCtx->inCount++;
 
-    	// The preceding function may have displayed anything
-    	// and so, we don't know the current cursor position.
-    	// Hence, we reset the cursor position to 0 because the
-    	// caller is supposed to display the prompt if any and
-    	// then let us display the new command line if any
-    	pCtx->cursor = 0;
+    return 0;
+}
 
-    	cmdParserReplaceLine(pCtx, p, cursor);
-  	}
+
+//check if the next buffered char can be accepted as is in the command line
+static int cmdParserPeekPrintable(cmdParserInstance_t *pCtx, unsigned char *c)
+{
+    if(!(pCtx->inCount))
+    {
+        return 0;
+    }
+
+    *c = pCtx->inBuf[pCtx->inHead];
+
+    return (*c >= ' ') && (*c < 0x7f);
 }
 
-// action for STATE 0 of FSM
-static int cmdParserState0(cmdParserInstance_t *pCtx)
+
+// get the end of the UTF-8 char beginning with seq[0] (returns its length,
+// 0 if the sequence is invalid or -1 if an error occured; on EAGAIN, the
+// bytes are put back in the input)
+static int cmdParserGetUtf8(cmdParserInstance_t *pCtx, unsigned char *seq)
 {
-  	// Command mngt parameters
-  	pCtx->storedUngetChar  	= 0;
-  	pCtx->cursor           	= 0;
-  	pCtx->lineSz           	= 0;
-  	pCtx->cmd[0]       		= '\0';
-  	pCtx->savedCmd[0] 		= '\0';
+    unsigned int len = cmdParserUtf8Len(seq[0]);
+    unsigned int i;
 
-  	// Reinit the history pointers
-  	cmdParserHistoryReset(pCtx);
+    for(i = 1; i < len; i ++)
+    {
+        if(0 != cmdParserGetChar(pCtx, &seq[i]))
+        {
+            if(EAGAIN == errno)
+            {
+                // Put back the bytes got so far
+                while(i --)
+                {
+                    cmdParserUngetChar(pCtx, &seq[i]);
+                }
+                errno = EAGAIN;
+            }
 
-  	return CMD_PARSER_STATE_1;
+            return -1;
+        }
+
+        // Ignore the truncated, overlong or out of range sequences
+        if((0x80 != (seq[i] & 0xc0)) ||
+           ((1 == i) && (((0xe0 == seq[0]) && (seq[1] < 0xa0)) || ((0xed == seq[0]) && (seq[1] > 0x9f)) ||
+                         ((0xf0 == seq[0]) && (seq[1] < 0x90)) || ((0xf4 == seq[0]) && (seq[1] > 0x8f)))))
+        {
+            cmdParserUngetChar(pCtx, &seq[i]);
+            return 0;
+        }
+    }
+
+    return len;
 }
 
-// actiion for STATE 1 of FSM
-static int cmdParserState1(cmdParserInstance_t *pCtx)
+
+//
+static int cmdParserBeep(cmdParserInstance_t *pCtx)
 {
-	unsigned char  c;
-	unsigned char *p;
-	int            rc;
+	unsigned char c = 0x7;
+	int           rc;
 
-  	rc = cmdParserGetChar(pCtx, &c);
-  	if(0 != rc)
+  	rc = cmdParserWrite(pCtx, &c, 1);
+  	if(rc < 0)
   	{
-    	assert(-1 == rc);
-    	if(EAGAIN == errno)
-    	{
-      		return CMD_PARSER_STATE_1 | CMD_PARSER_STATE_AGAIN;
-    	}
     	return -1;
   	}
 
-  	switch(c)
+  	return 0;
+}
+
+
+//check if cmd is empty or not
+static int cmdParserIsEmpty(const unsigned char *cmd, unsigned int len)
+{
+	const unsigned char *p;
+	const unsigned char *end = cmd + len;
+
+  	assert(cmd);
+
+  	p = cmd;
+  	while((p < end) && (*p != '\n'))
   	{
-    	case '\0' :
+    	if(!CMD_IS_BLANK(*p))
     	{
-      		// For some reasons that I don't understand right now,
-      		// we receive NUL in place of LF
-      	return CMD_PARSER_CURRENT_STATE;
+     		return 0;
     	}
-    	break;
 
-    	case CMD_IN_ASCII_RANGE('A') : // Go to beginning of line
-    	case CMD_IN_ASCII_RANGE('B') : // Go one char backward
-    	case CMD_IN_ASCII_RANGE('F') : // Go one char forward
-    	case CMD_IN_ASCII_RANGE('E') : // Go to end of line
-    	case CMD_IN_ASCII_RANGE('[') : // ESC sequence ?
-    	{
-      		cmdParserUngetChar(pCtx, &c);
-	
-      		// Save command line
-      		strncpy((char *)(pCtx->savedCmd), (char *)(pCtx->cmd), pCtx->user.lineLen);
-      		pCtx->savedCmd[pCtx->user.lineLen - 1] = '\0';
+    	p++;
+  	}
 
-      		return CMD_PARSER_STATE_2;
-    	}
-    	break;
+ 	return 1;
+}
 
-    	case CMD_PARSER_CTRL_MSG :
-    	{
-      		// If there are chars in the command line
-      		if (pCtx->lineSz)
+// history cmds are variable-length records stored in an arena and referenced
+// by an index which is a table in a circular way
+//
+// Index (historyLen slots, twice as many with CMD_PARSER_HISTORY_NO_DUPS):
+//            +-------------------------------------------+
+//            | X | X | X |   |   |   |   | X | X | X | X |
+//            +-------------------------------------------+
+//                        ^                   ^
+//                        |                   |
+//                      insert             oldest = insert - sz
+//
+// Arena (historyBytes): the records are NUL terminated strings stored one
+// after the other. A record which doesn't fit at the end of the arena is
+// stored at its beginning (the end is lost until the arena wraps again).
+//            +-------------------------------------------+
+//            | d\0 | e\0 |         | a\0 | b\0 | c\0 |   |
+//            +-------------------------------------------+
+//                        ^           ^
+//                        |           |
+//                      head        oldest record
+//
+// The oldest records are dropped when the index is full or when the arena
+// has not enough room for a new record.
+//
+// With CMD_PARSER_HISTORY_NO_DUPS, a new command removes its older duplicate
+// found through a hash table of the commands (which knows its slot). The
+// record stays in the index as a tombstone (no hits) that the browsing
+// skips, until it is the oldest one and goes away with its room in the
+// arena. The index has twice as many slots for the tombstones not to crowd
+// out the commands: the history still holds historyLen commands, unless
+// the index is full of tombstones. The oldest and the newest records are
+// never tombstones.
+//
+// The commands are identified by a sequence number increasing with their
+// age (the indexes of the history refer to them by it).
+//
+// The current position in the history is relative to the insertion index:
+//
+//     -(sz - insert) <= cur < insert
+//
+//     and the slot of the entry in the index is cur modulo len
+//
+//
+// UP operation (assuming sz > 0):
+//       if (cur > -(sz - insert))
+//         cur = cur - 1
+//       display histo[cur mod len]
+//
+// DOWN operation (assuming sz > 0):
+//       if (cur < (insert - 1))
+//         cur = cur + 1
+//       display histo[cur mod len]
+//
+//
+// Insert operation:
+//
+//  histo[insert] = new record
+//  insert = (insert + 1) % len
+
+
+// check if a record of the history holds a command (not a tombstone)
+#define CMD_PARSER_HISTORY_LIVE(rec)  (0 != (rec)->hits)
+
+// slot in the history index from a position relative to the insertion index
+static unsigned int cmdParserHistorySlot(cmdParserInstance_t *pCtx, int cur)
+{
+    int len = (int)(pCtx->historySlots);
+
+    return (unsigned int)(((cur % len) + len) % len);
+}
+
+// record of a command of the history from its position (0 = oldest)
+static cmdParserHistoryRec_t *cmdParserHistoryAt(cmdParserInstance_t *pCtx, unsigned int pos)
+{
+    return &(pCtx->historyIdx[cmdParserHistorySlot(pCtx, (int)(pCtx->historyInsert - pCtx->historySz + pos))]);
+}
+
+// number of commands of the history older than a sequence number (the
+// sequence numbers increase from the oldest to the newest command)
+static unsigned int cmdParserHistoryOlder(cmdParserInstance_t *pCtx, unsigned int seq)
+{
+    unsigned int lo = 0;
+    unsigned int hi = pCtx->historySz;
+    unsigned int mid;
+
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(cmdParserHistoryAt(pCtx, mid)->seq < seq)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// make a command of the history the current one
+static cmdParserHistoryRec_t *cmdParserHistoryGoTo(cmdParserInstance_t *pCtx, unsigned int seq)
+{
+    unsigned int pos = cmdParserHistoryOlder(pCtx, seq);
+
+    pCtx->historyCur = (int)(pCtx->historyInsert - pCtx->historySz + pos);
+
+    return cmdParserHistoryAt(pCtx, pos);
+}
+
+// record of a command of the history from its sequence number (NULL if it
+// has been removed)
+static cmdParserHistoryRec_t *cmdParserHistoryFind(cmdParserInstance_t *pCtx, unsigned int seq)
+{
+    unsigned int           pos = cmdParserHistoryOlder(pCtx, seq);
+    cmdParserHistoryRec_t *rec;
+
+    if(pos == pCtx->historySz)
+    {
+        return NULL;
+    }
+
+    rec = cmdParserHistoryAt(pCtx, pos);
+
+    return ((rec->seq == seq) && CMD_PARSER_HISTORY_LIVE(rec)) ? rec : NULL;
+}
+
+// newest command of the history if it is the same as a command (NULL if not)
+static cmdParserHistoryRec_t *cmdParserHistorySame(cmdParserInstance_t *pCtx, const unsigned char *cmd, unsigned int len)
+{
+    cmdParserHistoryRec_t *rec;
+
+    if(0 == pCtx->historySz)
+    {
+        return NULL;
+    }
+
+    rec = cmdParserHistoryAt(pCtx, pCtx->historySz - 1);
+
+    return ((rec->len == len) && !memcmp(pCtx->history + rec->off, cmd, len)) ? rec : NULL;
+}
+
+// Indexes of the history
+//
+// An index is an hash table (open addressing) whose keys refer to the list
+// of the sequence numbers of the commands of the history having them (in
+// ascending order). The lists are only appended: the references to the
+// dropped commands are skipped at search time and the index is rebuilt
+// when they outnumber the live ones.
+//
+//   - trigram index: the keys are the trigrams (3 consecutive bytes) found
+//     in the commands
+//   - prefix index: the keys are the nodes of a trie of the bytes of the
+//     commands (a node lists the commands beginning with its path). A node
+//     gets children only when it lists more than CMD_PARSER_PREFIX_BURST
+//     commands: below, the few commands of the node are scanned
+
+// key of the trigram beginning at 'p' (never 0 which marks a free bucket)
+#define CMD_PARSER_TRIGRAM_KEY(p)     ((uint64_t)(p)[0] | ((uint64_t)(p)[1] << 8) | ((uint64_t)(p)[2] << 16) | ((uint64_t)1 << 24))
+
+// key of the child of a node of the prefix trie (0 = root) for a byte
+// (never 0 which marks a free bucket)
+#define CMD_PARSER_PREFIX_KEY(parent, c)  (((uint64_t)(parent) << 8) | (uint64_t)(c) | ((uint64_t)1 << 40))
+
+// bucket of a key in an index
+static cmdParserPostings_t *cmdParserIndexBucket(cmdParserIndex_t *idx, uint64_t key)
+{
+    uint64_t     h = key;
+    unsigned int i;
+
+    // Mix the bits of the key
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 29;
+
+    i = (unsigned int)h & (idx->sz - 1);
+    while(idx->buckets[i].key && (idx->buckets[i].key != key))
+    {
+        i = (i + 1) & (idx->sz - 1);
+    }
+
+    return &(idx->buckets[i]);
+}
+
+// list of the commands having a key (NULL if none)
+static cmdParserPostings_t *cmdParserIndexFind(cmdParserIndex_t *idx, uint64_t key)
+{
+    cmdParserPostings_t *post;
+
+    if(!(idx->sz))
+    {
+        return NULL;
+    }
+
+    post = cmdParserIndexBucket(idx, key);
+
+    return post->key ? post : NULL;
+}
+
+// number of commands older than 'seq' in a list
+static unsigned int cmdParserIndexBefore(const cmdParserPostings_t *post, unsigned int seq)
+{
+    unsigned int lo = 0;
+    unsigned int hi = post->nb;
+    unsigned int mid;
+
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(post->seq[mid] < seq)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// free an index
+static void cmdParserIndexFree(cmdParserIndex_t *idx)
+{
+    unsigned int i;
+
+    for(i = 0; i < idx->sz; i++)
+    {
+        free(idx->buckets[i].seq);
+    }
+
+    free(idx->buckets);
+    idx->buckets = NULL;
+    idx->sz      = 0;
+    idx->nb      = 0;
+    idx->live    = 0;
+    idx->stale   = 0;
+}
+
+// double the size of the hash table of an index
+static int cmdParserIndexGrow(cmdParserIndex_t *idx)
+{
+    cmdParserPostings_t *old = idx->buckets;
+    unsigned int         oldSz = idx->sz;
+    unsigned int         i;
+
+    idx->sz = oldSz ? (2 * oldSz) : CMD_PARSER_INDEX_BUCKETS;
+    idx->buckets = (cmdParserPostings_t *)calloc(idx->sz, sizeof(cmdParserPostings_t));
+    if(!(idx->buckets))
+    {
+        idx->buckets = old;
+        idx->sz = oldSz;
+        return -1;
+    }
+
+    for(i = 0; i < oldSz; i++)
+    {
+        if(old[i].key)
+        {
+            *cmdParserIndexBucket(idx, old[i].key) = old[i];
+        }
+    }
+
+    free(old);
+
+    return 0;
+}
+
+// add a command to the list of a key (returns 1 if it is added, 0 if it
+// is already there or -1 on error)
+static int cmdParserIndexAppend(cmdParserIndex_t *idx, uint64_t key, unsigned int seq)
+{
+    cmdParserPostings_t *post;
+    unsigned int        *p;
+
+    if(((idx->nb + 1) * 2 > idx->sz) && (0 != cmdParserIndexGrow(idx)))
+    {
+        return -1;
+    }
+
+    post = cmdParserIndexBucket(idx, key);
+    if(!(post->key))
+    {
+        post->key = key;
+        idx->nb++;
+        post->id = idx->nb;
+    }
+
+    // A key may appear several times in the command
+    if(post->nb && (seq == post->seq[post->nb - 1]))
+    {
+        return 0;
+    }
+
+    if(post->nb == post->max)
+    {
+        p = (unsigned int *)realloc(post->seq, (post->max ? (2 * post->max) : 4) * sizeof(unsigned int));
+        if(!p)
+        {
+            return -1;
+        }
+
+        post->seq = p;
+        post->max = post->max ? (2 * post->max) : 4;
+    }
+
+    post->seq[post->nb++] = seq;
+
+    return 1;
+}
+
+// index the trigrams of a command
+static int cmdParserTrigramAdd(cmdParserInstance_t *pCtx, cmdParserIndex_t *idx, cmdParserHistoryRec_t *rec)
+{
+    const unsigned char *cmd = pCtx->history + rec->off;
+    unsigned int         i;
+    int                  rc;
+
+    rec->grams = 0;
+    for(i = 0; (i + 3) <= rec->len; i++)
+    {
+        rc = cmdParserIndexAppend(idx, CMD_PARSER_TRIGRAM_KEY(cmd + i), rec->seq);
+        if(rc < 0)
+        {
+            return -1;
+        }
+
+        rec->grams += rc;
+        idx->live += rc;
+    }
+
+    return 0;
+}
+
+// add a command to the node of its first 'depth' + 1 bytes below the node
+// 'parent' of the prefix trie, and further down while the nodes have
+// children
+static int cmdParserPrefixPut(cmdParserInstance_t *pCtx, cmdParserIndex_t *idx, cmdParserHistoryRec_t *rec, unsigned int parent, unsigned int depth)
+{
+    const unsigned char   *cmd = pCtx->history + rec->off;
+    cmdParserPostings_t   *post;
+    cmdParserHistoryRec_t *r;
+    unsigned int          *list;
+    unsigned int           nb;
+    unsigned int           i;
+    uint64_t               key;
+    int                    rc;
+
+    for(; depth < rec->len; depth++)
+    {
+        key = CMD_PARSER_PREFIX_KEY(parent, cmd[depth]);
+        rc = cmdParserIndexAppend(idx, key, rec->seq);
+        if(rc < 0)
+        {
+            return -1;
+        }
+
+        rec->prefixes += rc;
+        idx->live += rc;
+
+        // The bucket may have moved if the table grew
+        post = cmdParserIndexFind(idx, key);
+        parent = post->id;
+        if(!(post->burst))
+        {
+            if(post->nb <= CMD_PARSER_PREFIX_BURST)
+            {
+                return 0;
+            }
+
+            // Too many commands to scan: they are listed in the children as
+            // well (the list of the node does not move meanwhile)
+            post->burst = 1;
+            list = post->seq;
+            nb = post->nb;
+            for(i = 0; i < nb; i++)
+            {
+                r = cmdParserHistoryFind(pCtx, list[i]);
+                if(r && (0 != cmdParserPrefixPut(pCtx, idx, r, parent, depth + 1)))
+                {
+                    return -1;
+                }
+            }
+
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+// index the prefixes of a command
+static int cmdParserPrefixAdd(cmdParserInstance_t *pCtx, cmdParserIndex_t *idx, cmdParserHistoryRec_t *rec)
+{
+    rec->prefixes = 0;
+
+    return cmdParserPrefixPut(pCtx, idx, rec, 0, 0);
+}
+
+// node of the prefix trie listing the commands beginning with a prefix, or
+// the node above it if it has no children (NULL if no command begins with
+// the prefix)
+static cmdParserPostings_t *cmdParserPrefixNode(cmdParserIndex_t *idx, const unsigned char *pfx, unsigned int len)
+{
+    cmdParserPostings_t *post = NULL;
+    unsigned int         parent = 0;
+    unsigned int         i;
+
+    for(i = 0; i < len; i++)
+    {
+        post = cmdParserIndexFind(idx, CMD_PARSER_PREFIX_KEY(parent, pfx[i]));
+        if(!post || !(post->burst))
+        {
+            break;
+        }
+
+        parent = post->id;
+    }
+
+    return post;
+}
+
+// index a command of the history (the index is given up on error)
+static void cmdParserIndexCmd(cmdParserInstance_t *pCtx, cmdParserIndex_t *idx, cmdParserHistoryRec_t *rec)
+{
+    if(idx->on && (0 != idx->add(pCtx, idx, rec)))
+    {
+        // The history is scanned without the index
+        CMD_PARSER_ERR(pCtx, "Error %d while updating the history index\n", errno);
+        cmdParserIndexFree(idx);
+        idx->on = 0;
+    }
+}
+
+// index a new command of the history
+static void cmdParserIndexAdd(cmdParserInstance_t *pCtx, cmdParserHistoryRec_t *rec)
+{
+    cmdParserIndexCmd(pCtx, &(pCtx->trigrams), rec);
+    cmdParserIndexCmd(pCtx, &(pCtx->prefixes), rec);
+}
+
+// a command is going to be removed from the history
+static void cmdParserIndexDrop(cmdParserInstance_t *pCtx, const cmdParserHistoryRec_t *rec)
+{
+    if(pCtx->trigrams.on)
+    {
+        pCtx->trigrams.live -= rec->grams;
+        pCtx->trigrams.stale += rec->grams;
+    }
+
+    if(pCtx->prefixes.on)
+    {
+        pCtx->prefixes.live -= rec->prefixes;
+        pCtx->prefixes.stale += rec->prefixes;
+    }
+}
+
+// rebuild an index from the commands in the history if it holds too many
+// references to dropped commands
+static void cmdParserIndexClean(cmdParserInstance_t *pCtx, cmdParserIndex_t *idx)
+{
+    cmdParserHistoryRec_t *rec;
+    unsigned int           pos;
+
+    if(!(idx->on) || (idx->stale <= idx->live) || (idx->stale <= CMD_PARSER_INDEX_STALE))
+    {
+        return;
+    }
+
+    cmdParserIndexFree(idx);
+
+    for(pos = 0; (pos < pCtx->historySz) && idx->on; pos++)
+    {
+        rec = cmdParserHistoryAt(pCtx, pos);
+        if(!CMD_PARSER_HISTORY_LIVE(rec))
+        {
+            continue;
+        }
+
+        cmdParserIndexCmd(pCtx, idx, rec);
+    }
+}
+
+
+
+// command stored in a slot of the history index (and its length)
+static const unsigned char *cmdParserHistoryEntry(cmdParserInstance_t *pCtx, unsigned int slot, unsigned int *len)
+{
+    *len = pCtx->historyIdx[slot].len;
+
+    return pCtx->history + pCtx->historyIdx[slot].off;
+}
+
+// check if a slot of the history index holds a command
+static int cmdParserHistoryValid(cmdParserInstance_t *pCtx, unsigned int slot)
+{
+    unsigned int len = pCtx->historySlots;
+
+    return (slot < len) && (((pCtx->historyInsert + len - 1 - slot) % len) < pCtx->historySz) &&
+           CMD_PARSER_HISTORY_LIVE(&(pCtx->historyIdx[slot]));
+}
+
+//go upward in history cmds
+static int cmdParserHistoryUp(cmdParserInstance_t *pCtx, const unsigned char **cmd, unsigned int *len)
+{
+	*cmd = NULL;
+
+  	if(!(pCtx->historySz))
+  	{
+    	return 2;
+  	}
+
+  	if(pCtx->historyCur > (-((signed)(pCtx->historySz) - (signed)(pCtx->historyInsert))))
+  	{
+    	// The tombstones are skipped (the oldest record is a command)
+    	do
+    	{
+      		pCtx->historyCur = pCtx->historyCur - 1;
+    	} while(!CMD_PARSER_HISTORY_LIVE(&(pCtx->historyIdx[cmdParserHistorySlot(pCtx, pCtx->historyCur)])));
+  	}
+  	else
+  	{
+    	return 1;
+  	}
+
+  	// Point on the UP entry in the history
+  	*cmd = cmdParserHistoryEntry(pCtx, cmdParserHistorySlot(pCtx, pCtx->historyCur), len);
+
+	return 0;
+}
+
+//go downward in history cmds
+static int cmdParserHistoryDown(cmdParserInstance_t *pCtx, const unsigned char **cmd, unsigned int *len)
+{
+  	*cmd = NULL;
+
+  	if(!(pCtx->historySz))
+  	{
+    	return 2;
+  	}
+
+  	if(pCtx->historyCur < ((signed)(pCtx->historyInsert) - 1))
+  	{
+    	// The tombstones are skipped (the newest record is a command)
+    	do
+    	{
+      		pCtx->historyCur = pCtx->historyCur + 1;
+    	} while(!CMD_PARSER_HISTORY_LIVE(&(pCtx->historyIdx[cmdParserHistorySlot(pCtx, pCtx->historyCur)])));
+  	}
+  	else
+  	{
+    	pCtx->historyCur = pCtx->historyInsert;
+    	return 1;
+  	}
+
+  	// Point on the DOWN entry in the history
+  	*cmd = cmdParserHistoryEntry(pCtx, cmdParserHistorySlot(pCtx, pCtx->historyCur), len);
+
+  	return 0;
+}
+
+//get the oldest record cmd
+static const unsigned char *cmdParserHistoryOldest(cmdParserInstance_t *pCtx, unsigned int *len)
+{
+  	if(0 == pCtx->historySz)
+  	{
+    	return NULL;
+  	}
+
+  	// Update the current index with the relative value of the oldest record
+  	pCtx->historyCur = -((signed)(pCtx->historySz) - (signed)(pCtx->historyInsert));
+
+  	// Command in the oldest record
+  	return cmdParserHistoryEntry(pCtx, cmdParserHistorySlot(pCtx, pCtx->historyCur), len);
+}
+
+
+//get the newest cmd
+static const unsigned char *cmdParserHistoryNewest(cmdParserInstance_t *pCtx, unsigned int *len)
+{
+  	if(0 == pCtx->historySz)
+  	{
+    	return NULL;
+  	}
+
+  	// Index of the newest record = index of the record just before
+  	// the insertion point
+  	pCtx->historyCur = pCtx->historyInsert - 1;
+
+  	// Command line in the newest record
+  	return cmdParserHistoryEntry(pCtx, cmdParserHistorySlot(pCtx, pCtx->historyCur), len);
+}
+
+// hash of a command (FNV-1a)
+static uint32_t cmdParserHash(const unsigned char *cmd, unsigned int len)
+{
+    uint32_t     h = 2166136261U;
+    unsigned int i;
+
+    for(i = 0; i < len; i++)
+    {
+        h = (h ^ cmd[i]) * 16777619U;
+    }
+
+    return h;
+}
+
+// bucket of a command in the table of duplicates (the free bucket where
+// it goes if it is not in the history)
+static cmdParserHistoryDup_t *cmdParserDupFind(cmdParserInstance_t *pCtx, uint32_t hash, const unsigned char *cmd, unsigned int len)
+{
+    cmdParserHistoryDup_t *dup;
+    cmdParserHistoryRec_t *rec;
+    unsigned int           i = hash & (pCtx->dupsSz - 1);
+
+    for(dup = &(pCtx->dups[i]); dup->used; dup = &(pCtx->dups[i]))
+    {
+        if(dup->hash == hash)
+        {
+            rec = &(pCtx->historyIdx[dup->slot]);
+            if((rec->len == len) && !memcmp(pCtx->history + rec->off, cmd, len))
+            {
+                return dup;
+            }
+        }
+
+        i = (i + 1) & (pCtx->dupsSz - 1);
+    }
+
+    return dup;
+}
+
+// free a bucket of the table of duplicates (the following buckets of the
+// cluster are moved back to keep the lookups going)
+static void cmdParserDupRemove(cmdParserInstance_t *pCtx, cmdParserHistoryDup_t *dup)
+{
+    unsigned int mask = pCtx->dupsSz - 1;
+    unsigned int i = (unsigned int)(dup - pCtx->dups);
+    unsigned int j, home;
+
+    for(j = (i + 1) & mask; pCtx->dups[j].used; j = (j + 1) & mask)
+    {
+        // An entry may fill the hole if its home bucket is not between the
+        // hole and itself
+        home = pCtx->dups[j].hash & mask;
+        if(((j - home) & mask) >= ((j - i) & mask))
+        {
+            pCtx->dups[i] = pCtx->dups[j];
+            i = j;
+        }
+    }
+
+    pCtx->dups[i].used = 0;
+}
+
+// reclaim the tombstones at the oldest end of the history
+static void cmdParserHistoryTrim(cmdParserInstance_t *pCtx)
+{
+  	while(pCtx->historySz && !CMD_PARSER_HISTORY_LIVE(cmdParserHistoryAt(pCtx, 0)))
+  	{
+    	pCtx->historySz--;
+  	}
+}
+
+// remove a command from the middle of the history (its record becomes a
+// tombstone)
+static void cmdParserHistoryKill(cmdParserInstance_t *pCtx, cmdParserHistoryRec_t *rec)
+{
+  	assert(CMD_PARSER_HISTORY_LIVE(rec));
+
+  	cmdParserIndexDrop(pCtx, rec);
+  	rec->hits = 0;
+  	pCtx->historyLive--;
+
+  	cmdParserHistoryTrim(pCtx);
+}
+
+// drop the oldest record of the history
+static void cmdParserHistoryDrop(cmdParserInstance_t *pCtx)
+{
+	cmdParserHistoryRec_t *rec = cmdParserHistoryAt(pCtx, 0);
+	cmdParserHistoryDup_t *dup;
+
+  	assert(pCtx->historySz > 0);
+  	assert(CMD_PARSER_HISTORY_LIVE(rec));
+
+  	// The references of the indexes to the command become useless
+  	cmdParserIndexDrop(pCtx, rec);
+  	if(pCtx->dups)
+  	{
+    	dup = cmdParserDupFind(pCtx, cmdParserHash(pCtx->history + rec->off, rec->len), pCtx->history + rec->off, rec->len);
+    	if(dup->used)
+    	{
+      		cmdParserDupRemove(pCtx, dup);
+    	}
+  	}
+
+  	pCtx->historySz--;
+  	pCtx->historyLive--;
+  	cmdParserHistoryTrim(pCtx);
+
+  	// Start again at the beginning of the arena when it is empty
+  	if(0 == pCtx->historySz)
+  	{
+    	pCtx->historyHead = 0;
+  	}
+}
+
+// find room for a record of 'len' bytes in the history arena (the oldest
+// records are dropped if needed)
+static int cmdParserHistoryAlloc(cmdParserInstance_t *pCtx, unsigned int len, unsigned int *off)
+{
+	unsigned int oldest, newest;
+
+  	if(len > pCtx->historyBytes)
+  	{
+    	return -1;
+  	}
+
+  	// The history holds up to historyLen commands and the index must have
+  	// a free slot
+  	if((pCtx->historyLive == pCtx->user.historyLen) || (pCtx->historySz == pCtx->historySlots))
+  	{
+    	cmdParserHistoryDrop(pCtx);
+  	}
+
+  	while(pCtx->historySz)
+  	{
+    	oldest = pCtx->historyIdx[cmdParserHistorySlot(pCtx, pCtx->historyInsert - pCtx->historySz)].off;
+    	newest = pCtx->historyIdx[cmdParserHistorySlot(pCtx, pCtx->historyInsert - 1)].off;
+
+    	if(newest >= oldest)
+    	{
+      		// The records are in [oldest, head[: room at the end or at the
+      		// beginning of the arena
+      		if((pCtx->historyBytes - pCtx->historyHead) >= len)
+      		{
+        		*off = pCtx->historyHead;
+        		return 0;
+      		}
+
+      		if(oldest >= len)
+      		{
+        		*off = 0;
+        		return 0;
+      		}
+    	}
+    	else
+    	{
+      		// The records are in [oldest, end[ and [0, head[: room between
+      		// them
+      		if((oldest - pCtx->historyHead) >= len)
+      		{
+        		*off = pCtx->historyHead;
+        		return 0;
+      		}
+    	}
+
+    	cmdParserHistoryDrop(pCtx);
+  	}
+
+  	*off = 0;
+  	return 0;
+}
+
+// store a command in the history (returns 0 if it is recorded)
+static int cmdParserHistoryStore(cmdParserInstance_t *pCtx, const unsigned char *cmd, unsigned int len, time_t when, int status)
+{
+	cmdParserHistoryRec_t *rec;
+	cmdParserHistoryDup_t *dup;
+	unsigned int           off;
+	unsigned int           hits;
+	uint32_t               hash = 0;
+
+  	// We don't add the command line in the history if it is the same as
+  	// the newest one (without moving in the history)
+  	rec = cmdParserHistorySame(pCtx, cmd, len);
+  	if(rec)
+  	{
+    	rec->hits++;
+    	return -1;
+  	}
+  	hits = 1;
+
+  	// The new command replaces its older duplicate (the table is cleared
+  	// before the first command to keep cmdParserNew quick)
+  	if(pCtx->dups)
+  	{
+    	if(0 == pCtx->historySeq)
+    	{
+      		memset(pCtx->dups, 0, pCtx->dupsSz * sizeof(cmdParserHistoryDup_t));
+    	}
+
+    	hash = cmdParserHash(cmd, len);
+    	dup = cmdParserDupFind(pCtx, hash, cmd, len);
+    	if(dup->used)
+    	{
+      		// The new command inherits the hits of its older duplicate
+      		rec = &(pCtx->historyIdx[dup->slot]);
+      		hits += rec->hits;
+      		cmdParserHistoryKill(pCtx, rec);
+      		cmdParserDupRemove(pCtx, dup);
+    	}
+  	}
+
+  	// Make room for the command and its NUL (a command bigger than the
+  	// arena is not recorded)
+  	if(0 != cmdParserHistoryAlloc(pCtx, len + 1, &off))
+  	{
+    	return -1;
+  	}
+
+  	// Copy the command in the history
+  	memcpy(pCtx->history + off, cmd, len);
+  	pCtx->history[off + len] = '\0';
+  	pCtx->historyHead = off + len + 1;
+
+  	rec = &(pCtx->historyIdx[pCtx->historyInsert]);
+  	rec->off = off;
+  	rec->len = len;
+  	rec->grams = 0;
+  	rec->prefixes = 0;
+  	rec->seq = pCtx->historySeq;
+  	rec->status = status;
+  	rec->hits = hits;
+
+  	// A command imported from another process may be older than the newest
+  	// one: it keeps its time, and the times are looked for with a binary
+  	// search on the newest time so far
+  	rec->time = when;
+  	rec->since = when;
+  	if(pCtx->historySz && (cmdParserHistoryAt(pCtx, pCtx->historySz - 1)->since > when))
+  	{
+    	rec->since = cmdParserHistoryAt(pCtx, pCtx->historySz - 1)->since;
+  	}
+
+  	// Increment the insertion index (the line being edited stays displayed)
+  	if(pCtx->historyCur == (signed)(pCtx->historyInsert))
+  	{
+    	pCtx->historyCur = (pCtx->historyInsert + 1) % pCtx->historySlots;
+  	}
+  	pCtx->historyInsert = (pCtx->historyInsert + 1) % pCtx->historySlots;
+
+  	// Increment the number of recorded lines
+  	pCtx->historySz++;
+  	pCtx->historyLive++;
+  	assert(pCtx->historySz <= pCtx->historySlots);
+
+  	// Index the command (the set of the suggestions is made again to
+  	// include it)
+  	cmdParserIndexAdd(pCtx, rec);
+  	pCtx->historySeq++;
+  	pCtx->suggestPfx = 0;
+
+  	// Record the command in the table of duplicates
+  	if(pCtx->dups)
+  	{
+    	dup = cmdParserDupFind(pCtx, hash, pCtx->history + off, len);
+    	dup->used = 1;
+    	dup->hash = hash;
+    	dup->seq  = rec->seq;
+    	dup->slot = (unsigned int)(rec - pCtx->historyIdx);
+  	}
+
+  	// Get rid of the references to the dropped commands
+  	cmdParserIndexClean(pCtx, &(pCtx->trigrams));
+  	cmdParserIndexClean(pCtx, &(pCtx->prefixes));
+
+  	return 0;
+}
+
+// The history may be kept in a file mapped in memory. The commands are
+// appended to it as records framed by their length, so that the newest
+// ones are found from the end of the file without parsing it:
+//
+//     +--------+-----------------------------+-----+--------------+
+//     | header | len sum time status cmd len | ... | (zeros)      |
+//     +--------+-----------------------------+-----+--------------+
+//                                                  ^              ^
+//                                                 end            size
+//
+// The checksum covers the command only, as the exit status is written
+// after the record.
+//
+// The file grows by doubling. The records are synced on disk by batches of
+// CMD_PARSER_LOG_SYNC, then the end of the synced records is updated in the
+// header. After a crash, only the records after this end are checked. When
+// the file is full of commands too old to be loaded, it is rewritten with
+// its newest records and replaces the old one.
+//
+// Several instances (of one process or more) may keep their history in the
+// same file. It is locked only while it is updated: the instance catches up
+// first with the file grown or replaced and with the records appended by the
+// others. A file which is not a history file is moved aside ('.bad').
+// Without the file, the history is kept in memory only.
+
+// offsets of the fields in a record of the file
+#define CMD_PARSER_LOG_TIME           (2 * sizeof(uint32_t))
+#define CMD_PARSER_LOG_STATUS         (4 * sizeof(uint32_t))
+#define CMD_PARSER_LOG_CMD            (5 * sizeof(uint32_t))
+
+// size of a record in the file
+#define CMD_PARSER_LOG_REC_SZ(len)    (CMD_PARSER_LOG_CMD + sizeof(uint32_t) + (((len) + 3) & ~3U))
+
+// header of the file
+#define CMD_PARSER_LOG_HDR(pCtx)      ((cmdParserLogHdr_t *)((pCtx)->log))
+
+// length of the record at an offset of the file
+static uint32_t cmdParserLogWord(cmdParserInstance_t *pCtx, size_t off)
+{
+    uint32_t w;
+
+    memcpy(&w, pCtx->log + off, sizeof(w));
+
+    return w;
+}
+
+// check the record at an offset of the file (returns its size or 0)
+static size_t cmdParserLogCheck(cmdParserInstance_t *pCtx, size_t off)
+{
+    uint32_t len;
+    size_t   sz;
+
+    if((off + CMD_PARSER_LOG_REC_SZ(0)) > pCtx->logSize)
+    {
+        return 0;
+    }
+
+    len = cmdParserLogWord(pCtx, off);
+    sz = CMD_PARSER_LOG_REC_SZ(len);
+    if(!len || (len > (pCtx->logSize - off)) || ((off + sz) > pCtx->logSize))
+    {
+        return 0;
+    }
+
+    if((cmdParserLogWord(pCtx, off + sz - sizeof(uint32_t)) != len) ||
+       (cmdParserLogWord(pCtx, off + sizeof(uint32_t)) != cmdParserHash(pCtx->log + off + CMD_PARSER_LOG_CMD, len)))
+    {
+        return 0;
+    }
+
+    return sz;
+}
+
+// write a record at the end of the file (there is room for it)
+static void cmdParserLogPut(cmdParserInstance_t *pCtx, const cmdParserHistoryRec_t *rec)
+{
+    const unsigned char *cmd = pCtx->history + rec->off;
+    unsigned char       *p = pCtx->log + pCtx->logEnd;
+    uint32_t             w;
+    int64_t              t = rec->time;
+    int32_t              status = rec->status;
+    size_t               sz = CMD_PARSER_LOG_REC_SZ(rec->len);
+
+    w = rec->len;
+    memcpy(p, &w, sizeof(w));
+    w = cmdParserHash(cmd, rec->len);
+    memcpy(p + sizeof(w), &w, sizeof(w));
+    memcpy(p + CMD_PARSER_LOG_TIME, &t, sizeof(t));
+    memcpy(p + CMD_PARSER_LOG_STATUS, &status, sizeof(status));
+    memcpy(p + CMD_PARSER_LOG_CMD, cmd, rec->len);
+    memset(p + CMD_PARSER_LOG_CMD + rec->len, 0, sz - CMD_PARSER_LOG_CMD - sizeof(w) - rec->len);
+    w = rec->len;
+    memcpy(p + sz - sizeof(w), &w, sizeof(w));
+
+    pCtx->logEnd += sz;
+}
+
+// map a file of the persistent history
+static int cmdParserLogMap(cmdParserInstance_t *pCtx, int fd, size_t size)
+{
+    void *p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(MAP_FAILED == p)
+    {
+        return -1;
+    }
+
+    if(pCtx->log)
+    {
+        munmap(pCtx->log, pCtx->logSize);
+    }
+
+    pCtx->log = (unsigned char *)p;
+    pCtx->logSize = size;
+
+    return 0;
+}
+
+// sync the records appended to the file, then the header
+static int cmdParserLogSync(cmdParserInstance_t *pCtx)
+{
+    if(0 != msync(pCtx->log, pCtx->logEnd, MS_SYNC))
+    {
+        return -1;
+    }
+
+    CMD_PARSER_LOG_HDR(pCtx)->end = pCtx->logEnd;
+    if(0 != msync(pCtx->log, sizeof(cmdParserLogHdr_t), MS_SYNC))
+    {
+        return -1;
+    }
+
+    pCtx->logPending = 0;
+
+    return 0;
+}
+
+// stop keeping the history in the file
+static void cmdParserLogClose(cmdParserInstance_t *pCtx)
+{
+    if(!(pCtx->log))
+    {
+        return;
+    }
+
+    // The other instances may have synced further meanwhile
+    if(pCtx->logPending)
+    {
+        if((0 != flock(pCtx->logFd, LOCK_EX)) ||
+           ((pCtx->logEnd > CMD_PARSER_LOG_HDR(pCtx)->end) && (0 != cmdParserLogSync(pCtx))))
+        {
+            CMD_PARSER_ERR(pCtx, "Error %d while syncing the history file\n", errno);
+        }
+    }
+
+    // The lock goes with the descriptor
+    munmap(pCtx->log, pCtx->logSize);
+    close(pCtx->logFd);
+    pCtx->log = NULL;
+    pCtx->logSize = 0;
+    pCtx->logEnd = 0;
+    pCtx->logLastSeq = CMD_PARSER_HISTORY_NEWEST;
+}
+
+// open the file again once it has been replaced
+static int cmdParserLogReopen(cmdParserInstance_t *pCtx)
+{
+    int fd;
+
+    fd = open(pCtx->logPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd < 0)
+    {
+        return -1;
+    }
+
+    if(pCtx->log)
+    {
+        munmap(pCtx->log, pCtx->logSize);
+    }
+    close(pCtx->logFd);
+
+    pCtx->logFd = fd;
+    pCtx->log = NULL;
+    pCtx->logSize = 0;
+    pCtx->logEnd = 0;
+    pCtx->logPending = 0;
+
+    // The offsets in the former file are meaningless
+    pCtx->logLastSeq = CMD_PARSER_HISTORY_NEWEST;
+    pCtx->logLoading = 0;
+
+    return 0;
+}
+
+// move aside a file which is not a history file (for the user to look at
+// it) and start a new one
+static int cmdParserLogSetAside(cmdParserInstance_t *pCtx)
+{
+    char *bad;
+    int   rc;
+
+    bad = (char *)malloc(strlen(pCtx->logPath) + 5);
+    if(!bad)
+    {
+        return -1;
+    }
+    sprintf(bad, "%s.bad", pCtx->logPath);
+
+    CMD_PARSER_ERR(pCtx, "'%s' is not a history file: moved to '%s'\n", pCtx->logPath, bad);
+    rc = rename(pCtx->logPath, bad);
+    free(bad);
+
+    return (0 != rc) ? -1 : cmdParserLogReopen(pCtx);
+}
+
+// lock the file to update it, after catching up with the other instances:
+// file replaced or grown, and records appended since the last time
+static int cmdParserLogLock(cmdParserInstance_t *pCtx)
+{
+    static const char              magic[8] = CMD_PARSER_LOG_MAGIC;
+    static const cmdParserLogHdr_t blank;
+    cmdParserLogHdr_t             *hdr;
+    struct stat                    st, cur;
+    size_t                         off, sz;
+    int                            errSav;
+    int                            created;
+
+    for(;;)
+    {
+        created = 0;
+
+        if((0 != flock(pCtx->logFd, LOCK_EX)) || (0 != fstat(pCtx->logFd, &cur)))
+        {
+            return -1;
+        }
+
+        // The file may have been rewritten or set aside by another instance
+        if((0 != stat(pCtx->logPath, &st)) || (st.st_dev != cur.st_dev) || (st.st_ino != cur.st_ino))
+        {
+            if(0 != cmdParserLogReopen(pCtx))
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        if(0 == cur.st_size)
+        {
+            if(0 != ftruncate(pCtx->logFd, CMD_PARSER_LOG_CHUNK))
+            {
+                goto error;
+            }
+            cur.st_size = CMD_PARSER_LOG_CHUNK;
+            created = 1;
+        }
+
+        if((size_t)(cur.st_size) >= sizeof(cmdParserLogHdr_t))
+        {
+            if(((size_t)(cur.st_size) != pCtx->logSize) && (0 != cmdParserLogMap(pCtx, pCtx->logFd, cur.st_size)))
+            {
+                goto error;
+            }
+
+            // New file (or created by an instance which stopped before
+            // writing the header): the header of any other file is kept
+            hdr = CMD_PARSER_LOG_HDR(pCtx);
+            if(created || !memcmp(hdr, &blank, sizeof(blank)))
+            {
+                memcpy(hdr->magic, magic, sizeof(magic));
+                hdr->version = CMD_PARSER_LOG_VERSION;
+                hdr->end = sizeof(cmdParserLogHdr_t);
+            }
+
+            if(!memcmp(hdr->magic, magic, sizeof(magic)) && (CMD_PARSER_LOG_VERSION == hdr->version))
+            {
+                break;
+            }
+        }
+
+        if(0 != cmdParserLogSetAside(pCtx))
+        {
+            goto error;
+        }
+    }
+
+    // A damaged end is rebuilt by checking all the records
+    if((hdr->end < sizeof(cmdParserLogHdr_t)) || (hdr->end > pCtx->logSize) || (hdr->end & 3))
+    {
+        CMD_PARSER_ERR(pCtx, "Damaged header in '%s': checking all the records\n", pCtx->logPath);
+        hdr->end = sizeof(cmdParserLogHdr_t);
+    }
+
+    // Records appended since the last sync (by any instance)
+    off = (pCtx->logEnd > hdr->end) ? pCtx->logEnd : hdr->end;
+    for(; 0 != (sz = cmdParserLogCheck(pCtx, off)); off += sz);
+
+    // Wipe out the remains of a record which was being written
+    if(((off + sizeof(uint32_t)) <= pCtx->logSize) && cmdParserLogWord(pCtx, off))
+    {
+        memset(pCtx->log + off, 0, pCtx->logSize - off);
+    }
+
+    pCtx->logEnd = off;
+
+    return 0;
+
+error:
+
+    errSav = errno;
+    flock(pCtx->logFd, LOCK_UN);
+    errno = errSav;
+
+    return -1;
+}
+
+// open (or create) the file of the persistent history and recover the
+// records which may have been written after the last sync
+static int cmdParserLogOpen(cmdParserInstance_t *pCtx, const char *path)
+{
+    int errSav;
+
+    pCtx->logPath = strdup(path);
+    if(!(pCtx->logPath))
+    {
+        return -1;
+    }
+
+    pCtx->logFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(pCtx->logFd < 0)
+    {
+        return -1;
+    }
+
+    if(0 != cmdParserLogLock(pCtx))
+    {
+        errSav = errno;
+        if(pCtx->log)
+        {
+            munmap(pCtx->log, pCtx->logSize);
+            pCtx->log = NULL;
+        }
+        close(pCtx->logFd);
+        errno = errSav;
+        return -1;
+    }
+
+    // The recovered records are synced with the next ones
+    pCtx->logPending = (pCtx->logEnd != CMD_PARSER_LOG_HDR(pCtx)->end);
+
+    flock(pCtx->logFd, LOCK_UN);
+
+    return 0;
+}
+
+// oldest of the newest records of the file which fit in the history
+// (returns their number)
+static unsigned int cmdParserLogTail(cmdParserInstance_t *pCtx, size_t *from)
+{
+    size_t       off = pCtx->logEnd;
+    size_t       bytes = 0;
+    unsigned int nb = 0;
+    uint32_t     len;
+
+    while((off > sizeof(cmdParserLogHdr_t)) && (nb < pCtx->user.historyLen))
+    {
+        len = cmdParserLogWord(pCtx, off - sizeof(uint32_t));
+        if((len > off) || (CMD_PARSER_LOG_REC_SZ(len) > (off - sizeof(cmdParserLogHdr_t))) ||
+           (cmdParserLogWord(pCtx, off - CMD_PARSER_LOG_REC_SZ(len)) != len))
+        {
+            CMD_PARSER_ERR(pCtx, "Corrupted history file at offset %zu\n", off);
+            break;
+        }
+
+        if((bytes + len + 1) > pCtx->historyBytes)
+        {
+            break;
+        }
+
+        off -= CMD_PARSER_LOG_REC_SZ(len);
+        bytes += len + 1;
+        nb++;
+    }
+
+    *from = off;
+
+    return nb;
+}
+
+// load up to 'max' of the newest commands of the file in the history
+// (returns 1 while some remain to load)
+static int cmdParserLogLoad(cmdParserInstance_t *pCtx, unsigned int max)
+{
+    uint32_t     len;
+    int64_t      t;
+    int32_t      status;
+
+    if(!(pCtx->logLoading) || !(pCtx->log))
+    {
+        pCtx->logLoading = 0;
+        return 0;
+    }
+
+    // Go backward from the end of the file up to the oldest command which
+    // fits in the history
+    if(!(pCtx->logLoadOff))
+    {
+        pCtx->logLoadNb = cmdParserLogTail(pCtx, &(pCtx->logLoadOff));
+    }
+
+    // Then forward from the oldest one
+    for(; pCtx->logLoadNb && max; pCtx->logLoadNb--, max--)
+    {
+        len = cmdParserLogWord(pCtx, pCtx->logLoadOff);
+        memcpy(&t, pCtx->log + pCtx->logLoadOff + CMD_PARSER_LOG_TIME, sizeof(t));
+        memcpy(&status, pCtx->log + pCtx->logLoadOff + CMD_PARSER_LOG_STATUS, sizeof(status));
+        cmdParserHistoryStore(pCtx, pCtx->log + pCtx->logLoadOff + CMD_PARSER_LOG_CMD, len, (time_t)t, status);
+        pCtx->logLoadOff += CMD_PARSER_LOG_REC_SZ(len);
+    }
+
+    pCtx->logLoading = (0 != pCtx->logLoadNb);
+
+    return pCtx->logLoading;
+}
+
+// rewrite the file with its records from 'from' (the older ones don't fit
+// in the history) and room for 'room' more bytes (the file is locked)
+static int cmdParserLogCompact(cmdParserInstance_t *pCtx, size_t from, size_t room)
+{
+    static const char  magic[8] = CMD_PARSER_LOG_MAGIC;
+    cmdParserLogHdr_t *hdr;
+    char              *tmp;
+    size_t             end = sizeof(cmdParserLogHdr_t) + (pCtx->logEnd - from);
+    size_t             size = (((end + room) / CMD_PARSER_LOG_CHUNK) + 1) * CMD_PARSER_LOG_CHUNK;
+    void              *p = MAP_FAILED;
+    int                fd;
+    int                errSav;
+
+    tmp = (char *)malloc(strlen(pCtx->logPath) + 5);
+    if(!tmp)
+    {
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", pCtx->logPath);
+
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0)
+    {
+        free(tmp);
+        return -1;
+    }
+
+    // The new file is locked before the other instances can see it
+    if((0 == flock(fd, LOCK_EX | LOCK_NB)) && (0 == ftruncate(fd, size)))
+    {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if(MAP_FAILED == p)
+    {
+        goto error;
+    }
+
+    hdr = (cmdParserLogHdr_t *)p;
+    memcpy(hdr->magic, magic, sizeof(magic));
+    hdr->version = CMD_PARSER_LOG_VERSION;
+    hdr->end = end;
+    memcpy(hdr + 1, pCtx->log + from, pCtx->logEnd - from);
+
+    // The new file replaces the old one once it is on disk
+    if((0 != msync(p, end, MS_SYNC)) || (0 != rename(tmp, pCtx->logPath)))
+    {
+        munmap(p, size);
+        goto error;
+    }
+
+    munmap(pCtx->log, pCtx->logSize);
+    close(pCtx->logFd);
+    pCtx->log = (unsigned char *)p;
+    pCtx->logFd = fd;
+    pCtx->logSize = size;
+    pCtx->logEnd = end;
+    pCtx->logPending = 0;
+    pCtx->logLastSeq = CMD_PARSER_HISTORY_NEWEST;
+    free(tmp);
+
+    return 0;
+
+error:
+
+    errSav = errno;
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    errno = errSav;
+
+    return -1;
+}
+
+// append a command to the file of the persistent history
+static void cmdParserLogAppend(cmdParserInstance_t *pCtx, const cmdParserHistoryRec_t *rec)
+{
+    size_t sz = CMD_PARSER_LOG_REC_SZ(rec->len);
+    size_t from;
+    size_t size;
+
+    if(0 != cmdParserLogLock(pCtx))
+    {
+        goto error;
+    }
+
+    if((pCtx->logEnd + sz) > pCtx->logSize)
+    {
+        // Rewrite the file rather than grow it if most of its records are
+        // too old to be loaded in the history
+        cmdParserLogTail(pCtx, &from);
+        if((2 * (sizeof(cmdParserLogHdr_t) + (pCtx->logEnd - from) + sz)) < pCtx->logEnd)
+        {
+            if(0 != cmdParserLogCompact(pCtx, from, sz))
+            {
+                goto error;
+            }
+        }
+
+        for(size = pCtx->logSize; (pCtx->logEnd + sz) > size; size *= 2);
+
+        if((size != pCtx->logSize) &&
+           ((0 != ftruncate(pCtx->logFd, size)) || (0 != cmdParserLogMap(pCtx, pCtx->logFd, size))))
+        {
+            goto error;
+        }
+    }
+
+    // The exit status of the newest command may come later
+    pCtx->logLast = pCtx->logEnd;
+    pCtx->logLastSeq = rec->seq;
+
+    cmdParserLogPut(pCtx, rec);
+
+    if((++(pCtx->logPending) >= CMD_PARSER_LOG_SYNC) && (0 != cmdParserLogSync(pCtx)))
+    {
+        goto error;
+    }
+
+    flock(pCtx->logFd, LOCK_UN);
+
+    return;
+
+error:
+
+    // The history goes on in memory only
+    CMD_PARSER_ERR(pCtx, "Error %d on the history file '%s'\n", errno, pCtx->logPath);
+    cmdParserLogClose(pCtx);
+}
+
+// The history may be shared by the processes of the host through a ring of
+// slots in a POSIX shared memory segment. A process claims the sequence
+// number of a command with an atomic increment of the head of the ring,
+// then publishes the command in the slot 'seq modulo the number of slots'.
+// The sequence number of a slot works like a seqlock:
+//
+//     2 * seq + 1 : the command is being written
+//     2 * seq + 2 : the command is published
+//
+// A writer never takes a slot from a newer command (it claims a new sequence
+// number instead) and lets an older writer finish filling it. A reader
+// copies the command and checks that the slot didn't change meanwhile (and
+// its checksum). Before browsing the history, an instance copies the
+// commands published by the others since the last time into its own history:
+// it stops at the first command not published yet and skips the ones
+// already overwritten by newer commands.
+
+// slots of the shared history
+#define CMD_PARSER_SHM_SLOTS(hdr)     ((cmdParserShmSlot_t *)((hdr) + 1))
+
+// size of the shared history
+#define CMD_PARSER_SHM_SIZE(nb)       (sizeof(cmdParserShmHdr_t) + (size_t)(nb) * sizeof(cmdParserShmSlot_t))
+
+// wait for another process setting up the shared history
+static int cmdParserShmWait(int fd, cmdParserShmHdr_t **hdr)
+{
+    struct stat st;
+    int         i;
+    void       *p;
+
+    // The segment is sized by its creator
+    for(i = 0; ; i++)
+    {
+        if(0 != fstat(fd, &st))
+        {
+            return -1;
+        }
+
+        if((size_t)(st.st_size) >= sizeof(cmdParserShmHdr_t))
+        {
+            break;
+        }
+
+        if(i == CMD_PARSER_SHM_WAIT)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        usleep(1000);
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(MAP_FAILED == p)
+    {
+        return -1;
+    }
+    *hdr = (cmdParserShmHdr_t *)p;
+
+    for(i = 0; CMD_PARSER_SHM_READY != __atomic_load_n(&((*hdr)->state), __ATOMIC_ACQUIRE); i++)
+    {
+        if(i == CMD_PARSER_SHM_WAIT)
+        {
+            munmap(p, st.st_size);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        usleep(1000);
+    }
+
+    // The mapping must be the size of the ring
+    if(memcmp((*hdr)->magic, CMD_PARSER_SHM_MAGIC, sizeof((*hdr)->magic)) ||
+       ((size_t)(st.st_size) != CMD_PARSER_SHM_SIZE((*hdr)->nbSlots)))
+    {
+        munmap(p, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// attach the instance to the shared history (created if needed)
+static int cmdParserShmOpen(cmdParserInstance_t *pCtx, const char *name)
+{
+    cmdParserShmHdr_t *hdr;
+    unsigned int       nb;
+    int                fd;
+    int                errSav;
+    void              *p;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd >= 0)
+    {
+        // Creator of the segment: one slot per entry of the history
+        for(nb = 1; nb < pCtx->user.historyLen; nb *= 2);
+
+        p = MAP_FAILED;
+        if(0 == ftruncate(fd, CMD_PARSER_SHM_SIZE(nb)))
+        {
+            p = mmap(NULL, CMD_PARSER_SHM_SIZE(nb), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        // Don't leave a segment which will never be set up
+        if(MAP_FAILED == p)
+        {
+            errSav = errno;
+            shm_unlink(name);
+            errno = errSav;
+            goto error;
+        }
+
+        hdr = (cmdParserShmHdr_t *)p;
+        memcpy(hdr->magic, CMD_PARSER_SHM_MAGIC, sizeof(hdr->magic));
+        hdr->nbSlots = nb;
+        __atomic_store_n(&(hdr->state), CMD_PARSER_SHM_READY, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        if(EEXIST != errno)
+        {
+            return -1;
+        }
+
+        fd = shm_open(name, O_RDWR, 0600);
+        if((fd < 0) || (0 != cmdParserShmWait(fd, &hdr)))
+        {
+            goto error;
+        }
+    }
+
+    close(fd);
+
+    pCtx->shm = hdr;
+
+    // The commands already in the ring are shared as well
+    pCtx->shmSeen = __atomic_load_n(&(hdr->head), __ATOMIC_ACQUIRE);
+    pCtx->shmSeen -= (pCtx->shmSeen < hdr->nbSlots) ? pCtx->shmSeen : hdr->nbSlots;
+    pCtx->shmOwner = ((uint64_t)getpid() << 32) | (uint32_t)(uintptr_t)pCtx;
+
+    return 0;
+
+error:
+
+    errSav = errno;
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+    errno = errSav;
+
+    return -1;
+}
+
+// detach the instance from the shared history
+static void cmdParserShmClose(cmdParserInstance_t *pCtx)
+{
+    if(pCtx->shm)
+    {
+        munmap(pCtx->shm, CMD_PARSER_SHM_SIZE(pCtx->shm->nbSlots));
+        pCtx->shm = NULL;
+    }
+}
+
+// publish a command in the shared history
+static void cmdParserShmPublish(cmdParserInstance_t *pCtx, const cmdParserHistoryRec_t *rec)
+{
+    cmdParserShmHdr_t   *hdr = pCtx->shm;
+    cmdParserShmSlot_t  *slot;
+    const unsigned char *cmd = pCtx->history + rec->off;
+    unsigned int         len = rec->len;
+    uint64_t             seq, cur;
+    unsigned int         i;
+    int                  taken;
+
+    if(len > CMD_PARSER_SHM_CMD_LEN)
+    {
+        return;
+    }
+
+    do
+    {
+        seq = __atomic_fetch_add(&(hdr->head), 1, __ATOMIC_RELAXED);
+        slot = &(CMD_PARSER_SHM_SLOTS(hdr)[seq & (hdr->nbSlots - 1)]);
+
+        // An older writer still filling the slot is given some time (the
+        // readers skip its command once the slot is taken)
+        cur = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+        for(i = 0; (cur & 1) && (cur < (2 * seq + 1)) && (i < CMD_PARSER_SHM_SPIN); i++)
+        {
+            sched_yield();
+            cur = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+        }
+
+        // A newer command has taken the slot: the readers skip this sequence
+        // number, so the command goes to a new one
+        taken = 0;
+        while((cur < (2 * seq + 1)) &&
+              !(taken = __atomic_compare_exchange_n(&(slot->seq), &cur, 2 * seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)));
+    } while(!taken);
+
+    slot->owner = pCtx->shmOwner;
+    slot->len = len;
+    slot->hash = cmdParserHash(cmd, len);
+    slot->time = rec->time;
+    memcpy(slot->cmd, cmd, len);
+
+    cur = 2 * seq + 1;
+    __atomic_compare_exchange_n(&(slot->seq), &cur, 2 * seq + 2, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+// copy in the history the commands published by the other instances
+static void cmdParserShmImport(cmdParserInstance_t *pCtx)
+{
+    cmdParserShmHdr_t  *hdr = pCtx->shm;
+    cmdParserShmSlot_t *slot;
+    unsigned char       cmd[CMD_PARSER_SHM_CMD_LEN];
+    uint64_t            head, seq, v;
+    uint64_t            owner;
+    uint32_t            len, hash;
+    int64_t             t;
+
+    head = __atomic_load_n(&(hdr->head), __ATOMIC_ACQUIRE);
+
+    // The oldest commands may have been overwritten
+    seq = pCtx->shmSeen;
+    if((head - seq) > hdr->nbSlots)
+    {
+        seq = head - hdr->nbSlots;
+    }
+
+    for(; seq < head; seq++)
+    {
+        slot = &(CMD_PARSER_SHM_SLOTS(hdr)[seq & (hdr->nbSlots - 1)]);
+
+        // The next import starts from a command not published yet, while a
+        // command overwritten by a newer one is skipped for good
+        v = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+        if(v < (2 * seq + 2))
+        {
+            break;
+        }
+
+        if(v != (2 * seq + 2))
+        {
+            continue;
+        }
+
+        owner = slot->owner;
+        len = slot->len;
+        hash = slot->hash;
+        t = slot->time;
+        if((len > CMD_PARSER_SHM_CMD_LEN) || (owner == pCtx->shmOwner))
+        {
+            continue;
+        }
+        memcpy(cmd, slot->cmd, len);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if((__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != v) || (cmdParserHash(cmd, len) != hash))
+        {
+            continue;
+        }
+
+        cmdParserHistoryStore(pCtx, cmd, len, (time_t)t, CMD_PARSER_NO_STATUS);
+    }
+
+    pCtx->shmSeen = seq;
+}
+
+// make sure that the history is up to date before using it: commands of
+// the history file and of the other processes (only when the line being
+// edited is displayed, to keep the positions in the history while browsing)
+static void cmdParserHistoryLoad(cmdParserInstance_t *pCtx)
+{
+    if(pCtx->logLoading)
+    {
+        cmdParserLogLoad(pCtx, UINT_MAX);
+    }
+
+    if(pCtx->shm && (pCtx->historyCur == (signed)(pCtx->historyInsert)))
+    {
+        cmdParserShmImport(pCtx);
+    }
+}
+
+// load the history file by chunks as long as the user doesn't type anything
+// (one chunk per call in non blocking mode, not to hold up the caller)
+static void cmdParserHistoryIdle(cmdParserInstance_t *pCtx)
+{
+    struct pollfd pfd;
+
+    if(pCtx->user.onEvent)
+    {
+        return;
+    }
+
+    pfd.fd = pCtx->user.fdIn;
+    pfd.events = POLLIN;
+    while(pCtx->logLoading && !(pCtx->inCount) && (0 == poll(&pfd, 1, 0)))
+    {
+        cmdParserLogLoad(pCtx, CMD_PARSER_LOG_LOAD_CHUNK);
+
+        if(pCtx->user.nonBlocking)
+        {
+            break;
+        }
+    }
+}
+
+//add cmd into history table
+static void cmdParserHistoryAdd(cmdParserInstance_t *pCtx)
+{
+	cmdParserHistoryRec_t *rec;
+	unsigned int          len;
+
+  	// No exit status may be reported until a command is recorded
+  	pCtx->statusSeq = CMD_PARSER_HISTORY_NEWEST;
+
+  	// We don't add the command line if the history is not activated
+  	if(!(pCtx->historyOn) || !(pCtx->user.historyLen))
+  	{
+    	return;
+  	}
+
+  	// We don't add the command line in the history if it is empty
+  	len = pCtx->lineSz;
+  	if(cmdParserIsEmpty(pCtx->cmd, len))
+  	{
+    	return;
+  	}
+
+  	// The commands of the file are older
+  	cmdParserHistoryLoad(pCtx);
+
+  	if(0 != cmdParserHistoryStore(pCtx, pCtx->cmd, len, time(NULL), CMD_PARSER_NO_STATUS))
+  	{
+    	// Same command as the newest one: the exit status goes to it
+    	rec = cmdParserHistorySame(pCtx, pCtx->cmd, len);
+    	if(rec)
+    	{
+      		pCtx->statusSeq = rec->seq;
+    	}
+    	return;
+  	}
+
+  	rec = cmdParserHistoryAt(pCtx, pCtx->historySz - 1);
+  	pCtx->statusSeq = rec->seq;
+
+  	// Keep the command in the history file as well
+  	if(pCtx->log)
+  	{
+    	cmdParserLogAppend(pCtx, rec);
+  	}
+
+  	// Share the command with the other processes
+  	if(pCtx->shm)
+  	{
+    	cmdParserShmPublish(pCtx, rec);
+  	}
+}
+
+
+// check if a command of the history contains a pattern
+static int cmdParserHistoryMatch(cmdParserInstance_t *pCtx, const cmdParserHistoryRec_t *rec, const unsigned char *pat, unsigned int len)
+{
+    const unsigned char *p;
+    const unsigned char *end;
+
+    if(!rec || !CMD_PARSER_HISTORY_LIVE(rec))
+    {
+        return 0;
+    }
+
+    p = pCtx->history + rec->off;
+    end = p + rec->len;
+    while((unsigned)(end - p) >= len)
+    {
+        p = (const unsigned char *)memchr(p, pat[0], end - p - len + 1);
+        if(!p)
+        {
+            return 0;
+        }
+
+        if(!memcmp(p, pat, len))
+        {
+            return 1;
+        }
+
+        p++;
+    }
+
+    return 0;
+}
+
+// sequence number of the oldest command of the history
+static unsigned int cmdParserHistoryOldestSeq(cmdParserInstance_t *pCtx)
+{
+    return pCtx->historySz ? cmdParserHistoryAt(pCtx, 0)->seq : pCtx->historySeq;
+}
+
+// look for the newest command older than 'before' containing a pattern
+static int cmdParserHistorySearch(cmdParserInstance_t *pCtx, const unsigned char *pat, unsigned int len, unsigned int before, unsigned int *seq)
+{
+    unsigned int           oldest = cmdParserHistoryOldestSeq(pCtx);
+    cmdParserPostings_t   *t;
+    cmdParserPostings_t   *best = NULL;
+    cmdParserHistoryRec_t *rec;
+    unsigned int           i, lo;
+
+    if(!len)
+    {
+        return -1;
+    }
+
+    if(pCtx->trigrams.on && (len >= 3))
+    {
+        // The candidates are in the shortest list of the trigrams of the
+        // pattern
+        for(i = 0; (i + 3) <= len; i++)
+        {
+            t = cmdParserIndexFind(&(pCtx->trigrams), CMD_PARSER_TRIGRAM_KEY(pat + i));
+            if(!t)
+            {
+                return -1;
+            }
+
+            if(!best || (t->nb < best->nb))
+            {
+                best = t;
+            }
+        }
+
+        // Newest candidate older than 'before'
+        lo = cmdParserIndexBefore(best, before);
+        while((lo-- > 0) && (best->seq[lo] >= oldest))
+        {
+            if(cmdParserHistoryMatch(pCtx, cmdParserHistoryFind(pCtx, best->seq[lo]), pat, len))
+            {
+                *seq = best->seq[lo];
+                return 0;
+            }
+        }
+
+        return -1;
+    }
+
+    // Short pattern: scan the history
+    i = cmdParserHistoryOlder(pCtx, before);
+    while(i-- > 0)
+    {
+        rec = cmdParserHistoryAt(pCtx, i);
+        if(cmdParserHistoryMatch(pCtx, rec, pat, len))
+        {
+            *seq = rec->seq;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// check if a command of the history begins with a prefix and differs from
+// the command line (if any)
+static int cmdParserHistoryBegins(cmdParserInstance_t *pCtx, const cmdParserHistoryRec_t *rec, const unsigned char *pfx, unsigned int len, const unsigned char *line)
+{
+    const unsigned char *p;
+
+    if(!rec || !CMD_PARSER_HISTORY_LIVE(rec))
+    {
+        return 0;
+    }
+
+    p = pCtx->history + rec->off;
+
+    return (rec->len >= len) && !memcmp(p, pfx, len) &&
+           (!line || (rec->len != pCtx->lineSz) || memcmp(p, line, rec->len));
+}
+
+// look for the nearest command older ('up') or newer than 'from' beginning
+// with a prefix and different from a line (NULL = any)
+static int cmdParserHistoryPrefix(cmdParserInstance_t *pCtx, const unsigned char *pfx, unsigned int len, const unsigned char *line, unsigned int from, int up, unsigned int *seq)
+{
+    unsigned int           oldest = cmdParserHistoryOldestSeq(pCtx);
+    cmdParserPostings_t   *post;
+    cmdParserHistoryRec_t *rec;
+    unsigned int           i;
+
+    if(pCtx->prefixes.on && len)
+    {
+        // The candidates begin with the prefix (or its first chars when they
+        // are few)
+        post = cmdParserPrefixNode(&(pCtx->prefixes), pfx, len);
+        if(!post)
+        {
+            return -1;
+        }
+
+        if(up)
+        {
+            i = cmdParserIndexBefore(post, from);
+            while((i-- > 0) && (post->seq[i] >= oldest))
+            {
+                if(cmdParserHistoryBegins(pCtx, cmdParserHistoryFind(pCtx, post->seq[i]), pfx, len, line))
+                {
+                    *seq = post->seq[i];
+                    return 0;
+                }
+            }
+        }
+        else
+        {
+            for(i = cmdParserIndexBefore(post, from + 1); i < post->nb; i++)
+            {
+                if(cmdParserHistoryBegins(pCtx, cmdParserHistoryFind(pCtx, post->seq[i]), pfx, len, line))
+                {
+                    *seq = post->seq[i];
+                    return 0;
+                }
+            }
+        }
+
+        return -1;
+    }
+
+    // No index: scan the history
+    if(up)
+    {
+        i = cmdParserHistoryOlder(pCtx, from);
+        while(i-- > 0)
+        {
+            rec = cmdParserHistoryAt(pCtx, i);
+            if(cmdParserHistoryBegins(pCtx, rec, pfx, len, line))
+            {
+                *seq = rec->seq;
+                return 0;
+            }
+        }
+    }
+    else
+    {
+        for(i = cmdParserHistoryOlder(pCtx, from + 1); i < pCtx->historySz; i++)
+        {
+            rec = cmdParserHistoryAt(pCtx, i);
+            if(cmdParserHistoryBegins(pCtx, rec, pfx, len, line))
+            {
+                *seq = rec->seq;
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+
+// reset cmd hsitory table
+static void cmdParserHistoryReset(cmdParserInstance_t *pCtx)
+{
+	// Reset the current index to the insertion index
+	pCtx->historyCur = pCtx->historyInsert;
+}
+
+
+// list history cmds (the line being edited is left untouched)
+void cmdParserHistoryList(cmdParser_t *pInst, void (* list)(const unsigned char *item, unsigned int index))
+{
+	cmdParserInstance_t   *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+	cmdParserHistoryRec_t *rec;
+	unsigned int          i;
+
+  	errno = 0;
+
+  	if(!pCtx || !list)
+  	{
+    	errno = EINVAL;
+    	return;
+  	}
+
+  	cmdParserHistoryLoad(pCtx);
+
+  	// If the history is empty
+  	if(0 == pCtx->historySz)
+  	{
+    	list(NULL, (unsigned)-1);
+    	return;
+  	}
+
+  	// From the oldest item, straight from the history
+  	for(i = 0; i < pCtx->historySz; i++)
+  	{
+    	rec = cmdParserHistoryAt(pCtx, i);
+    	if(CMD_PARSER_HISTORY_LIVE(rec))
+    	{
+      		list(pCtx->history + rec->off, (unsigned int)(rec - pCtx->historyIdx));
+    	}
+  	}
+
+  	list(NULL, -1);
+}
+
+//get history cmd
+const unsigned char *cmdParserHistoryGet(cmdParser_t *pInst, unsigned int idx)
+{
+    cmdParserInstance_t  *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+
+  	if(!pCtx)
+  	{
+    	errno = EINVAL;
+    	return NULL;
+  	}
+
+  	// Validate the index
+  	if(idx >= pCtx->historySlots)
+  	{
+    	errno = EINVAL;
+    	return NULL;
+  	}
+
+  	cmdParserHistoryLoad(pCtx);
+
+  	// The index is the real index of the item in the history table
+  	// We must make sure that it is in use
+  	if(!cmdParserHistoryValid(pCtx, idx))
+  	{
+    	errno = ENOENT;
+    	return NULL;
+  	}
+
+  	// The command is NUL terminated in the history
+  	return pCtx->history + pCtx->historyIdx[idx].off;
+}
+
+// visit the history from a position (sequence number) toward the oldest
+// command (the ones before the position) or the newest one (the ones from
+// the position). The position moves on the visited command, so that the
+// next call returns the following one in either direction.
+int cmdParserHistoryIterate(cmdParser_t *pInst, unsigned int *pos, int older, cmdParserHistoryItem_t *item)
+{
+	cmdParserInstance_t   *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+	cmdParserHistoryRec_t *rec;
+	unsigned int          i;
+
+  	if(!pCtx || !pos || !item)
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	cmdParserHistoryLoad(pCtx);
+
+  	// Number of commands before the position (the tombstones are skipped)
+  	i = cmdParserHistoryOlder(pCtx, *pos);
+  	while(older && (i > 0) && !CMD_PARSER_HISTORY_LIVE(cmdParserHistoryAt(pCtx, i - 1)))
+  	{
+    	i--;
+  	}
+  	while(!older && (i < pCtx->historySz) && !CMD_PARSER_HISTORY_LIVE(cmdParserHistoryAt(pCtx, i)))
+  	{
+    	i++;
+  	}
+
+  	if(older ? (0 == i) : (i == pCtx->historySz))
+  	{
+    	errno = ENOENT;
+    	return -1;
+  	}
+
+  	rec = cmdParserHistoryAt(pCtx, older ? i - 1 : i);
+  	*pos = older ? rec->seq : rec->seq + 1;
+
+  	item->cmd = pCtx->history + rec->off;
+  	item->len = rec->len;
+  	item->seq = rec->seq;
+  	item->time = rec->time;
+  	item->status = rec->status;
+
+  	return 0;
+}
+
+// position in the history before the first command added at or after a
+// given time (binary search on the newest time so far, which increases
+// with the commands even if some imported ones are older)
+int cmdParserHistorySince(cmdParser_t *pInst, time_t since, unsigned int *pos)
+{
+	cmdParserInstance_t *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+	unsigned int        lo, hi, mid;
+
+  	if(!pCtx || !pos)
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	cmdParserHistoryLoad(pCtx);
+
+  	lo = 0;
+  	hi = pCtx->historySz;
+  	while(lo < hi)
+  	{
+    	mid = (lo + hi) / 2;
+    	if(cmdParserHistoryAt(pCtx, mid)->since < since)
+    	{
+      		lo = mid + 1;
+    	}
+    	else
+    	{
+      		hi = mid;
+    	}
+  	}
+
+  	*pos = (lo < pCtx->historySz) ? cmdParserHistoryAt(pCtx, lo)->seq : pCtx->historySeq;
+
+  	return 0;
+}
+
+// record the exit status of the last command returned by cmdParserInteract()
+int cmdParserHistoryStatus(cmdParser_t *pInst, int status)
+{
+	cmdParserInstance_t   *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+	cmdParserHistoryRec_t *rec;
+	int32_t               w = status;
+
+  	if(!pCtx)
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	// The command may have been dropped from the history since
+  	rec = cmdParserHistoryFind(pCtx, pCtx->statusSeq);
+  	if(!rec)
+  	{
+    	errno = ENOENT;
+    	return -1;
+  	}
+
+  	rec->status = status;
+
+  	// Update the record of the file (synced with the next ones): only a
+  	// command appended by this instance has a record (never the header).
+  	// The file is locked as another instance may be rewriting it (the
+  	// record is forgotten if the file has been replaced meanwhile)
+  	if(pCtx->log && (pCtx->logLastSeq == rec->seq))
+  	{
+    	if(0 != cmdParserLogLock(pCtx))
+    	{
+      		// The history goes on in memory only
+      		CMD_PARSER_ERR(pCtx, "Error %d on the history file '%s'\n", errno, pCtx->logPath);
+      		cmdParserLogClose(pCtx);
+      		return 0;
+    	}
+
+    	if((pCtx->logLastSeq == rec->seq) && (pCtx->logLast >= sizeof(cmdParserLogHdr_t)))
+    	{
+      		memcpy(pCtx->log + pCtx->logLast + CMD_PARSER_LOG_STATUS, &w, sizeof(w));
+      		pCtx->logPending++;
+    	}
+
+    	flock(pCtx->logFd, LOCK_UN);
+  	}
+
+  	return 0;
+}
+
+//reset cmd
+static void cmdParserResetLine(cmdParserInstance_t *pCtx)
+{
+	pCtx->lineSz = 0;
+	pCtx->cursor = 0;
+	pCtx->cursorCol = 0;
+	pCtx->gapPos = 0;
+	pCtx->cmd[0] = '\0';
+}
+
+//get ctl mgs
+static int cmdParserGetCtrlMsg(cmdParserInstance_t *pCtx)
+{
+	unsigned int  i;
+	int           rc;
+	unsigned char c, len;
+
+  	assert(0 == pCtx->lineSz);
+
+  	pCtx->cmd[0] = CMD_PARSER_CTRL_MSG;
+  	pCtx->lineSz ++;
+  	pCtx->gapPos = pCtx->lineSz;
+
+  	// Get the size of the message
+  	rc = cmdParserGetChar(pCtx, &len);
+  	if(0 != rc)
+  	{
+    	return -1;
+  	}
+
+  	// Check that we don't overflow the buffer
+  	if(0 != cmdParserLineReserve(pCtx, len + 1))
+  	{
+    	CMD_PARSER_ERR(pCtx, "Control message too long: %u\n", len);
+    	return -1;
+  	}
+
+  	pCtx->cmd[1] = len;
+  	pCtx->lineSz ++;
+
+  	// Get the data of the message
+  	for(i = 0; i < len; i ++)
+  	{
+    	rc = cmdParserGetChar(pCtx, &c);
+    	if (0 != rc)
+    	{
+      		return -1;
+    	}
+
+    	pCtx->cmd[i + 2] = c;
+    	pCtx->lineSz ++;
+  	} 
+
+  	// The gap is at the end of the message
+  	pCtx->gapPos = pCtx->lineSz;
+
+ 	return 0;
+}
+
+
+// insert the bytes of a char into cmd
+static int cmdParserAcceptSeq(cmdParserInstance_t *pCtx, const unsigned char *seq, unsigned int len)
+{
+	unsigned int w;
+	int          rc;
+
+  	// We don't use isprint() to check if it is a printable char otherwise,
+  	// latin chars with accent which are greater than 128 (ASCII set) would
+  	// not be printed
+  	if(0 == cmdParserLineReserve(pCtx, len))
+	{
+    	assert((unsigned)(pCtx->cursor) <= pCtx->lineSz);
+
+    	// Insert the char in the gap
+    	cmdParserGapMove(pCtx, pCtx->cursor);
+    	memcpy(pCtx->cmd + pCtx->cursor, seq, len);
+    	pCtx->gapPos += len;
+    	pCtx->cursor += len;
+    	pCtx->lineSz += len;
+    	w = cmdParserSpanWidth(pCtx, seq, len);
+    	pCtx->cursorCol += w;
+
+    	// Echo if activated
+    	if(pCtx->echoOn)
+    	{
+      		// Make room for the char if it is inserted in the line: the
+      		// terminal shifts the right side of the line by itself
+      		if(w && ((unsigned)(pCtx->cursor) < pCtx->lineSz) && !(pCtx->user.dumbTerminal))
+      		{
+        		rc = cmdParserWriteCsi(pCtx, w, '@');
+        		if(rc < 0)
+        		{
+          			return -1;
+        		}
+      		}
+
+      		rc = cmdParserEchoSpan(pCtx, seq, len);
+      		if(rc < 0)
+      		{
+        		return -1;
+      		}
+
+      		pCtx->shownSz = pCtx->lineSz;
+    	}
+
+    	// Redisplay the right side of the line if any
+    	if(((unsigned)(pCtx->cursor) < pCtx->lineSz) && pCtx->user.dumbTerminal)
+    	{
+      		return cmdParserShiftLine(pCtx, 1);
+    	}
+  	}
+  	else
+  	{
+    	cmdParserBeep(pCtx);
+  	}
+
+  	return 0;
+}
+
+// get a character into cmd
+#define	CMD_PARSER_ACCEPT_CHAR(p, c)		_cmdParserAcceptChar((p), (c), __LINE__)
+static int _cmdParserAcceptChar(cmdParserInstance_t *pCtx, const unsigned char c, int lineno)
+{
+	//printf("\n%d#Accepting <0x%x, %c>\n", lineno, c, c);
+	(void)lineno;
+
+  	return cmdParserAcceptSeq(pCtx, &c, 1);
+}
+
+// Inline suggestions
+//
+// While the user types at the end of the line, the rest of the best ranked
+// command of the history beginning with the line is displayed dimmed after
+// the cursor, and Right, End, Ctrl-F or Ctrl-E take it. The commands
+// beginning with the line are kept in a set that each new char filters,
+// instead of looking for them again. They are ranked by frecency: each
+// occurrence of a command scores hits * HALF / (HALF + age), where age is
+// the number of newer commands, and the occurrences of a command add up.
+
+// build the set of the commands beginning with the line, or filter it if
+// chars have only been appended to the line since
+static int cmdParserSuggestSet(cmdParserInstance_t *pCtx, const unsigned char *line)
+{
+    unsigned int           oldest = cmdParserHistoryOldestSeq(pCtx);
+    cmdParserPostings_t   *post;
+    cmdParserHistoryRec_t *rec;
+    unsigned int           i;
+    unsigned int           nb = 0;
+
+    // The set and the ranking table are allocated at the first use
+    if(!(pCtx->suggestSet))
+    {
+        pCtx->suggestSet = (unsigned int *)malloc((pCtx->user.historyLen * sizeof(unsigned int)) +
+                                                  (CMD_PARSER_SUGGEST_BUCKETS * sizeof(cmdParserSuggest_t)));
+        if(!(pCtx->suggestSet))
+        {
+            return -1;
+        }
+        pCtx->suggestRank = (cmdParserSuggest_t *)(pCtx->suggestSet + pCtx->user.historyLen);
+    }
+
+    if(pCtx->suggestPfx && (pCtx->lineSz >= pCtx->suggestPfx) &&
+       (cmdParserHash(line, pCtx->suggestPfx) == pCtx->suggestHash))
+    {
+        for(i = 0; i < pCtx->suggestNb; i++)
+        {
+            if(cmdParserHistoryBegins(pCtx, cmdParserHistoryFind(pCtx, pCtx->suggestSet[i]), line, pCtx->lineSz, NULL))
+            {
+                pCtx->suggestSet[nb++] = pCtx->suggestSet[i];
+            }
+        }
+    }
+    else if(pCtx->prefixes.on && pCtx->lineSz)
+    {
+        post = cmdParserPrefixNode(&(pCtx->prefixes), line, pCtx->lineSz);
+        for(i = post ? cmdParserIndexBefore(post, oldest) : 0; post && (i < post->nb) && (nb < pCtx->user.historyLen); i++)
+        {
+            if(cmdParserHistoryBegins(pCtx, cmdParserHistoryFind(pCtx, post->seq[i]), line, pCtx->lineSz, NULL))
+            {
+                pCtx->suggestSet[nb++] = post->seq[i];
+            }
+        }
+    }
+    else
+    {
+        for(i = 0; i < pCtx->historySz; i++)
+        {
+            rec = cmdParserHistoryAt(pCtx, i);
+            if(cmdParserHistoryBegins(pCtx, rec, line, pCtx->lineSz, NULL))
+            {
+                pCtx->suggestSet[nb++] = rec->seq;
+            }
+        }
+    }
+
+    pCtx->suggestNb = nb;
+    pCtx->suggestPfx = pCtx->lineSz;
+    pCtx->suggestHash = cmdParserHash(line, pCtx->lineSz);
+
+    return 0;
+}
+
+// best ranked command of the set, longer than the line (NULL if none)
+static cmdParserHistoryRec_t *cmdParserSuggestBest(cmdParserInstance_t *pCtx)
+{
+    cmdParserSuggest_t    *rank = pCtx->suggestRank;
+    cmdParserSuggest_t    *b;
+    cmdParserHistoryRec_t *rec;
+    cmdParserHistoryRec_t *other;
+    cmdParserHistoryRec_t *best = NULL;
+    double                 bestScore = 0;
+    unsigned int           i, n, h;
+
+    for(h = 0; h < CMD_PARSER_SUGGEST_BUCKETS; h++)
+    {
+        rank[h].seq = CMD_PARSER_HISTORY_NEWEST;
+    }
+
+    // From the newest candidate (the oldest ones hardly count)
+    for(i = pCtx->suggestNb, n = 0; (i-- > 0) && (n < CMD_PARSER_SUGGEST_RANK); )
+    {
+        rec = cmdParserHistoryFind(pCtx, pCtx->suggestSet[i]);
+        if(!rec || (rec->len == pCtx->lineSz))
+        {
+            continue;
+        }
+        n++;
+
+        // The occurrences of a command share a bucket (the one of the newest)
+        for(h = cmdParserHash(pCtx->history + rec->off, rec->len) & (CMD_PARSER_SUGGEST_BUCKETS - 1); ; h = (h + 1) & (CMD_PARSER_SUGGEST_BUCKETS - 1))
+        {
+            b = &(rank[h]);
+            if(CMD_PARSER_HISTORY_NEWEST == b->seq)
+            {
+                b->seq = rec->seq;
+                b->score = 0;
+                break;
+            }
+
+            other = cmdParserHistoryFind(pCtx, b->seq);
+            if((other->len == rec->len) && !memcmp(pCtx->history + other->off, pCtx->history + rec->off, rec->len))
+            {
+                break;
+            }
+        }
+
+        b->score += (double)(rec->hits) * CMD_PARSER_SUGGEST_HALF / (CMD_PARSER_SUGGEST_HALF + (pCtx->historySeq - 1 - rec->seq));
+        if(b->score > bestScore)
+        {
+            bestScore = b->score;
+            best = cmdParserHistoryFind(pCtx, b->seq);
+        }
+    }
+
+    return best;
+}
+
+// display the suggestion for the line after the cursor
+static int cmdParserSuggest(cmdParserInstance_t *pCtx)
+{
+    cmdParserHistoryRec_t *rec;
+    const unsigned char   *line;
+    unsigned int           w;
+
+    pCtx->suggestSeq = CMD_PARSER_HISTORY_NEWEST;
+
+    if(!(pCtx->user.historyFlags & CMD_PARSER_HISTORY_SUGGEST) || !(pCtx->historyOn) || !(pCtx->echoOn) ||
+       pCtx->user.dumbTerminal || !(pCtx->lineSz) || ((unsigned)(pCtx->cursor) != pCtx->lineSz))
+    {
+        return 0;
+    }
+
+    line = cmdParserLineFlat(pCtx);
+    if(0 != cmdParserSuggestSet(pCtx, line))
+    {
+        // No suggestion without memory
+        return 0;
+    }
+
+    rec = cmdParserSuggestBest(pCtx);
+    if(!rec)
+    {
+        return 0;
+    }
+
+    // Rest of the command in dim, then back to the cursor
+    w = cmdParserSpanWidth(pCtx, pCtx->history + rec->off + pCtx->lineSz, rec->len - pCtx->lineSz);
+    if((cmdParserWrite(pCtx, "\x1b[2m", 4) < 0) ||
+       (0 != cmdParserEchoSpan(pCtx, pCtx->history + rec->off + pCtx->lineSz, rec->len - pCtx->lineSz)) ||
+       (cmdParserWrite(pCtx, "\x1b[22m", 5) < 0) ||
+       (0 != cmdParserEchoBack(pCtx, w)))
+    {
+        return -1;
+    }
+
+    pCtx->suggestSeq = rec->seq;
+    pCtx->suggestShown = w;
+
+    return 0;
+}
+
+// erase the displayed suggestion (it may still be taken by the key being
+// handled)
+static int cmdParserSuggestErase(cmdParserInstance_t *pCtx)
+{
+    if(!(pCtx->suggestShown))
+    {
+        pCtx->suggestSeq = CMD_PARSER_HISTORY_NEWEST;
+        return 0;
+    }
+
+    pCtx->suggestShown = 0;
+
+    return cmdParserEchoBlanks(pCtx, 0);
+}
+
+// take the suggestion which was displayed (returns 1 if there is none)
+static int cmdParserSuggestTake(cmdParserInstance_t *pCtx)
+{
+    cmdParserHistoryRec_t *rec;
+    const unsigned char   *line;
+
+    if((CMD_PARSER_HISTORY_NEWEST == pCtx->suggestSeq) || ((unsigned)(pCtx->cursor) != pCtx->lineSz))
+    {
+        return 1;
+    }
+
+    line = cmdParserLineFlat(pCtx);
+    rec = cmdParserHistoryFind(pCtx, pCtx->suggestSeq);
+    pCtx->suggestSeq = CMD_PARSER_HISTORY_NEWEST;
+    if(!cmdParserHistoryBegins(pCtx, rec, line, pCtx->lineSz, NULL) || (rec->len == pCtx->lineSz))
+    {
+        return 1;
+    }
+
+    if(0 != cmdParserAcceptSeq(pCtx, pCtx->history + rec->off + pCtx->lineSz, rec->len - pCtx->lineSz))
+    {
+        return -1;
+    }
+
+    // Longer commands may begin like the new line
+    return (0 != cmdParserSuggest(pCtx)) ? -1 : 0;
+}
+
+//Replace current display cmd by a new one and setting cursor at a given position
+//
+// Only the part of the display which changes is redrawn: the common prefix
+// of the displayed and new lines is skipped and, on ANSI terminals, the
+// common suffix is kept in place by inserting or deleting chars before it.
+static void cmdParserReplaceLine(cmdParserInstance_t *pCtx, const unsigned char *newCmd, unsigned int newLen, unsigned int newCursor)
+{
+	const unsigned char *newEnd;
+	unsigned int         l_old, l_new;
+	unsigned int         pfx, sfx, oldMid, newMid;
+	unsigned int         oldW, newW;
+
+  	// The new command may be the current one
+  	if(!newCmd || (newCmd == pCtx->cmd))
+  	{
+    	newCmd = cmdParserLineFlat(pCtx);
+    	newLen = pCtx->lineSz;
+  	}
+
+  	l_new = newLen;
+  	if((l_new > pCtx->lineSz) && (0 != cmdParserLineReserve(pCtx, l_new - pCtx->lineSz)))
+  	{
+    	l_new = pCtx->cmdSz - 1;
+  	}
+  	newEnd = newCmd + l_new;
+
+  	// Length of the line currently displayed
+  	l_old = (pCtx->shownSz < pCtx->lineSz) ? pCtx->shownSz : pCtx->lineSz;
+
+  	// Common prefix of the displayed and new lines (ending on a char
+  	// boundary in both of them)
+  	for(pfx = 0; (pfx < l_old) && (pfx < l_new); pfx ++)
+  	{
+    	if(CMD_PARSER_CHAR(pCtx, pfx) != newCmd[pfx])
+    	{
+      		break;
+    	}
+  	}
+  	while(pfx && !(cmdParserIsLineCharStart(pCtx, pfx) && cmdParserIsCharStart(pCtx, newCmd + pfx, newEnd)))
+  	{
+    	pfx --;
+  	}
+
+  	// Common suffix (without insert/delete chars, the displayed chars can't
+  	// be shifted and so, it can be kept only if the lines have the same size)
+  	sfx = 0;
+  	if(!(pCtx->user.dumbTerminal) || (l_old == l_new))
+  	{
+    	while((pfx + sfx < l_old) && (pfx + sfx < l_new) &&
+          	  (CMD_PARSER_CHAR(pCtx, l_old - 1 - sfx) == newCmd[l_new - 1 - sfx]))
+    	{
+      		sfx ++;
+    	}
+    	while(sfx && !(cmdParserIsLineCharStart(pCtx, l_old - sfx) && cmdParserIsCharStart(pCtx, newEnd - sfx, newEnd)))
+    	{
+      		sfx --;
+    	}
+  	}
+
+  	oldMid = l_old - pfx - sfx;
+  	newMid = l_new - pfx - sfx;
+
+  	// Number of columns of the parts which change
+  	oldW = cmdParserLineWidth(pCtx, pfx, oldMid);
+  	newW = cmdParserSpanWidth(pCtx, newCmd + pfx, newMid);
+  	if(sfx && (pCtx->user.dumbTerminal) && (oldW != newW))
+  	{
+    	sfx = 0;
+    	oldMid = l_old - pfx;
+    	newMid = l_new - pfx;
+    	oldW = cmdParserLineWidth(pCtx, pfx, oldMid);
+    	newW = cmdParserSpanWidth(pCtx, newCmd + pfx, newMid);
+  	}
+
+  	// Move the cursor to the first char which changes
+  	cmdParserMoveCursor(pCtx, pfx, CMD_PARSER_MOVE_SET);
+
+  	if(pCtx->echoOn)
+  	{
+    	// Make room before the suffix
+    	if(sfx && (newW > oldW))
+    	{
+      		cmdParserWriteCsi(pCtx, newW - oldW, '@');
+    	}
+
+    	// Display the part of the new command which changes
+    	cmdParserEchoSpan(pCtx, newCmd + pfx, newMid);
+
+    	// Remove the chars between the new part and the suffix
+    	if(sfx && (newW < oldW))
+    	{
+      		cmdParserWriteCsi(pCtx, oldW - newW, 'P');
+    	}
+  	}
+
+  	// Copy the new command in the command line buffer (the gap is at its end)
+  	if(newCmd != pCtx->cmd)
+  	{
+    	memcpy(pCtx->cmd, newCmd, l_new);
+  	}
+  	pCtx->cursor = pfx + newMid;
+  	pCtx->cursorCol += newW;
+  	pCtx->lineSz = l_new;
+  	pCtx->gapPos = l_new;
+  	pCtx->shownSz = pCtx->echoOn ? l_new : 0;
+
+  	// If the previous line was longer than the current one, erase the
+  	// remaining chars from the previous command line
+  	if(!sfx && (newW < oldW))
+  	{
+    	cmdParserEchoBlanks(pCtx, oldW - newW);
+  	}
+
+  	// Put the cursor at the requested position (on a char boundary)
+  	while((newCursor > 0) && (newCursor < l_new) && !cmdParserIsLineCharStart(pCtx, newCursor))
+  	{
+    	newCursor --;
+  	}
+  	cmdParserMoveCursor(pCtx, newCursor, CMD_PARSER_MOVE_SET);
+}
+
+
+// display the reverse search in place of the command line
+static void cmdParserSearchShow(cmdParserInstance_t *pCtx)
+{
+	static const char      head[] = "(reverse-i-search)`";
+	static const char      failed[] = "(failed reverse-i-search)`";
+	static const char      sep[] = "': ";
+	cmdParserHistoryRec_t *rec;
+	unsigned int           w;
+
+  	if(!(pCtx->echoOn))
+  	{
+    	return;
+  	}
+
+  	// Back to the beginning of the line
+  	cmdParserEchoBack(pCtx, pCtx->searchShown);
+
+  	if(pCtx->searchLen && !(pCtx->searchFound))
+  	{
+    	cmdParserWrite(pCtx, failed, sizeof(failed) - 1);
+    	w = sizeof(failed) - 1;
+  	}
+  	else
+  	{
+    	cmdParserWrite(pCtx, head, sizeof(head) - 1);
+    	w = sizeof(head) - 1;
+  	}
+
+  	cmdParserEchoSpan(pCtx, pCtx->searchPat, pCtx->searchLen);
+  	w += cmdParserSpanWidth(pCtx, pCtx->searchPat, pCtx->searchLen);
+
+  	cmdParserWrite(pCtx, sep, sizeof(sep) - 1);
+  	w += sizeof(sep) - 1;
+
+  	if(pCtx->searchFound)
+  	{
+    	rec = cmdParserHistoryFind(pCtx, pCtx->searchSeq);
+    	cmdParserEchoSpan(pCtx, pCtx->history + rec->off, rec->len);
+    	w += cmdParserSpanWidth(pCtx, pCtx->history + rec->off, rec->len);
+  	}
+
+  	// Erase the end of the previous display
+  	if(w < pCtx->searchShown)
+  	{
+    	cmdParserEchoBlanks(pCtx, pCtx->searchShown - w);
+  	}
+
+  	pCtx->searchShown = w;
+}
+
+// look for the pattern of the reverse search in the commands older than
+// 'before'
+static void cmdParserSearchFrom(cmdParserInstance_t *pCtx, unsigned int before)
+{
+  	pCtx->searchFound = (0 == cmdParserHistorySearch(pCtx, pCtx->searchPat, pCtx->searchLen, before, &(pCtx->searchSeq)));
+  	if(pCtx->searchLen && !(pCtx->searchFound))
+  	{
+    	cmdParserBeep(pCtx);
+  	}
+
+  	cmdParserSearchShow(pCtx);
+}
+
+// enter the reverse search mode
+static void cmdParserSearchStart(cmdParserInstance_t *pCtx)
+{
+	unsigned int l;
+
+  	pCtx->searchLen = 0;
+  	pCtx->searchFound = 0;
+  	pCtx->searchCursor = pCtx->cursor;
+  	pCtx->searchShown = 0;
+
+  	// Erase the command line on the screen (it stays in cmd)
+  	l = (pCtx->shownSz < pCtx->lineSz) ? pCtx->shownSz : pCtx->lineSz;
+  	cmdParserMoveCursor(pCtx, 0, CMD_PARSER_MOVE_SET);
+  	cmdParserEchoBlanks(pCtx, cmdParserLineWidth(pCtx, 0, l));
+  	pCtx->shownSz = 0;
+
+  	cmdParserSearchShow(pCtx);
+}
+
+// leave the reverse search mode with the matching command or the command
+// line before the search
+static void cmdParserSearchEnd(cmdParserInstance_t *pCtx, int accept)
+{
+	cmdParserHistoryRec_t *rec;
+	const unsigned char   *p = NULL;
+	unsigned int           cursor = pCtx->searchCursor;
+	unsigned int           len = 0;
+
+  	// Erase the search on the screen
+  	if(pCtx->echoOn)
+  	{
+    	cmdParserEchoBack(pCtx, pCtx->searchShown);
+    	cmdParserEchoBlanks(pCtx, pCtx->searchShown);
+  	}
+  	pCtx->searchShown = 0;
+
+  	if(accept && pCtx->searchFound)
+  	{
+    	// Save the line being edited when leaving it for the history
+    	if(pCtx->historyCur == (signed)(pCtx->historyInsert))
+    	{
+      		cmdParserSaveLine(pCtx);
+    	}
+
+    	// Up/Down go on from the matching command
+    	rec = cmdParserHistoryGoTo(pCtx, pCtx->searchSeq);
+    	p = pCtx->history + rec->off;
+    	len = rec->len;
+    	cursor = len;
+  	}
+
+  	cmdParserReplaceLine(pCtx, p, len, cursor);
+}
+
+
+// go to the previous or next command of the history beginning with the
+// chars before the cursor
+static void cmdParserHistoryBeginning(cmdParserInstance_t *pCtx, int up)
+{
+	cmdParserHistoryRec_t *rec;
+	const unsigned char   *line;
+	const unsigned char   *p;
+	unsigned int           cursor = pCtx->cursor;
+	unsigned int           len;
+	unsigned int           seq;
+
+  	// Sequence number of the displayed command (historySeq for the line
+  	// being edited)
+  	seq = pCtx->historySeq;
+  	if(pCtx->historyCur != (signed)(pCtx->historyInsert))
+  	{
+    	seq = cmdParserHistoryAt(pCtx, pCtx->historySz - (pCtx->historyInsert - pCtx->historyCur))->seq;
+  	}
+
+  	line = cmdParserLineFlat(pCtx);
+  	if(0 != cmdParserHistoryPrefix(pCtx, line, cursor, line, seq, up, &seq))
+  	{
+    	if(up || (pCtx->historyCur == (signed)(pCtx->historyInsert)))
+    	{
+      		cmdParserBeep(pCtx);
+      		return;
+    	}
+
+    	// Back to the line being edited
+    	pCtx->historyCur = pCtx->historyInsert;
+    	p = pCtx->savedCmd;
+    	len = pCtx->savedSz;
+  	}
+  	else
+  	{
+    	// Save the line being edited when leaving it for the history
+    	if(pCtx->historyCur == (signed)(pCtx->historyInsert))
+    	{
+      		cmdParserSaveLine(pCtx);
+    	}
+
+    	rec = cmdParserHistoryGoTo(pCtx, seq);
+    	p = pCtx->history + rec->off;
+    	len = rec->len;
+  	}
+
+  	// The cursor stays after the prefix
+  	if(len < cursor)
+  	{
+    	cursor = len;
+  	}
+
+  	cmdParserReplaceLine(pCtx, p, len, cursor);
+}
+
+
+// manage a function key
+static void cmdParserHandleFk(cmdParserInstance_t *pCtx, unsigned int fn)
+{
+	unsigned int           cursor;
+	const unsigned char   *p;
+
+  	if(pCtx->functionKey)
+  	{
+    	cursor = pCtx->cursor;
+
+    	// The callback may display something
+    	cmdParserFlushOut(pCtx);
+
+    	p = pCtx->functionKey((void *)&(pCtx->user.ctx), fn, cmdParserLineFlat(pCtx), &cursor);
+
+    	// The preceding function may have displayed anything
+    	// and so, we don't know the current cursor position.
+    	// Hence, we reset the cursor position to 0 because the
+    	// caller is supposed to display the prompt if any and
+    	// then let us display the new command line if any
+    	pCtx->cursor = 0;
+    	pCtx->cursorCol = 0;
+    	pCtx->shownSz = 0;
+
+    	// The line comes from the user
+    	cmdParserReplaceLine(pCtx, p, p ? strlen((const char *)p) : 0, cursor);
+  	}
+}
+
+// action for STATE 0 of FSM
+static int cmdParserState0(cmdParserInstance_t *pCtx)
+{
+  	// Command mngt parameters
+  	pCtx->cursor           	= 0;
+  	pCtx->cursorCol        	= 0;
+  	pCtx->lineSz           	= 0;
+  	pCtx->gapPos           	= 0;
+  	pCtx->shownSz          	= 0;
+
+  	// Release the room taken by the previous line if it was long
+  	cmdParserLineShrink(pCtx);
+
+  	pCtx->cmd[0]       		= '\0';
+  	pCtx->savedCmd[0] 		= '\0';
+  	pCtx->savedSz           = 0;
+
+  	// Reinit the history pointers
+  	cmdParserHistoryReset(pCtx);
+
+  	return CMD_PARSER_STATE_1;
+}
+
+// actiion for STATE 1 of FSM
+static int cmdParserState1(cmdParserInstance_t *pCtx)
+{
+	unsigned char  c;
+	unsigned char *p;
+	int            rc;
+
+  	rc = cmdParserGetChar(pCtx, &c);
+  	if(0 != rc)
+  	{
+    	assert(-1 == rc);
+    	if(EAGAIN == errno)
+    	{
+      		return CMD_PARSER_STATE_1 | CMD_PARSER_STATE_AGAIN;
+    	}
+    	return -1;
+  	}
+
+  	// The suggestion is redisplayed after the chars typed at the end of
+  	// the line
+  	if(0 != cmdParserSuggestErase(pCtx))
+  	{
+    	return -1;
+  	}
+
+  	switch(c)
+  	{
+    	case '\0' :
+    	{
+      		// For some reasons that I don't understand right now,
+      		// we receive NUL in place of LF
+      	return CMD_PARSER_CURRENT_STATE;
+    	}
+    	break;
+
+    	case CMD_IN_ASCII_RANGE('A') : // Go to beginning of line
+    	case CMD_IN_ASCII_RANGE('B') : // Go one char backward
+    	case CMD_IN_ASCII_RANGE('F') : // Go one char forward
+    	case CMD_IN_ASCII_RANGE('E') : // Go to end of line
+    	case CMD_IN_ASCII_RANGE('[') : // ESC sequence ?
+    	{
+      		cmdParserUngetChar(pCtx, &c);
+
+      		return CMD_PARSER_STATE_2;
+    	}
+    	break;
+
+    	case CMD_PARSER_CTRL_MSG :
+    	{
+      		// If there are chars in the command line
+      		if (pCtx->lineSz)
       		{
         		// Store the control char for the next input
         		cmdParserUngetChar(pCtx, &c);
@@ -1187,6 +4685,20 @@ static int cmdParserState1(cmdParserInstance_t *pCtx)
     	}
     	break;
 
+    	case CMD_IN_ASCII_RANGE('R') : // Reverse search in the history
+    	{
+      		if(pCtx->historyOn && pCtx->searchPat)
+      		{
+        		cmdParserHistoryLoad(pCtx);
+        		cmdParserSearchStart(pCtx);
+        		return CMD_PARSER_STATE_9;
+      		}
+
+      		CMD_PARSER_ACCEPT_CHAR(pCtx, c);
+      		return CMD_PARSER_CURRENT_STATE;
+    	}
+    	break;
+
     	case '\t':
     	{
     		unsigned int i;
@@ -1197,10 +4709,11 @@ static int cmdParserState1(cmdParserInstance_t *pCtx)
       			unsigned int cursor = pCtx->cursor;
 
         		p = NULL;
-        		pCtx->user.tab.autoComplete(pCtx->user.ctx, pCtx->cmd, &cursor, &p);
+        		cmdParserFlushOut(pCtx);
+        		pCtx->user.tab.autoComplete(pCtx->user.ctx, cmdParserLineFlat(pCtx), &cursor, &p);
         		if(p)
         		{
-          			cmdParserReplaceLine(pCtx, p, cursor);
+          			cmdParserReplaceLine(pCtx, p, strlen((const char *)p), cursor);
         		}
       		}
       		else
@@ -1277,7 +4790,7 @@ static int cmdParserState1(cmdParserInstance_t *pCtx)
       		if(pCtx->cursor > 0)
       		{
         		//printf("\nDEL\n");
-        		cmdParserMoveCursor(pCtx, -1, CMD_PARSER_MOVE_CUR);
+        		cmdParserMoveCursor(pCtx, -(int)cmdParserPrevLen(pCtx, pCtx->cursor), CMD_PARSER_MOVE_CUR);
 
         		cmdParserShiftLine(pCtx, -1);
       		}
@@ -1307,10 +4820,6 @@ static int cmdParserState1(cmdParserInstance_t *pCtx)
     	{
       		cmdParserUngetChar(pCtx, &c);
 
-      		// Save command line
-      		strncpy((char *)(pCtx->savedCmd), (char *)(pCtx->cmd), pCtx->user.lineLen);
-      		pCtx->savedCmd[pCtx->user.lineLen - 1] = '\0';
-
       		return CMD_PARSER_STATE_8;
     	}
     	break;
@@ -1318,8 +4827,35 @@ static int cmdParserState1(cmdParserInstance_t *pCtx)
     	default : // Accept the char in the command line unless it is
               	  // not printable
     	{
+      		// Beginning of an UTF-8 char
+      		if(pCtx->user.utf8 && (c > 0x7f))
+      		{
+        		if(cmdParserUtf8Len(c) > 1)
+        		{
+          			cmdParserUngetChar(pCtx, &c);
+          			return CMD_PARSER_STATE_8;
+        		}
+
+        		// Ignore the stray bytes
+        		return CMD_PARSER_CURRENT_STATE;
+      		}
+
       		CMD_PARSER_ACCEPT_CHAR(pCtx, c);
 
+      		// Accept the plain chars already buffered without going
+      		// through the FSM for each of them (e.g. pasted text)
+      		while(cmdParserPeekPrintable(pCtx, &c))
+      		{
+        		cmdParserGetChar(pCtx, &c);
+        		CMD_PARSER_ACCEPT_CHAR(pCtx, c);
+      		}
+
+      		// Suggest the rest of the line, along with the echoed chars
+      		if(0 != cmdParserSuggest(pCtx))
+      		{
+        		return -1;
+      		}
+
       		return CMD_PARSER_CURRENT_STATE;
     	}
   	} // End switch
@@ -1346,6 +4882,13 @@ static int cmdParserState2(cmdParserInstance_t *pCtx)
     	return -1;
   	}
 
+  	// The keys handed over by the state 1 may take the suggestion, the
+  	// new ones discard it
+  	if((CMD_PARSER_STATE_1 != pCtx->prevState) && (0 != cmdParserSuggestErase(pCtx)))
+  	{
+    	return -1;
+  	}
+
   	switch(c)
   	{
     	case CMD_IN_ASCII_RANGE('A') :  // Go to beginning of line
@@ -1367,7 +4910,7 @@ static int cmdParserState2(cmdParserInstance_t *pCtx)
     	{
       		if(pCtx->cursor > 0)
       		{
-        		cmdParserMoveCursor(pCtx, -1, CMD_PARSER_MOVE_CUR);
+        		cmdParserMoveCursor(pCtx, -(int)cmdParserPrevLen(pCtx, pCtx->cursor), CMD_PARSER_MOVE_CUR);
       		}
       		else
       		{
@@ -1380,9 +4923,15 @@ static int cmdParserState2(cmdParserInstance_t *pCtx)
 
     	case CMD_IN_ASCII_RANGE('F') : // Go one char forward
     	{
+      		rc = cmdParserSuggestTake(pCtx);
+      		if(rc <= 0)
+      		{
+        		return rc ? -1 : CMD_PARSER_CURRENT_STATE;
+      		}
+
       		if((unsigned)(pCtx->cursor) < pCtx->lineSz)
       		{
-        		cmdParserMoveCursor(pCtx, 1, CMD_PARSER_MOVE_CUR);
+        		cmdParserMoveCursor(pCtx, cmdParserNextLen(pCtx, pCtx->cursor), CMD_PARSER_MOVE_CUR);
       		}
       		else
       		{
@@ -1395,6 +4944,12 @@ static int cmdParserState2(cmdParserInstance_t *pCtx)
 
     	case CMD_IN_ASCII_RANGE('E') : // Go to end of line
     	{
+      		rc = cmdParserSuggestTake(pCtx);
+      		if(rc <= 0)
+      		{
+        		return rc ? -1 : CMD_PARSER_CURRENT_STATE;
+      		}
+
       		if((unsigned)(pCtx->cursor) < pCtx->lineSz)
       		{
         		cmdParserMoveCursor(pCtx, pCtx->lineSz - pCtx->cursor, CMD_PARSER_MOVE_CUR);
@@ -1506,6 +5061,7 @@ static int cmdParserState4(cmdParserInstance_t *pCtx)
     	{
     		const unsigned char *p;
     		unsigned int         cursor;
+    		unsigned int         len = 0;
 
       		// If history activated
       		if(!(pCtx->historyOn))
@@ -1513,35 +5069,58 @@ static int cmdParserState4(cmdParserInstance_t *pCtx)
         		return CMD_PARSER_STATE_1;
       		}
 
+      		cmdParserHistoryLoad(pCtx);
+
+      		// Up/down among the commands beginning with the chars before the
+      		// cursor
+      		if((pCtx->user.historyFlags & CMD_PARSER_HISTORY_PREFIX) && (pCtx->cursor > 0) && (('A' == c) || ('B' == c)))
+      		{
+        		cmdParserHistoryBeginning(pCtx, ('A' == c));
+        		return CMD_PARSER_STATE_2;
+      		}
+
+      		// Save the line being edited when leaving it for the history
+      		if(pCtx->historyCur == (signed)(pCtx->historyInsert))
+      		{
+        		if('B' == c)
+        		{
+          			// Already on the line being edited
+          			return CMD_PARSER_STATE_2;
+        		}
+
+        		cmdParserSaveLine(pCtx);
+      		}
+
       		// Up/down in history
       		if('A' == c)
       		{
-        		rc = cmdParserHistoryUp(pCtx, &p);
+        		rc = cmdParserHistoryUp(pCtx, &p, &len);
         		if(0 != rc)
         		{
-          			p = cmdParserHistoryOldest(pCtx);
+          			p = cmdParserHistoryOldest(pCtx, &len);
         		}
       		}
       		else
       		{
         		if('B' == c)
         		{
-          			rc = cmdParserHistoryDown(pCtx, &p);
+          			rc = cmdParserHistoryDown(pCtx, &p, &len);
           			if(0 != rc)
           			{
             			p = pCtx->savedCmd;
+            			len = pCtx->savedSz;
           			}
         		}
         		else
         		{
           			if('5' == c)
           			{
-            			p = cmdParserHistoryOldest(pCtx);
+            			p = cmdParserHistoryOldest(pCtx, &len);
           			}
           			else
           			{
             			assert('6' == c);
-            			p = cmdParserHistoryNewest(pCtx);
+            			p = cmdParserHistoryNewest(pCtx, &len);
           			}
         		}
       		}
@@ -1554,8 +5133,8 @@ static int cmdParserState4(cmdParserInstance_t *pCtx)
 
       		// Overwrite the current displayed command line by the new one
       		// The cursor is set at the end of the line
-      		cursor = strlen((const char *)p);
-      		cmdParserReplaceLine(pCtx, p, cursor);
+      		cursor = len;
+      		cmdParserReplaceLine(pCtx, p, len, cursor);
       
 			return CMD_PARSER_STATE_2;
     	}
@@ -1563,9 +5142,15 @@ static int cmdParserState4(cmdParserInstance_t *pCtx)
 
     	case 'C' : // RIGHT arrow
     	{
-      		if((unsigned)(pCtx->cursor) < pCtx->user.lineLen)
+      		rc = cmdParserSuggestTake(pCtx);
+      		if(rc <= 0)
       		{
-        		cmdParserMoveCursor(pCtx, 1, CMD_PARSER_MOVE_CUR);
+        		return rc ? -1 : CMD_PARSER_STATE_2;
+      		}
+
+      		if((unsigned)(pCtx->cursor) < pCtx->lineSz)
+      		{
+        		cmdParserMoveCursor(pCtx, cmdParserNextLen(pCtx, pCtx->cursor), CMD_PARSER_MOVE_CUR);
       		}
       		else
       		{
@@ -1579,7 +5164,7 @@ static int cmdParserState4(cmdParserInstance_t *pCtx)
     	{
       		if(pCtx->cursor > 0)
       		{
-        		cmdParserMoveCursor(pCtx, -1, CMD_PARSER_MOVE_CUR);
+        		cmdParserMoveCursor(pCtx, -(int)cmdParserPrevLen(pCtx, pCtx->cursor), CMD_PARSER_MOVE_CUR);
       		}
       		else
       		{
@@ -1600,6 +5185,12 @@ static int cmdParserState4(cmdParserInstance_t *pCtx)
 
     	case 'F' : // END = CTRL E
     	{
+      		rc = cmdParserSuggestTake(pCtx);
+      		if(rc <= 0)
+      		{
+        		return rc ? -1 : CMD_PARSER_STATE_2;
+      		}
+
       		c = CMD_IN_ASCII_RANGE('E');
       		cmdParserUngetChar(pCtx, &c);
 
@@ -1622,6 +5213,8 @@ static int cmdParserState4(cmdParserInstance_t *pCtx)
         		assert(-1 == rc);
         		if(EAGAIN == errno)
         		{
+          			// Put back the '2' to restart from it
+          			c = '2';
           			cmdParserUngetChar(pCtx, &c);
           			return CMD_PARSER_STATE_4 | CMD_PARSER_STATE_AGAIN;
         		}
@@ -1649,6 +5242,8 @@ static int cmdParserState4(cmdParserInstance_t *pCtx)
         		assert(-1 == rc);
         		if(EAGAIN == errno)
         		{
+          			// Put back the '3' to restart from it
+          			c = '3';
           			cmdParserUngetChar(pCtx, &c);
           			return CMD_PARSER_STATE_4 | CMD_PARSER_STATE_AGAIN;
         		}
@@ -1695,7 +5290,6 @@ static int cmdParserState5(cmdParserInstance_t *pCtx)
     	assert(-1 == rc);
     	if(EAGAIN == errno)
     	{
-      		cmdParserUngetChar(pCtx, &c);
       		return CMD_PARSER_STATE_5 | CMD_PARSER_STATE_AGAIN;
     	}
 
@@ -1775,253 +5369,761 @@ static int cmdParserState5(cmdParserInstance_t *pCtx)
 }
 
 
-// action for STATE 6 of FSM
-static int cmdParserState6(cmdParserInstance_t *pCtx)
-{
-	unsigned char  c, c1;
-	int            rc;
+// action for STATE 6 of FSM
+static int cmdParserState6(cmdParserInstance_t *pCtx)
+{
+	unsigned char  c, c1;
+	int            rc;
+
+  	rc = cmdParserGetChar(pCtx, &c);
+
+  	if(rc != 0)
+  	{
+    	assert(-1 == rc);
+    	if(EAGAIN == errno)
+    	{
+      		return CMD_PARSER_STATE_6 | CMD_PARSER_STATE_AGAIN;
+    	}
+
+    	return -1;
+  	}
+
+  	rc = cmdParserGetChar(pCtx, &c1);
+
+  	if(rc != 0)
+  	{
+    	assert(-1 == rc);
+    	if(EAGAIN == errno)
+    	{
+      		cmdParserUngetChar(pCtx, &c);
+      		return CMD_PARSER_STATE_6 | CMD_PARSER_STATE_AGAIN;
+    	}
+
+    	return -1;
+  	}
+
+  	if(c1 != '~')
+  	{
+    	cmdParserUngetChar(pCtx, &c1);
+    	return CMD_PARSER_STATE_1;
+  	}
+
+  	switch(c)
+  	{
+    	case '5' : // FUNCTION key 5
+    	{
+      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_5);
+
+      		return CMD_PARSER_STATE_1;
+    	}
+    	break;
+    	case '7' : // FUNCTION key 6
+    	{
+      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_6);
+
+      		return CMD_PARSER_STATE_1;
+    	}
+   		break;
+    	case '8' : // FUNCTION key 7
+    	{
+      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_7);
+
+      		return CMD_PARSER_STATE_1;
+    	}
+    	break;
+    	case '9' : // FUNCTION key 8
+    	{
+      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_8);
+
+      		return CMD_PARSER_STATE_1;
+    	}
+    	break;
+    	default :
+    	{
+      		cmdParserUngetChar(pCtx, &c);
+      		return CMD_PARSER_STATE_1;
+    	}
+    	break;
+  	}	
+
+  	assert(0);
+}
+
+// action for STATE 7 of FSM
+static int cmdParserState7(cmdParserInstance_t *pCtx)
+{
+	unsigned char c, c1;
+	int           rc;
+
+  	rc = cmdParserGetChar(pCtx, &c);
+
+  	if(rc != 0)
+  	{
+    	assert(-1 == rc);
+    	if(EAGAIN == errno)
+    	{
+      		return CMD_PARSER_STATE_7 | CMD_PARSER_STATE_AGAIN;
+    	}
+
+    	return -1;
+  	}
+
+  	rc = cmdParserGetChar(pCtx, &c1);
+
+  	if(rc != 0)
+  	{
+    	assert(-1 == rc);
+    	if(EAGAIN == errno)
+    	{
+      		cmdParserUngetChar(pCtx, &c);
+      		return CMD_PARSER_STATE_7 | CMD_PARSER_STATE_AGAIN;
+    	}
+
+    	return -1;
+  	}
+
+  	if(c1 != '~')
+  	{
+    	cmdParserUngetChar(pCtx, &c1);
+    	return CMD_PARSER_STATE_1;
+  	}
+
+  	switch(c)
+  	{
+    	case '0' : // FUNCTION key 9
+    	{
+      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_9);
+
+      		return CMD_PARSER_STATE_1;
+    	}
+    	break;
+    	case '1' : // FUNCTION key 10
+    	{
+      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_10);
+
+      		return CMD_PARSER_STATE_1;
+    	}
+    	break;
+    	case '3' : // FUNCTION key 11
+    	{
+      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_11);
+
+      		return CMD_PARSER_STATE_1;
+    	}
+    	break;
+    	case '4' : // FUNCTION key 12
+    	{
+      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_12);
+
+      		return CMD_PARSER_STATE_1;
+    	}
+    	break;
+    	default :
+    	{
+      		cmdParserUngetChar(pCtx, &c);
+      		return CMD_PARSER_STATE_1;
+    	}
+  	}
+
+  	assert(0);
+} 
+
+// action for STATE 8 of FSM
+static int cmdParserState8(cmdParserInstance_t *pCtx)
+{
+	unsigned char c, c1;
+	unsigned char seq[4];
+	int           rc;
+
+  	rc = cmdParserGetChar(pCtx, &c);
+
+  	if(rc != 0)
+  	{
+    	assert(-1 == rc);
+    	if(EAGAIN == errno)
+    	{
+      		return CMD_PARSER_STATE_8 | CMD_PARSER_STATE_AGAIN;
+    	}
+
+    	return -1;
+  	}
+
+  	// UTF-8 char stored as is
+  	if(pCtx->user.utf8)
+  	{
+    	seq[0] = c;
+    	rc = cmdParserGetUtf8(pCtx, seq);
+    	if(rc < 0)
+    	{
+      		if(EAGAIN == errno)
+      		{
+        		return CMD_PARSER_STATE_8 | CMD_PARSER_STATE_AGAIN;
+      		}
+
+      		return -1;
+    	}
+
+    	if(rc > 0)
+    	{
+      		cmdParserAcceptSeq(pCtx, seq, rc);
+    	}
+    	return CMD_PARSER_STATE_1;
+  	}
 
-  	rc = cmdParserGetChar(pCtx, &c);
+  	rc = cmdParserGetChar(pCtx, &c1);
 
   	if(rc != 0)
   	{
     	assert(-1 == rc);
     	if(EAGAIN == errno)
     	{
-      		return CMD_PARSER_STATE_6 | CMD_PARSER_STATE_AGAIN;
+      		cmdParserUngetChar(pCtx, &c);
+      		return CMD_PARSER_STATE_8 | CMD_PARSER_STATE_AGAIN;
     	}
 
     	return -1;
   	}
 
-  	rc = cmdParserGetChar(pCtx, &c1);
+  	// Accented character from man iso_8859-1
+  	if(0xc3 == c && c1 >= 0x80 && c1 <= 0xbf)
+  	{
+    	// c1 + 0x40 = value in man iso_8859-1
+    	CMD_PARSER_ACCEPT_CHAR(pCtx, c1 + 0x40);
+    	return CMD_PARSER_STATE_1;
+  	}
+  	if(0xc2 == c && c1 >= 0xa0 && c1 <= 0xbf)
+  	{
+    	// c1 is the value in man iso_8859-1
+    	CMD_PARSER_ACCEPT_CHAR(pCtx, c1);
+    	return CMD_PARSER_STATE_1;
+  	}
+
+  	// Ignore the chars
+
+  	return CMD_PARSER_STATE_1;
+}
+
+// action for STATE 9 of FSM (reverse search in the history)
+static int cmdParserState9(cmdParserInstance_t *pCtx)
+{
+	unsigned char seq[4];
+	unsigned char c;
+	unsigned int  seqNb;
+	int           len = 1;
+	int           rc;
+
+  	rc = cmdParserGetChar(pCtx, &c);
 
   	if(rc != 0)
   	{
     	assert(-1 == rc);
     	if(EAGAIN == errno)
     	{
-      		cmdParserUngetChar(pCtx, &c);
-      		return CMD_PARSER_STATE_6 | CMD_PARSER_STATE_AGAIN;
+      		return CMD_PARSER_STATE_9 | CMD_PARSER_STATE_AGAIN;
     	}
 
     	return -1;
   	}
 
-  	if(c1 != '~')
-  	{
-    	cmdParserUngetChar(pCtx, &c1);
-    	return CMD_PARSER_STATE_1;
-  	}
-
   	switch(c)
   	{
-    	case '5' : // FUNCTION key 5
+    	case CMD_IN_ASCII_RANGE('R') : // Next older command
     	{
-      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_5);
+      		// The current command stays displayed if there is no other
+      		if(pCtx->searchFound && (0 == cmdParserHistorySearch(pCtx, pCtx->searchPat, pCtx->searchLen, pCtx->searchSeq, &seqNb)))
+      		{
+        		pCtx->searchSeq = seqNb;
+        		cmdParserSearchShow(pCtx);
+      		}
+      		else
+      		{
+        		cmdParserBeep(pCtx);
+      		}
 
-      		return CMD_PARSER_STATE_1;
+      		return CMD_PARSER_CURRENT_STATE;
     	}
     	break;
-    	case '7' : // FUNCTION key 6
-    	{
-      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_6);
 
-      		return CMD_PARSER_STATE_1;
-    	}
-   		break;
-    	case '8' : // FUNCTION key 7
+    	case CMD_IN_ASCII_RANGE('G') : // Abort the search
     	{
-      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_7);
-
+      		cmdParserSearchEnd(pCtx, 0);
       		return CMD_PARSER_STATE_1;
     	}
     	break;
-    	case '9' : // FUNCTION key 8
+
+    	case CMD_IN_ASCII_RANGE('H') :
+    	case 0x7F          : // Remove the last char of the pattern
     	{
-      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_8);
+      		if(!(pCtx->searchLen))
+      		{
+        		cmdParserBeep(pCtx);
+        		return CMD_PARSER_CURRENT_STATE;
+      		}
 
-      		return CMD_PARSER_STATE_1;
+      		do
+      		{
+        		pCtx->searchLen --;
+      		} while(pCtx->user.utf8 && pCtx->searchLen && (0x80 == (pCtx->searchPat[pCtx->searchLen] & 0xc0)));
+
+      		cmdParserSearchFrom(pCtx, pCtx->historySeq);
+      		return CMD_PARSER_CURRENT_STATE;
     	}
     	break;
+
     	default :
     	{
-      		cmdParserUngetChar(pCtx, &c);
-      		return CMD_PARSER_STATE_1;
+      		seq[0] = c;
+
+      		// Multi-byte char
+      		if((c > 0x7f) && (pCtx->user.utf8 || (0xc2 == c) || (0xc3 == c)) && (CMD_PARSER_CTRL_MSG != c))
+      		{
+        		len = cmdParserGetUtf8(pCtx, seq);
+        		if(len < 0)
+        		{
+          			if(EAGAIN == errno)
+          			{
+            			return CMD_PARSER_STATE_9 | CMD_PARSER_STATE_AGAIN;
+          			}
+
+          			return -1;
+        		}
+
+        		// Accented character from man iso_8859-1
+        		if(!(pCtx->user.utf8) && (2 == len))
+        		{
+          			seq[0] = ((c & 0x1f) << 6) | (seq[1] & 0x3f);
+          			len = (seq[0] >= 0xa0) ? 1 : 0;
+        		}
+
+        		// Ignore the chars
+        		if(!len)
+        		{
+          			return CMD_PARSER_CURRENT_STATE;
+        		}
+      		}
+      		else if((c < ' ') || (c > 0x7e))
+      		{
+        		// Any other control key ends the search and applies to the
+        		// matching command
+        		cmdParserSearchEnd(pCtx, 1);
+        		cmdParserUngetChar(pCtx, &c);
+        		return CMD_PARSER_STATE_1;
+      		}
+
+      		if((pCtx->searchLen + len) > CMD_PARSER_SEARCH_LEN)
+      		{
+        		cmdParserBeep(pCtx);
+        		return CMD_PARSER_CURRENT_STATE;
+      		}
+
+      		memcpy(pCtx->searchPat + pCtx->searchLen, seq, len);
+      		pCtx->searchLen += len;
+
+      		// The current command may still match
+      		if(pCtx->searchFound || (pCtx->searchLen == (unsigned)len))
+      		{
+        		cmdParserSearchFrom(pCtx, pCtx->searchFound ? pCtx->searchSeq + 1 : pCtx->historySeq);
+      		}
+      		else
+      		{
+        		cmdParserBeep(pCtx);
+        		cmdParserSearchShow(pCtx);
+      		}
+
+      		return CMD_PARSER_CURRENT_STATE;
     	}
-    	break;
-  	}	
+  	}
 
   	assert(0);
 }
 
-// action for STATE 7 of FSM
-static int cmdParserState7(cmdParserInstance_t *pCtx)
+typedef int (* cmdParserTransition_t)(cmdParserInstance_t *pCtx);
+
+
+static cmdParserTransition_t cmdParserFsm[] =
 {
-	unsigned char c, c1;
-	int           rc;
+  cmdParserState0,
+  cmdParserState1,
+  cmdParserState2,
+  cmdParserState3,
+  cmdParserState4,
+  cmdParserState5,
+  cmdParserState6,
+  cmdParserState7,
+  cmdParserState8,
+  cmdParserState9
+};
 
-  	rc = cmdParserGetChar(pCtx, &c);
+// History expansion
+//
+// The history shortcut (e.g. '!') introduces an event, anywhere in the line:
+//
+//     !!          newest command
+//     !n          command of the slot n of the history
+//     !-n         n-th newest command
+//     !prefix     newest command beginning with 'prefix'
+//     !?str[?]    newest command containing 'str'
+//
+// optionally followed by a word designator: ':n', ':^' (1st argument), ':$'
+// (last argument), ':*' (all the arguments), ':n-m', ':n*' (n to the last
+// one) or ':n-' (n to the one before the last). '!$', '!^' and '!*' are
+// the words of the newest command. The prefixes and the substrings are
+// looked up with the indexes of the history. A shortcut followed by a blank,
+// '=' or the end of the line is left as is, like a shortcut after a
+// backslash or between single quotes.
+
+// buffer of the expanded line
+typedef struct {
+    unsigned char *buf;
+    unsigned int   len;
+    unsigned int   size;
+} cmdParserExpand_t;
+
+// append chars to the expanded line
+static int cmdParserExpandPut(cmdParserExpand_t *exp, const unsigned char *p, unsigned int len)
+{
+    unsigned char *buf;
+    unsigned int   size;
 
-  	if(rc != 0)
-  	{
-    	assert(-1 == rc);
-    	if(EAGAIN == errno)
-    	{
-      		return CMD_PARSER_STATE_7 | CMD_PARSER_STATE_AGAIN;
-    	}
+    if((exp->len + len + 1) > exp->size)
+    {
+        for(size = exp->size ? exp->size : 128; (exp->len + len + 1) > size; size *= 2);
 
-    	return -1;
-  	}
+        buf = (unsigned char *)realloc(exp->buf, size);
+        if(!buf)
+        {
+            return -1;
+        }
+        exp->buf = buf;
+        exp->size = size;
+    }
 
-  	rc = cmdParserGetChar(pCtx, &c1);
+    memcpy(exp->buf + exp->len, p, len);
+    exp->len += len;
 
-  	if(rc != 0)
-  	{
-    	assert(-1 == rc);
-    	if(EAGAIN == errno)
-    	{
-      		cmdParserUngetChar(pCtx, &c);
-      		return CMD_PARSER_STATE_7 | CMD_PARSER_STATE_AGAIN;
-    	}
+    return 0;
+}
 
-    	return -1;
-  	}
+// bounds of a word of a command (the quoted blanks don't split the words)
+static int cmdParserExpandWord(const unsigned char *cmd, unsigned int len, unsigned int n, unsigned int *beg, unsigned int *end)
+{
+    unsigned int  i = 0;
+    unsigned char quote;
 
-  	if(c1 != '~')
-  	{
-    	cmdParserUngetChar(pCtx, &c1);
-    	return CMD_PARSER_STATE_1;
-  	}
+    for(;;)
+    {
+        while((i < len) && CMD_IS_BLANK(cmd[i]))
+        {
+            i++;
+        }
+
+        if(i == len)
+        {
+            return -1;
+        }
+
+        *beg = i;
+        for(quote = 0; (i < len) && (quote || !CMD_IS_BLANK(cmd[i])); i++)
+        {
+            if(quote == cmd[i])
+            {
+                quote = 0;
+            }
+            else if(!quote && (('\'' == cmd[i]) || ('"' == cmd[i])))
+            {
+                quote = cmd[i];
+            }
+        }
+        *end = i;
+
+        if(0 == n--)
+        {
+            return 0;
+        }
+    }
+}
+
+// number of words of a command
+static unsigned int cmdParserExpandWords(const unsigned char *cmd, unsigned int len)
+{
+    unsigned int nb, beg, end;
+
+    for(nb = 0; 0 == cmdParserExpandWord(cmd, len, nb, &beg, &end); nb++);
+
+    return nb;
+}
+
+// word number of a word designator ('^', '$' or a number)
+static int cmdParserExpandWordNb(const unsigned char **pp, unsigned int nb, unsigned int *n)
+{
+    const unsigned char *p = *pp;
+
+    if('^' == *p)
+    {
+        *n = 1;
+        p++;
+    }
+    else if('$' == *p)
+    {
+        *n = nb - 1;
+        p++;
+    }
+    else if(isdigit(*p))
+    {
+        for(*n = 0; isdigit(*p); p++)
+        {
+            *n = (*n * 10) + (*p - '0');
+        }
+    }
+    else
+    {
+        return -1;
+    }
+
+    *pp = p;
+
+    return 0;
+}
+
+// command designated by an event (the pointer moves after the event)
+static cmdParserHistoryRec_t *cmdParserExpandEvent(cmdParserInstance_t *pCtx, const unsigned char **pp)
+{
+    cmdParserHistoryRec_t *newest = pCtx->historySz ? cmdParserHistoryAt(pCtx, pCtx->historySz - 1) : NULL;
+    cmdParserHistoryRec_t *rec = NULL;
+    const unsigned char   *p = *pp;
+    const unsigned char   *s;
+    unsigned int           n, seq, i;
+
+    if(pCtx->user.historyShortCut == *p)
+    {
+        rec = newest;
+        p++;
+    }
+    else if(('$' == *p) || ('^' == *p) || ('*' == *p))
+    {
+        // The word designator follows
+        rec = newest;
+    }
+    else if(isdigit(*p) || (('-' == *p) && isdigit(*(p + 1))))
+    {
+        s = p;
+        for(p += ('-' == *p), n = 0; isdigit(*p); p++)
+        {
+            n = (n * 10) + (*p - '0');
+        }
+
+        if('-' == *s)
+        {
+            // n-th newest command (the tombstones are not counted)
+            for(i = pCtx->historySz; n && (i-- > 0); n -= CMD_PARSER_HISTORY_LIVE(rec) ? 1 : 0)
+            {
+                rec = cmdParserHistoryAt(pCtx, i);
+            }
+
+            if(n)
+            {
+                rec = NULL;
+            }
+        }
+        else
+        {
+            rec = cmdParserHistoryValid(pCtx, n) ? &(pCtx->historyIdx[n]) : NULL;
+        }
+    }
+    else if('?' == *p)
+    {
+        for(s = ++p; *p && ('?' != *p); p++);
+
+        if(0 == cmdParserHistorySearch(pCtx, s, p - s, pCtx->historySeq, &seq))
+        {
+            rec = cmdParserHistoryFind(pCtx, seq);
+        }
+
+        if('?' == *p)
+        {
+            p++;
+        }
+    }
+    else
+    {
+        for(s = p; *p && !CMD_IS_BLANK(*p) && (':' != *p); p++);
+
+        if(0 == cmdParserHistoryPrefix(pCtx, s, p - s, NULL, pCtx->historySeq, 1, &seq))
+        {
+            rec = cmdParserHistoryFind(pCtx, seq);
+        }
+    }
+
+    *pp = p;
+
+    return rec;
+}
+
+// append the words of a command selected by a word designator (the pointer
+// moves after the designator)
+static int cmdParserExpandDesignator(cmdParserInstance_t *pCtx, cmdParserExpand_t *exp, const cmdParserHistoryRec_t *rec, const unsigned char **pp)
+{
+    const unsigned char *cmd = pCtx->history + rec->off;
+    const unsigned char *p = *pp;
+    unsigned int         nb, first, last, beg, end, dummy;
+
+    // Whole command
+    if((':' != *p) && ('$' != *p) && ('^' != *p) && ('*' != *p))
+    {
+        return cmdParserExpandPut(exp, cmd, rec->len);
+    }
+
+    if(':' == *p)
+    {
+        p++;
+    }
 
-  	switch(c)
-  	{
-    	case '0' : // FUNCTION key 9
-    	{
-      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_9);
+    nb = cmdParserExpandWords(cmd, rec->len);
 
-      		return CMD_PARSER_STATE_1;
-    	}
-    	break;
-    	case '1' : // FUNCTION key 10
-    	{
-      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_10);
+    if('*' == *p)
+    {
+        // All the arguments (maybe none)
+        p++;
+        *pp = p;
+        if(nb < 2)
+        {
+            return 0;
+        }
+        first = 1;
+        last = nb - 1;
+    }
+    else
+    {
+        if(!nb || (0 != cmdParserExpandWordNb(&p, nb, &first)))
+        {
+            errno = ENOENT;
+            return -1;
+        }
 
-      		return CMD_PARSER_STATE_1;
-    	}
-    	break;
-    	case '3' : // FUNCTION key 11
-    	{
-      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_11);
+        last = first;
+        if('*' == *p)
+        {
+            p++;
+            last = nb - 1;
+        }
+        else if('-' == *p)
+        {
+            p++;
+            if(0 != cmdParserExpandWordNb(&p, nb, &last))
+            {
+                last = nb - 2;
+            }
+        }
+        *pp = p;
+    }
 
-      		return CMD_PARSER_STATE_1;
-    	}
-    	break;
-    	case '4' : // FUNCTION key 12
-    	{
-      		cmdParserHandleFk(pCtx, CMD_PARSER_FUNC_KEY_12);
+    if((first > last) || (last >= nb))
+    {
+        errno = ENOENT;
+        return -1;
+    }
 
-      		return CMD_PARSER_STATE_1;
-    	}
-    	break;
-    	default :
-    	{
-      		cmdParserUngetChar(pCtx, &c);
-      		return CMD_PARSER_STATE_1;
-    	}
-  	}
+    cmdParserExpandWord(cmd, rec->len, first, &beg, &dummy);
+    cmdParserExpandWord(cmd, rec->len, last, &dummy, &end);
 
-  	assert(0);
-} 
+    return cmdParserExpandPut(exp, cmd + beg, end - beg);
+}
 
-// action for STATE 8 of FSM
-static int cmdParserState8(cmdParserInstance_t *pCtx)
+// expand the history events of the command line (returns 1 if the line is
+// kept as is: no events, an event or a word not found, or no room)
+static int cmdParserHistoryExpand(cmdParserInstance_t *pCtx)
 {
-	unsigned char c, c1;
-	int           rc;
+    cmdParserExpand_t      exp = { NULL, 0, 0 };
+    cmdParserHistoryRec_t *rec;
+    const unsigned char   *p = pCtx->cmd;
+    const unsigned char   *from = p;
+    const unsigned char   *ev;
+    int                    quoted = 0;
+    int                    found = 0;
+
+    for(; *p; p++)
+    {
+        if('\\' == *p)
+        {
+            if(*(p + 1))
+            {
+                p++;
+            }
+            continue;
+        }
 
-  	rc = cmdParserGetChar(pCtx, &c);
+        if('\'' == *p)
+        {
+            quoted = !quoted;
+            continue;
+        }
 
-  	if(rc != 0)
-  	{
-    	assert(-1 == rc);
-    	if(EAGAIN == errno)
-    	{
-      		return CMD_PARSER_STATE_8 | CMD_PARSER_STATE_AGAIN;
-    	}
+        if(quoted || (pCtx->user.historyShortCut != *p) || !*(p + 1) ||
+           CMD_IS_BLANK(*(p + 1)) || ('=' == *(p + 1)))
+        {
+            continue;
+        }
 
-    	return -1;
-  	}
+        // Chars before the event
+        if(0 != cmdParserExpandPut(&exp, from, p - from))
+        {
+            goto error;
+        }
 
-  	rc = cmdParserGetChar(pCtx, &c1);
+        ev = p + 1;
+        rec = cmdParserExpandEvent(pCtx, &ev);
+        if(!rec)
+        {
+            free(exp.buf);
+            return 1;
+        }
 
-  	if(rc != 0)
-  	{
-    	assert(-1 == rc);
-    	if(EAGAIN == errno)
-    	{
-      		cmdParserUngetChar(pCtx, &c);
-      		return CMD_PARSER_STATE_8 | CMD_PARSER_STATE_AGAIN;
-    	}
+        if(0 != cmdParserExpandDesignator(pCtx, &exp, rec, &ev))
+        {
+            goto error;
+        }
 
-    	return -1;
-  	}
+        found = 1;
+        from = ev;
+        p = ev - 1;
+    }
 
-  	// Accented character from man iso_8859-1
-  	if(0xc3 == c && c1 >= 0x80 && c1 <= 0xbf)
-  	{
-    	// c1 + 0x40 = value in man iso_8859-1
-    	CMD_PARSER_ACCEPT_CHAR(pCtx, c1 + 0x40);
-    	return CMD_PARSER_STATE_1;
-  	}
-  	if(0xc2 == c && c1 >= 0xa0 && c1 <= 0xbf)
-  	{
-    	// c1 is the value in man iso_8859-1
-    	CMD_PARSER_ACCEPT_CHAR(pCtx, c1);
-    	return CMD_PARSER_STATE_1;
-  	}
+    if(!found)
+    {
+        return 1;
+    }
 
-  	// Ignore the chars
+    if(0 != cmdParserExpandPut(&exp, from, p - from))
+    {
+        goto error;
+    }
 
-  	return CMD_PARSER_STATE_1;
-}
+    // The expanded line replaces the command line
+    if((exp.len > pCtx->lineSz) && (0 != cmdParserLineReserve(pCtx, exp.len - pCtx->lineSz)))
+    {
+        goto error;
+    }
 
-typedef int (* cmdParserTransition_t)(cmdParserInstance_t *pCtx);
+    memcpy(pCtx->cmd, exp.buf, exp.len);
+    pCtx->cmd[exp.len] = '\0';
+    pCtx->lineSz = exp.len;
+    pCtx->gapPos = exp.len;
 
+    free(exp.buf);
 
-static cmdParserTransition_t cmdParserFsm[] =
-{
-  cmdParserState0,
-  cmdParserState1,
-  cmdParserState2,
-  cmdParserState3,
-  cmdParserState4,
-  cmdParserState5,
-  cmdParserState6,
-  cmdParserState7,
-  cmdParserState8
-};
+    return 0;
 
-// check if a sting is a number
-static int cmdParserIsNumber(const unsigned char *str)
-{
-  	while(*str)
-  	{
-    	if(!isdigit(*str))
-    	{
-      		return 0;
-    	}
-    	str++;
-  	}
+error:
 
-  	return 1;
+    free(exp.buf);
+
+    return (ENOMEM == errno) ? -1 : 1;
 }
 
 
 // get a cmd
 static int cmdParserGet(cmdParserInstance_t *pCtx)
 {
-	unsigned char *p;
 	int            newState;
 	int            save;
 
@@ -2076,82 +6178,24 @@ static int cmdParserGet(cmdParserInstance_t *pCtx)
   	// If no errors, check if it is not an history invocation
   	if(pCtx->state == CMD_PARSER_STATE_0)
   	{
-    	// If the history is activated
-    	if(pCtx->historyOn)
-    	{
-      		// If the history shortcut is configured
-      		if(pCtx->user.historyShortCut)
-      		{
-        		// Look for the shortcut at the first non blank position
-        		// in the command line
-        		p = pCtx->cmd;
-        		while(*p && CMD_IS_BLANK(*p))
-        		{
-          			p ++;
-        		}
+    	// Hand over a contiguous line
+    	cmdParserLineFlat(pCtx);
 
-        		// If the line is not empty or not full of blanks
-        		if(*p)
-        		{
-          			// If the 1st non blank char is the history shortcut
-          			if(pCtx->user.historyShortCut == *p)
-          			{
-          				unsigned int i;
-
-            			// Get the history index
-            			p++;
-            			if(!(*p))
-            			{
-              				// No index, return the line to the user
-              				goto historyAdd;
-            			}
-
-            			// If it is a reference to the last command of the history (e.g. !!)
-            			if((pCtx->user.historyShortCut == *p) && !(*(p + 1)))
-            			{
-            				const unsigned char *p1;
-
-              				// Get the newest command from the history
-              				p1 = cmdParserHistoryNewest(pCtx);
-              				if(!p1)
-              				{
-                				// The history is empty, return the line to the user
-                				goto historyAdd;
-              				}
-              				else
-              				{
-                				strcpy((char *)(pCtx->cmd), (const char *)p1);
-
-                				// Update the line size
-                				pCtx->lineSz = strlen((char *)(pCtx->cmd));
-              				}
-
-              				return 0;
-            			}
-
-            			if(!cmdParserIsNumber(p))
-            			{
-              				// Bad index, return the line to the user
-              				goto historyAdd;
-            			}
-
-            			i = atoi((char *)p);
-            			if((0 == pCtx->historySz) || (i >= pCtx->historySz))
-            			{
-              				// Index out of range, return the line to the user
-              				goto historyAdd;
-            			}
-
-            			// This will load 'pCtx->cmd' with the history entry
-            			p = cmdParserHistoryGet((cmdParser_t *)&(pCtx->user.ctx), i);
-            			assert(p);
-
-          			} 
-        		} 
-      		}
+    	// A control message is handed over as is (binary payload)
+    	if(pCtx->lineSz && (CMD_PARSER_CTRL_MSG == pCtx->cmd[0]))
+    	{
+      		return 0;
     	}
 
-historyAdd:
+    	// The history is about to be used
+    	cmdParserHistoryLoad(pCtx);
+
+    	// Expand the history events (the line is returned as is if one of
+    	// them is not found)
+    	if(pCtx->historyOn && pCtx->user.historyShortCut && (cmdParserHistoryExpand(pCtx) < 0))
+    	{
+      		return -1;
+    	}
 
     	// Store the line in the history
     	cmdParserHistoryAdd(pCtx);
@@ -2163,7 +6207,7 @@ historyAdd:
   	if(pCtx->state & CMD_PARSER_STATE_AGAIN)
   	{
     	// Make sure we are configured to behave like that
-    	assert(pCtx->user.nonBlocking);
+    	assert(pCtx->user.nonBlocking || pCtx->user.onEvent);
 
     	// Compute the next state
     	pCtx->state = pCtx->state & ~CMD_PARSER_STATE_AGAIN;
@@ -2181,6 +6225,97 @@ historyAdd:
 }
 
 
+// set up the reading of a script: a file is mapped, a pipe (or any other
+// input) is read in a buffer
+static int cmdParserBatchOpen(cmdParserInstance_t *pCtx)
+{
+    struct stat st;
+    off_t       off;
+    size_t      delta;
+    void        *p;
+
+    pCtx->batch = 1;
+
+    // The mapping is private: the newlines are replaced by NULs in place
+    // (the kernel copies only the pages written)
+    off = lseek(pCtx->user.fdIn, 0, SEEK_CUR);
+    if((0 == fstat(pCtx->user.fdIn, &st)) && S_ISREG(st.st_mode) && (off >= 0))
+    {
+        if(st.st_size <= off)
+        {
+            pCtx->batchEof = 1;
+            return 0;
+        }
+
+        delta = off % sysconf(_SC_PAGESIZE);
+        pCtx->batchMapLen = (st.st_size - off) + delta;
+        p = mmap(NULL, pCtx->batchMapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE, pCtx->user.fdIn, off - delta);
+        if(MAP_FAILED != p)
+        {
+            (void)madvise(p, pCtx->batchMapLen, MADV_SEQUENTIAL);
+            pCtx->batchMap = (unsigned char *)p;
+            pCtx->batchBuf = pCtx->batchMap + delta;
+            pCtx->batchLen = st.st_size - off;
+            pCtx->batchOff = off;
+            pCtx->batchEof = 1;
+            return 0;
+        }
+
+        // Read like a pipe
+        pCtx->batchMapLen = 0;
+    }
+
+    pCtx->batchSz  = CMD_PARSER_BATCH_BUF_LEN;
+    pCtx->batchBuf = (unsigned char *)malloc(pCtx->batchSz);
+    if(!(pCtx->batchBuf))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// release the input of a script (the file offset is left after the lines
+// handed over)
+static void cmdParserBatchClose(cmdParserInstance_t *pCtx)
+{
+    if(pCtx->batchMap)
+    {
+        (void)lseek(pCtx->user.fdIn, pCtx->batchOff + pCtx->batchHead, SEEK_SET);
+        munmap(pCtx->batchMap, pCtx->batchMapLen);
+    }
+    else
+    {
+        free(pCtx->batchBuf);
+    }
+    free(pCtx->batchRes);
+
+    pCtx->batchMap = NULL;
+    pCtx->batchBuf = NULL;
+    pCtx->batchRes = NULL;
+}
+
+// free an instance along with its command line
+static void cmdParserFree(cmdParserInstance_t *pCtx)
+{
+  	free(pCtx->cmd);
+  	free(pCtx->savedCmd);
+  	free(pCtx->result);
+  	cmdParserIndexFree(&(pCtx->trigrams));
+  	cmdParserIndexFree(&(pCtx->prefixes));
+  	free(pCtx->suggestSet);
+  	cmdParserBatchClose(pCtx);
+  	cmdParserLogClose(pCtx);
+  	free(pCtx->logPath);
+  	cmdParserShmClose(pCtx);
+
+  	// For debug purposes, reset the memory zone
+  	memset(pCtx, 0, sizeof(*pCtx));
+
+  	// Free the memory zone
+  	free(pCtx);
+}
+
 // get a new CMD instance
 cmdParser_t *cmdParserNew(cmdParserParam_t *param)
 {
@@ -2188,6 +6323,12 @@ cmdParser_t *cmdParserNew(cmdParserParam_t *param)
 	cmdParserInstance_t  *pCtx;
 	struct termios       newTermSettings;
 	int                  rc;
+	unsigned int         inBufSz;
+	unsigned int         outBufSz;
+	unsigned int         historyBytes;
+	unsigned int         dupsSz = 0;
+	unsigned int         slots;
+	int                  search;
 
   	if(!param)
   	{
@@ -2204,14 +6345,22 @@ cmdParser_t *cmdParserNew(cmdParserParam_t *param)
     	return NULL;
   	}
 
-  	if(param->fdIn < 0)
+  	if(param->lineMaxLen && (param->lineMaxLen < param->lineLen))
+  	{
+    	CMD_PARSER_ERR(NULL, "The maximum length of the command line (%u) is lower than its length (%u)\n", param->lineMaxLen, param->lineLen);
+    	errno = EINVAL;
+    	return NULL;
+  	}
+
+  	// The file descriptors are not used by an instance fed by the user
+  	if((param->fdIn < 0) && !(param->onEvent))
   	{
     	CMD_PARSER_ERR(NULL, "Invalid input file descriptor (%d)\n", param->fdIn);
     	errno = EINVAL;
     	return NULL;
   	}
 
-  	if(param->fdOut < 0)
+  	if((param->fdOut < 0) && !(param->onEvent))
   	{
     	CMD_PARSER_ERR(NULL, "Invalid output file descriptor (%d)\n", param->fdOut);
     	errno = EINVAL;
@@ -2226,11 +6375,39 @@ cmdParser_t *cmdParserNew(cmdParserParam_t *param)
    		return NULL;
   	}
 
-  	// Allocate an instance along with the buffers belonging to it
-  	pCtx = (cmdParserInstance_t *)malloc(sizeof(cmdParserInstance_t)           + // Main structure
-                                      	param->lineLen                      + // Command line
-                                      	param->lineLen                      + // Saved command line
-                                      	(param->historyLen * param->lineLen)   // History
+  	inBufSz = param->inBufLen ? param->inBufLen : CMD_PARSER_IN_BUF_LEN;
+  	outBufSz = (param->outBufLen > 1) ? param->outBufLen : CMD_PARSER_OUT_BUF_LEN;
+
+  	// A command of the initial length always fits in the history
+  	historyBytes = param->historyBytes ? param->historyBytes : (param->historyLen * CMD_PARSER_HISTORY_REC_LEN);
+  	if(historyBytes < param->lineLen)
+  	{
+    	historyBytes = param->lineLen;
+  	}
+  	if(!(param->historyLen))
+  	{
+    	historyBytes = 0;
+  	}
+  	search = param->historyLen && (param->historyFlags & CMD_PARSER_HISTORY_SEARCH);
+
+  	// The table of duplicates is at most half full, and the index has room
+  	// for the tombstones of the duplicates
+  	slots = param->historyLen;
+  	if(param->historyLen && (param->historyFlags & CMD_PARSER_HISTORY_NO_DUPS))
+  	{
+    	for(dupsSz = 1; dupsSz < (2 * param->historyLen); dupsSz *= 2);
+    	slots = 2 * param->historyLen;
+  	}
+
+  	// Allocate an instance along with the buffers belonging to it (the
+  	// command line is allocated apart as it grows with the edited line)
+  	pCtx = (cmdParserInstance_t *)malloc(sizeof(cmdParserInstance_t)                       + // Main structure
+                                      	(slots * sizeof(cmdParserHistoryRec_t))         + // History index
+                                      	(dupsSz * sizeof(cmdParserHistoryDup_t))        + // Table of duplicates
+                                      	inBufSz                                         + // Input ring
+                                      	outBufSz                                        + // Output buffer
+                                      	(search ? CMD_PARSER_SEARCH_LEN : 0)            + // Pattern of the reverse search
+                                      	historyBytes                                      // History
                                      	);
   	if(NULL == pCtx)
   	{
@@ -2245,8 +6422,14 @@ cmdParser_t *cmdParserNew(cmdParserParam_t *param)
 
   	// Populate the instance
   	pCtx->user           = *param;
-  	pCtx->cmd       = (unsigned char *)(pCtx + 1);
-  	pCtx->savedCmd = pCtx->cmd + param->lineLen;
+  	pCtx->historyIdx     = (cmdParserHistoryRec_t *)(pCtx + 1);
+  	pCtx->historySlots   = slots;
+  	pCtx->dups           = dupsSz ? (cmdParserHistoryDup_t *)(pCtx->historyIdx + slots) : NULL;
+  	pCtx->dupsSz         = dupsSz;
+  	pCtx->inBuf          = (unsigned char *)((cmdParserHistoryDup_t *)(pCtx->historyIdx + slots) + dupsSz);
+  	pCtx->inBufSz        = inBufSz;
+  	pCtx->outBuf         = pCtx->inBuf + inBufSz;
+  	pCtx->outBufSz       = outBufSz;
  	pCtx->state          = CMD_PARSER_STATE_0;
   	pCtx->prevState     = CMD_PARSER_STATE_0;
   	pCtx->functionKey   = NULL;
@@ -2255,15 +6438,104 @@ cmdParser_t *cmdParserNew(cmdParserParam_t *param)
   	if(param->historyLen)
   	{
     	pCtx->historyOn = 1;
-    	pCtx->history   = pCtx->savedCmd + param->lineLen;
+    	pCtx->statusSeq = CMD_PARSER_HISTORY_NEWEST;
+    	pCtx->suggestSeq = CMD_PARSER_HISTORY_NEWEST;
+    	pCtx->logLastSeq = CMD_PARSER_HISTORY_NEWEST;
+    	pCtx->history   = pCtx->outBuf + outBufSz;
+    	pCtx->historyBytes = historyBytes;
+
+    	// The pattern of the reverse search is before the history
+    	if(search)
+    	{
+      		pCtx->searchPat = pCtx->history;
+      		pCtx->history += CMD_PARSER_SEARCH_LEN;
+    	}
+
+    	// The history expansion looks for substrings and prefixes as well
+    	if(search || param->historyShortCut)
+    	{
+      		pCtx->trigrams.on  = 1;
+      		pCtx->trigrams.add = cmdParserTrigramAdd;
+    	}
+
+    	if((param->historyFlags & (CMD_PARSER_HISTORY_PREFIX | CMD_PARSER_HISTORY_SUGGEST)) || param->historyShortCut)
+    	{
+      		pCtx->prefixes.on  = 1;
+      		pCtx->prefixes.add = cmdParserPrefixAdd;
+    	}
   	}
   	else
   	{
     	pCtx->historyOn = 0;
   	}
 
+  	// Command line (the translated line is needed only for iso_8859-1)
+  	pCtx->cmdSz    = param->lineLen;
+  	pCtx->cmd      = (unsigned char *)malloc(param->lineLen);
+  	pCtx->savedCmd = (unsigned char *)malloc(param->lineLen);
+  	pCtx->result   = param->utf8 ? NULL : (unsigned char *)malloc(2 * param->lineLen);
+  	if(!(pCtx->cmd) || !(pCtx->savedCmd) || (!(param->utf8) && !(pCtx->result)))
+  	{
+    	errSav = errno;
+    	CMD_PARSER_ERR(NULL, "Error %d while allocating the command line\n", errno);
+    	cmdParserFree(pCtx);
+   		errno = errSav;
+    	return NULL;
+  	}
+
+  	// Warm up the history with the file of the previous instances (it is
+  	// only opened here to display the first prompt at once)
+  	if(param->historyLen && param->historyFile)
+  	{
+    	if(0 != cmdParserLogOpen(pCtx, param->historyFile))
+    	{
+      		// The history is kept in memory only
+      		CMD_PARSER_ERR(NULL, "Error %d while opening the history file '%s': history not saved\n", errno, param->historyFile);
+    	}
+    	else
+    	{
+      		// The history is loaded when the user needs it or is idle
+      		pCtx->logLoading = 1;
+    	}
+  	}
+
+  	// Share the history with the other processes
+  	if(param->historyLen && param->historyShm)
+  	{
+    	if(0 != cmdParserShmOpen(pCtx, param->historyShm))
+    	{
+      		errSav = errno;
+      		CMD_PARSER_ERR(NULL, "Error %d while attaching the shared history '%s'\n", errno, param->historyShm);
+      		cmdParserFree(pCtx);
+      		errno = errSav;
+      		return NULL;
+    	}
+  	}
+
   	// By default, echo is activated
   	pCtx->echoOn = 1;
+  	pCtx->echoWanted = 1;
+
+  	// Over telnet, the server echoes the chars one by one and wants the
+  	// size of the window (the answers are processed with the input)
+  	if(param->telnet)
+  	{
+    	pCtx->telnet.willEcho = 1;
+    	pCtx->telnet.willSga  = 1;
+    	pCtx->telnet.doNaws   = 1;
+    	cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_WILL, CMD_PARSER_TELNET_ECHO);
+    	cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_WILL, CMD_PARSER_TELNET_SGA);
+    	cmdParserTelnetSend(pCtx, CMD_PARSER_TELNET_DO, CMD_PARSER_TELNET_NAWS);
+  	}
+
+  	// The prompt is displayed by the caller
+  	pCtx->promptWidth = -1;
+
+  	// No terminal behind an instance fed by the user
+  	if(param->onEvent)
+  	{
+    	return (cmdParser_t *)&(pCtx->user.ctx);
+  	}
 
   	// If non blocking mode is requested, set the attribute on the input
   	if(param->nonBlocking)
@@ -2275,9 +6547,30 @@ cmdParser_t *cmdParserNew(cmdParserParam_t *param)
       		errSav = errno;
       		CMD_PARSER_ERR(NULL, "Error %d while setting NO_BLOCK flag on input\n", errno);
       		errno = errSav;
-      		free(pCtx);
+      		cmdParserFree(pCtx);
+      		return NULL;
+    	}
+  	}
+
+  	// The telnet client has its own terminal
+  	if(param->telnet)
+  	{
+    	return (cmdParser_t *)&(pCtx->user.ctx);
+  	}
+
+  	// Input from a file or a pipe: script read line by line
+  	if(!isatty(param->fdIn))
+  	{
+    	if(0 != cmdParserBatchOpen(pCtx))
+    	{
+      		errSav = errno;
+      		CMD_PARSER_ERR(NULL, "Error %d while setting up the reading of the script\n", errno);
+      		cmdParserFree(pCtx);
+      		errno = errSav;
       		return NULL;
     	}
+
+    	return (cmdParser_t *)&(pCtx->user.ctx);
   	}
   	
    	// Save the terminal's settings
@@ -2287,7 +6580,7 @@ cmdParser_t *cmdParserNew(cmdParserParam_t *param)
    		errSav = errno;
    		CMD_PARSER_ERR(NULL, "Error %d while getting input terminal attributes\n", errno);
    		errno = errSav;
-   		free(pCtx);
+   		cmdParserFree(pCtx);
    		return NULL;
   	}
 
@@ -2302,7 +6595,7 @@ cmdParser_t *cmdParserNew(cmdParserParam_t *param)
     	errSav = errno;
       	CMD_PARSER_ERR(NULL, "Error %d on tcsetattr()\n", errno);
       	errno = errSav;
-      	free(pCtx);
+      	cmdParserFree(pCtx);
       	return NULL;
     }
   	
@@ -2325,11 +6618,21 @@ void cmdParserDelete(cmdParser_t *pInst)
 
   	// Make sure the parameter points on something which looks like an instance
   	assert(pCtx->user.lineLen > 0);
-  	assert(pCtx->user.fdIn >= 0);
-  	assert(pCtx->user.fdOut >= 0);
+  	assert((pCtx->user.fdIn >= 0) || pCtx->user.onEvent);
+  	assert((pCtx->user.fdOut >= 0) || pCtx->user.onEvent);
+
+  	// Display what may remain in the output buffer
+  	cmdParserFlushOut(pCtx);
+
+  	// No terminal behind an instance fed by the user
+  	if(pCtx->user.onEvent)
+  	{
+    	cmdParserFree(pCtx);
+    	return;
+  	}
 
     // Set back the terminal settings
-    if(0 != tcsetattr(pCtx->user.fdIn, TCSANOW, &(pCtx->origTermSettings)))
+    if(!(pCtx->user.telnet) && !(pCtx->batch) && (0 != tcsetattr(pCtx->user.fdIn, TCSANOW, &(pCtx->origTermSettings))))
     {
       	CMD_PARSER_ERR(pCtx, "Error %d on tcsetattr(%d)\n", errno, pCtx->user.fdIn);
     }
@@ -2340,14 +6643,10 @@ void cmdParserDelete(cmdParser_t *pInst)
     	if (-1 == fcntl(pCtx->user.fdIn, F_SETFL, pCtx->inFlag))
     	{
       		CMD_PARSER_ERR(pCtx, "Error %d on fcntl()\n", errno);
-    	}
-  	}
-
-  	// For debug purposes, reset the memory zone
-  	memset(pCtx, 0, sizeof(*pCtx));
+    	}
+  	}
 
-  	// Free the memory zone
-  	free(pCtx);
+  	cmdParserFree(pCtx);
 }
 
 // set debug level
@@ -2382,15 +6681,33 @@ int cmdParserSetEcho(cmdParser_t *pInst, int echo)
     	return -1;
   	}
 
-  	prev = pCtx->echoOn;
+  	prev = pCtx->echoWanted;
   	assert(prev >= 0);
 
-  	pCtx->echoOn = echo;
+  	pCtx->echoWanted = echo;
+  	cmdParserTelnetEcho(pCtx);
 
   	return prev;
 }
 
 
+//set the width of the prompt displayed before the command line (-1 if unknown)
+int cmdParserSetPromptWidth(cmdParser_t *pInst, int width)
+{
+    cmdParserInstance_t *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+
+  	if(!pCtx || (width < -1))
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	pCtx->promptWidth = width;
+
+  	return 0;
+}
+
+
 //set/unset history
 int cmdParserSetHistory(cmdParser_t *pInst, int history)
 {
@@ -2412,70 +6729,227 @@ int cmdParserSetHistory(cmdParser_t *pInst, int history)
 }
 
 
-// translate iso_8859-1 chars
-static int cmdParserTranslateAccents(cmdParserInstance_t *pCtx)
+// translate iso_8859-1 chars into UTF-8 (room for twice the chars in
+// 'p1') and return the end of the translation
+static unsigned char *cmdParserLatin1ToUtf8(unsigned char *p1, const unsigned char *p, const unsigned char *end)
 {
-	unsigned int   max = pCtx->user.lineLen;
-	unsigned int   len = pCtx->lineSz;
-	unsigned int   holes = max - len - 1;
-	unsigned char *p = pCtx->cmd, *p1;
-	unsigned char  c;
+	const unsigned char *q;
+
+  	while(p < end)
+  	{
+    	// Copy the run of ASCII chars
+    	q = cmdParserAsciiRun(p, end);
+    	memcpy(p1, p, q - p);
+    	p1 += q - p;
+    	p = q;
+
+    	// Char out of ASCII set
+    	if(p < end)
+    	{
+      		memcpy(p1, cmdParserLatin1[*p - 0x80], 2);
+      		p1 += 2;
+      		p++;
+    	}
+  	}
 
-  	assert(strlen((char *)(pCtx->cmd)) == len);
+  	return p1;
+}
+
+// translate iso_8859-1 chars into UTF-8 in the result buffer
+static unsigned char *cmdParserTranslateAccents(cmdParserInstance_t *pCtx)
+{
+	unsigned char *p1;
 
   	// If it is a control message, there no translation to do
-  	if(CMD_PARSER_CTRL_MSG == *p)
+  	if((pCtx->lineSz > 0) && (CMD_PARSER_CTRL_MSG == *(pCtx->cmd)))
   	{
-    	return 0;
+    	pCtx->resultSz = pCtx->lineSz;
+    	return pCtx->cmd;
   	}
 
-  	while (*p)
+  	p1 = cmdParserLatin1ToUtf8(pCtx->result, pCtx->cmd, pCtx->cmd + pCtx->lineSz);
+  	*p1 = '\0';
+
+  	// Update the effective size of the line
+  	pCtx->resultSz = p1 - pCtx->result;
+
+  	return pCtx->result;
+}
+
+// command line handed over to the user (in UTF-8)
+static unsigned char *cmdParserResult(cmdParserInstance_t *pCtx)
+{
+  	// The line is already in UTF-8
+  	if(pCtx->user.utf8)
   	{
-    	// If *p out of ASCII set
-    	if(*p > 0x7f)
-    	{
-      		// Is there a remaining hole ?
-      		if(!holes)
-      		{
-        		errno = ENOSPC;
-        		return -1;
-      		}
+    	pCtx->resultSz = pCtx->lineSz;
+    	return pCtx->cmd;
+  	}
 
-      		c = *p;
+  	// Translate the accented characters
+  	return cmdParserTranslateAccents(pCtx);
+}
 
-      		if(*p >= 0xc0)
-      		{
-        		*p = 0xc3;
-        		c -= 0x40;
-      		}
-      		else
-      		{
-        		*p = 0xc2;
-      		}
 
-      		// Shift the string
-      		p1 = pCtx->cmd + len;
-      		while(p1 > p)
-      		{
-        		*(p1 + 1) = *p1;
-        		p1--;
-      		}
-      		*(p + 1) = c;
-      		p += 2;
-      		len += 1;
+// hand over a line of a script: in place when possible (NUL instead of
+// the newline), apart when it must be translated or has no room for the
+// NUL (last line of a mapped file)
+static unsigned char *cmdParserBatchResult(cmdParserInstance_t *pCtx, unsigned char *line, size_t len, int inPlace)
+{
+    unsigned char *p;
+    size_t        sz;
 
-      		holes--;
-    	}
-    	else
-    	{
-      		p++;
-    	}
-  	}
+    // CR LF end of line
+    if(len && ('\r' == line[len - 1]))
+    {
+        len--;
+    }
 
-  	// Update the effective size of the line
-  	pCtx->lineSz = len;
+    if(pCtx->user.lineMaxLen && (len > pCtx->user.lineMaxLen))
+    {
+        len = pCtx->user.lineMaxLen;
+    }
 
-  	return 0;
+    if(!(pCtx->user.utf8) && (cmdParserAsciiRun(line, line + len) != (line + len)))
+    {
+        inPlace = 0;
+    }
+
+    if(inPlace)
+    {
+        line[len] = '\0';
+        pCtx->resultSz = len;
+        return line;
+    }
+
+    sz = (2 * len) + 1;
+    if(sz > pCtx->batchResSz)
+    {
+        p = (unsigned char *)realloc(pCtx->batchRes, sz);
+        if(!p)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+        pCtx->batchRes   = p;
+        pCtx->batchResSz = sz;
+    }
+
+    if(pCtx->user.utf8)
+    {
+        memcpy(pCtx->batchRes, line, len);
+        p = pCtx->batchRes + len;
+    }
+    else
+    {
+        p = cmdParserLatin1ToUtf8(pCtx->batchRes, line, line + len);
+    }
+    *p = '\0';
+    pCtx->resultSz = p - pCtx->batchRes;
+
+    return pCtx->batchRes;
+}
+
+// next line of a script (the lines are split with memchr() which scans
+// the input several bytes at a time)
+static unsigned char *cmdParserBatchLine(cmdParserInstance_t *pCtx)
+{
+    unsigned char *line;
+    unsigned char *nl;
+    size_t        len;
+    ssize_t       rc;
+    void          *p;
+
+    for(;;)
+    {
+        line = pCtx->batchBuf + pCtx->batchHead;
+        len  = pCtx->batchLen - pCtx->batchHead;
+
+        nl = len ? (unsigned char *)memchr(line, '\n', len) : NULL;
+        if(nl)
+        {
+            pCtx->batchHead += (nl - line) + 1;
+
+            // End of a line too long
+            if(pCtx->batchSkip)
+            {
+                pCtx->batchSkip = 0;
+                continue;
+            }
+
+            return cmdParserBatchResult(pCtx, line, nl - line, 1);
+        }
+
+        if(pCtx->batchEof)
+        {
+            pCtx->batchHead = pCtx->batchLen;
+
+            // Last line without a newline
+            if(len && !(pCtx->batchSkip))
+            {
+                return cmdParserBatchResult(pCtx, line, len, !(pCtx->batchMap));
+            }
+
+            errno = ECONNRESET;
+            return NULL;
+        }
+
+        // Make room for more input
+        if(pCtx->batchSkip)
+        {
+            pCtx->batchLen = 0;
+        }
+        else if(pCtx->batchHead)
+        {
+            memmove(pCtx->batchBuf, line, len);
+            pCtx->batchLen = len;
+        }
+        pCtx->batchHead = 0;
+
+        // The beginning of a line too long is handed over, its end skipped
+        if(pCtx->user.lineMaxLen && (pCtx->batchLen > pCtx->user.lineMaxLen))
+        {
+            pCtx->batchSkip = 1;
+            pCtx->batchHead = pCtx->batchLen;
+            return cmdParserBatchResult(pCtx, pCtx->batchBuf, pCtx->batchLen, 1);
+        }
+
+        // Room for a NUL at the end of the last line
+        if((pCtx->batchLen + 1) >= pCtx->batchSz)
+        {
+            p = realloc(pCtx->batchBuf, 2 * pCtx->batchSz);
+            if(!p)
+            {
+                errno = ENOMEM;
+                return NULL;
+            }
+            pCtx->batchBuf = (unsigned char *)p;
+            pCtx->batchSz *= 2;
+        }
+
+        do
+        {
+            rc = read(pCtx->user.fdIn, pCtx->batchBuf + pCtx->batchLen, pCtx->batchSz - pCtx->batchLen - 1);
+        } while((rc < 0) && (EINTR == errno));
+
+        if(rc < 0)
+        {
+            if(EAGAIN != errno)
+            {
+                CMD_PARSER_ERR(pCtx, "Error '%s' (%d) on read(%d)\n", strerror(errno), errno, pCtx->user.fdIn);
+            }
+            return NULL;
+        }
+
+        pCtx->stats.inReads++;
+        pCtx->stats.inBytes += rc;
+
+        if(0 == rc)
+        {
+            pCtx->batchEof = 1;
+        }
+        pCtx->batchLen += rc;
+    }
 }
 
 
@@ -2494,24 +6968,111 @@ unsigned char *cmdParserInteract(cmdParser_t *pInst)
     	return NULL;
   	}
 
+  	// No edition on the lines of a script
+  	if(pCtx->batch)
+  	{
+    	return cmdParserBatchLine(pCtx);
+  	}
+
+  	// Make use of the time the user takes to type
+  	cmdParserHistoryIdle(pCtx);
+
   	rc = cmdParserGet(pCtx);
+
+  	// Display what has been echoed during the edition
+  	cmdParserFlushOut(pCtx);
+
   	if(0 == rc)
   	{
-    	// Translate the accented characters
-    	rc = cmdParserTranslateAccents(pCtx);
+    	return cmdParserResult(pCtx);
+  	}
+  	else
+  	{
+    	return NULL;
+  	}
+}
+
+// read cmd along with its length (the line may contain NULs if it is a
+// control message)
+int cmdParserInteractView(cmdParser_t *pInst, cmdParserView_t *view)
+{
+	unsigned char *p;
+
+  	if(!view)
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	p = cmdParserInteract(pInst);
+  	if(!p)
+  	{
+    	return -1;
+  	}
+
+  	view->data = p;
+  	view->len  = CMD_PARSER_USER_TO_INSTANCE(pInst)->resultSz;
+
+  	return 0;
+}
+
+// hand over input chars to an instance (events through the onEvent
+// callback: completed lines, data to display and end of input)
+int cmdParserFeed(cmdParser_t *pInst, const unsigned char *buf, unsigned int len)
+{
+	cmdParserInstance_t *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+	cmdParserEvent_t    ev;
+	int                 rc;
+
+  	errno = 0;
+
+  	if(!pCtx || !(pCtx->user.onEvent) || (!buf && len))
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	pCtx->feedBuf = buf;
+  	pCtx->feedLen = len;
+
+  	// Up to the last char (the state machine waits for the next ones in
+  	// the middle of a sequence)
+  	for(;;)
+  	{
+    	rc = cmdParserGet(pCtx);
     	if(0 == rc)
     	{
-      		return pCtx->cmd;
+      		ev.type = CMD_PARSER_EVENT_LINE;
+      		ev.data = cmdParserResult(pCtx);
+      		ev.len  = pCtx->resultSz;
+    	}
+    	else if(ECONNRESET == errno)
+    	{
+      		ev.type = CMD_PARSER_EVENT_EOF;
+      		ev.data = NULL;
+      		ev.len  = 0;
     	}
     	else
     	{
-      		return NULL;
+      		break;
     	}
+
+    	// Display what has been echoed before the event
+    	cmdParserFlushOut(pCtx);
+    	pCtx->user.onEvent(pCtx->user.ctx, &ev);
   	}
-  	else
+
+  	pCtx->feedBuf = NULL;
+  	pCtx->feedLen = 0;
+
+  	if(EAGAIN != errno)
   	{
-    	return NULL;
+    	return -1;
   	}
+
+  	// Display what has been echoed
+  	errno = 0;
+  	return cmdParserFlushOut(pCtx);
 }
 
 
@@ -2535,3 +7096,108 @@ cmdParserFnKey_t cmdParserFunctionKey(cmdParser_t *pInst, cmdParserFnKey_t funct
 
   	return prev;
 }
+
+
+// flush the output buffer
+int cmdParserFlush(cmdParser_t *pInst)
+{
+	cmdParserInstance_t *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+
+  	if(!pCtx)
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	return cmdParserFlushOut(pCtx);
+}
+
+
+// display data along with the command line (e.g. prompt or answer)
+int cmdParserPrint(cmdParser_t *pInst, const void *buf, unsigned int len)
+{
+	cmdParserInstance_t *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+
+  	if(!pCtx || (!buf && len))
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	if(cmdParserWrite(pCtx, buf, len) < 0)
+  	{
+    	return -1;
+  	}
+
+  	return cmdParserFlushOut(pCtx);
+}
+
+
+// get the size of the window of the telnet client
+int cmdParserGetWindowSize(cmdParser_t *pInst, unsigned int *cols, unsigned int *rows)
+{
+	cmdParserInstance_t *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+
+  	if(!pCtx || !cols || !rows)
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	// Not reported (yet)
+  	if(!(pCtx->telnet.cols) || !(pCtx->telnet.rows))
+  	{
+    	errno = ENOENT;
+    	return -1;
+  	}
+
+  	*cols = pCtx->telnet.cols;
+  	*rows = pCtx->telnet.rows;
+
+  	return 0;
+}
+
+
+// check if the history file is loaded (1 = loaded, 0 = pending)
+int cmdParserHistoryLoaded(cmdParser_t *pInst)
+{
+	cmdParserInstance_t *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+
+  	if(!pCtx)
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	return !(pCtx->logLoading);
+}
+
+// check if the instance reads a script (1 = batch, 0 = terminal)
+int cmdParserBatch(cmdParser_t *pInst)
+{
+	cmdParserInstance_t *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+
+  	if(!pCtx)
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	return pCtx->batch;
+}
+
+// get the I/O counters
+int cmdParserGetStats(cmdParser_t *pInst, cmdParserStats_t *stats)
+{
+	cmdParserInstance_t *pCtx = CMD_PARSER_USER_TO_INSTANCE(pInst);
+
+  	if(!pCtx || !stats)
+  	{
+    	errno = EINVAL;
+    	return -1;
+  	}
+
+  	*stats = pCtx->stats;
+
+  	return 0;
+}
@@ -1,6 +1,8 @@
 #ifndef CMD_PARSER_H
 #define CMD_PARSER_H
 
+#include <time.h>
+
 #define CMD_PARSER_TAB_AUTO_COMPLETE   0  // auto_complete callback 
 #define CMD_PARSER_TAB_SPACES          1  // number of spaces for a TAB 
 
@@ -20,14 +22,36 @@
 
 #define CMD_PARSER_CTRL_MSG         0x80
 
+#define CMD_PARSER_HISTORY_SEARCH   0x01  // Ctrl-R search in the history (with a trigram index)
+#define CMD_PARSER_HISTORY_PREFIX   0x02  // Up/Down visit the commands beginning like the line (with a prefix index)
+#define CMD_PARSER_HISTORY_NO_DUPS  0x04  // a new command erases its older duplicate from the history
+#define CMD_PARSER_HISTORY_SUGGEST  0x08  // the rest of the best ranked command beginning like the line is suggested
+
+#define CMD_PARSER_HISTORY_OLDEST   0u          // position before the oldest command of the history
+#define CMD_PARSER_HISTORY_NEWEST   0xFFFFFFFFu // position after the newest command of the history
+
+#define CMD_PARSER_NO_STATUS        (-1)        // no exit status reported for a command
+
 typedef struct {
     void *ctx;      // user data
 } cmdParser_t;
 
 
+#define CMD_PARSER_EVENT_LINE       0     // command line completed
+#define CMD_PARSER_EVENT_OUTPUT     1     // data to display
+#define CMD_PARSER_EVENT_EOF        2     // end of input (Ctrl-D on an empty line)
+
+// event of an instance fed with cmdParserFeed()
+typedef struct {
+    int                 type;                   // CMD_PARSER_EVENT_xxx
+    const unsigned char *data;                  // command line (NUL terminated) or data to display
+    unsigned int        len;                    // length of the data
+} cmdParserEvent_t;
+
+
 typedef struct {
     // command
-    unsigned int        lineLen;                // length of command
+    unsigned int        lineLen;                // initial length of command
 
     // IO
     int                 nonBlocking;            // blocking mode or not
@@ -50,9 +74,81 @@ typedef struct {
     char                historyShortCut;        // charactor to call an history entry
 
     void                *ctx;                   // user information
+
+    // The following fields are appended to keep the layout of the first
+    // versions (a zeroed field keeps the former behaviour)
+
+    // command
+    unsigned int        lineMaxLen;             // the command grows up to this length (0 = no limit)
+    int                 utf8;                   // command stored in UTF-8 (instead of iso_8859-1)
+
+    // IO
+    unsigned int        inBufLen;               // size of the input buffer (0 = default)
+    unsigned int        outBufLen;              // size of the output buffer (0 = default)
+    int                 dumbTerminal;           // terminal without ANSI control sequences
+    int                 telnet;                 // telnet protocol on the input/output (e.g. a connection instead of a terminal)
+    void                (*onEvent) (void                   *ctx,            // user context
+                                    const cmdParserEvent_t *event);         // instance fed with cmdParserFeed() without I/O on fdIn/fdOut (NULL = none)
+
+    // history
+    unsigned int        historyBytes;           // memory budget of the history (0 = default)
+    unsigned int        historyFlags;           // CMD_PARSER_HISTORY_xxx
+    const char          *historyFile;           // file keeping the history across the instances (NULL = none)
+    const char          *historyShm;            // shared memory sharing the history between the processes (NULL = none)
 } cmdParserParam_t;
 
 
+// I/O counters of an instance
+typedef struct {
+    unsigned long       inReads;                // number of read() on input
+    unsigned long       inBytes;                // number of bytes read on input
+    unsigned long       outWrites;              // number of write() on output
+    unsigned long       outBytes;               // number of bytes written on output
+} cmdParserStats_t;
+
+
+// command of the history seen by cmdParserHistoryIterate() (valid until the
+// history changes, see cmdParserHistoryList())
+typedef struct {
+    const unsigned char *cmd;                   // command (NUL terminated, must not be modified)
+    unsigned int        len;                    // length of the command
+    unsigned int        seq;                    // sequence number (increasing from the oldest command)
+    time_t              time;                   // time when the command was added
+    int                 status;                 // exit status of the command (CMD_PARSER_NO_STATUS = unknown)
+} cmdParserHistoryItem_t;
+
+
+// parameters of a server of sessions (one instance per connection)
+typedef struct {
+    const char          *path;                  // Unix-domain socket (NULL = local TCP port)
+    unsigned short      port;                   // local TCP port (on the loopback)
+    unsigned int        maxSessions;            // sessions at a time (0 = no limit)
+    cmdParserParam_t    session;                // parameters of the instances (fdIn, fdOut, nonBlocking, onEvent and ctx are set by the server)
+
+    void                (*onOpen) (void         *ctx,                       // user context
+                                   cmdParser_t  *pInst);                    // session opened (e.g. to display the first prompt)
+    int                 (*onLine) (void                 *ctx,               // user context
+                                   cmdParser_t          *pInst,             // session
+                                   const unsigned char  *cmd,               // command line
+                                   unsigned int         len);               // < 0 to close the session
+    void                (*onClose) (void        *ctx,                       // user context
+                                    cmdParser_t *pInst);                    // session closed
+
+    void                *ctx;                   // user information
+} cmdParserServerParam_t;
+
+typedef struct {
+    void *ctx;      // user data
+} cmdParserServer_t;
+
+
+// command line seen by cmdParserInteractView() (valid until the next call)
+typedef struct {
+    const unsigned char *data;                  // command line (NUL terminated, a control message may contain NULs)
+    unsigned int        len;                    // length of the command line
+} cmdParserView_t;
+
+
 typedef const unsigned char * (*cmdParserFnKey_t)
                                (
                                 cmdParser_t             *pInst,
@@ -63,9 +159,24 @@ typedef const unsigned char * (*cmdParserFnKey_t)
 
 extern unsigned char *cmdParserInteract(cmdParser_t *pInst);
 
-extern void cmdParserHistoryList(cmdParser_t *pInst, void (* list)(unsigned char *item, unsigned int index));
+extern int cmdParserInteractView(cmdParser_t *pInst, cmdParserView_t *view);
+
+extern int cmdParserFeed(cmdParser_t *pInst, const unsigned char *buf, unsigned int len);
+
+// The commands handed out by cmdParserHistoryList(), cmdParserHistoryGet()
+// and cmdParserHistoryIterate() point in the history itself: they must not
+// be modified and are only valid until the history changes, i.e. until the
+// next call to cmdParserInteract(), cmdParserInteractView(), cmdParserFeed()
+// or to a cmdParserHistoryXXX() function (which may load or import commands)
+extern void cmdParserHistoryList(cmdParser_t *pInst, void (* list)(const unsigned char *item, unsigned int index));
+
+extern const unsigned char *cmdParserHistoryGet(cmdParser_t *pInst, unsigned int idx);
+
+extern int cmdParserHistoryIterate(cmdParser_t *pInst, unsigned int *pos, int older, cmdParserHistoryItem_t *item);
+
+extern int cmdParserHistorySince(cmdParser_t *pInst, time_t since, unsigned int *pos);
 
-extern unsigned char *cmParserHistoryGet(cmdParser_t *pInst, unsigned int idx);
+extern int cmdParserHistoryStatus(cmdParser_t *pInst, int status);
 
 extern cmdParser_t *cmdParserNew(cmdParserParam_t *param);
 
@@ -77,7 +188,31 @@ extern int cmdParserSetEcho(cmdParser_t *pInst, int echo);
 
 extern int cmdParserSetHistory(cmdParser_t *pInst, int history);
 
+extern int cmdParserSetPromptWidth(cmdParser_t *pInst, int width);
+
 extern cmdParserFnKey_t cmdParserFunctionKey(cmdParser_t *pInst, cmdParserFnKey_t functionKey);
 
+extern int cmdParserFlush(cmdParser_t *pInst);
+
+extern int cmdParserGetStats(cmdParser_t *pInst, cmdParserStats_t *stats);
+
+extern int cmdParserHistoryLoaded(cmdParser_t *pInst);
+
+extern int cmdParserBatch(cmdParser_t *pInst);
+
+extern int cmdParserPrint(cmdParser_t *pInst, const void *buf, unsigned int len);
+
+extern int cmdParserGetWindowSize(cmdParser_t *pInst, unsigned int *cols, unsigned int *rows);
+
+extern cmdParserServer_t *cmdParserServerNew(cmdParserServerParam_t *param);
+
+extern void cmdParserServerDelete(cmdParserServer_t *pSrv);
+
+extern int cmdParserServerRun(cmdParserServer_t *pSrv);
+
+extern int cmdParserServerStop(cmdParserServer_t *pSrv);
+
+extern int cmdParserServerSend(cmdParser_t *pInst, const void *buf, unsigned int len);
+
 #endif
 
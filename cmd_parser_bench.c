@@ -0,0 +1,377 @@
+#include <getopt.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <libgen.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include "cmd_parser.h"
+
+// Keystrokes of a line before the carriage return
+#define BENCH_LINE_LEN   20
+
+// client connection
+typedef struct {
+	int             fd;
+	int             busy;       // keystroke waiting for its echo
+	unsigned int    typed;      // keystrokes of the current line
+	struct timespec sent;       // time of the keystroke
+} benchConn_t;
+
+static cmdParserServer_t *benchServer;
+
+static struct option benchLongOpts[] =
+{
+	{"sessions",	required_argument, 	NULL, 	's'},
+	{"keys",		required_argument, 	NULL, 	'k'},
+	{"window",		required_argument, 	NULL, 	'w'},
+	{"path",		required_argument, 	NULL, 	'p'},
+	{"help", 		no_argument,		NULL,	'h'},
+	{NULL,			0,				    NULL,	0  }
+};
+
+static void benchHelp(char *p)
+{
+  	fprintf(stderr,
+          "\n"
+          "Usage: %s [<options> ...]\n"
+          "\n"
+          "Measure the keystroke to echo latency of the sessions of a server\n"
+          "\n"
+          "Options:\n"
+          "\n"
+          "\t-s | --sessions nb : Number of concurrent sessions (default: 1000)\n"
+          "\t-k | --keys nb     : Number of keystrokes to measure (default: 100000)\n"
+          "\t-w | --window nb   : Keystrokes in flight at a time (default: 64)\n"
+          "\t-p | --path path   : Unix-domain socket of the server (default: /tmp/cmd_parser_bench.sock)\n"
+          "\t-h | --help        : This help\n"
+          ,
+          basename(p)
+          );
+}
+
+static void benchStop(int sig)
+{
+	(void)sig;
+
+	cmdParserServerStop(benchServer);
+}
+
+static void benchOpen(void *ctx, cmdParser_t *pInst)
+{
+	(void)ctx;
+
+	// The prompt tells the client that the session is ready
+	cmdParserServerSend(pInst, "> ", 2);
+}
+
+// process serving the sessions
+static int benchServe(const char *path, int ready)
+{
+	cmdParserServerParam_t params;
+	char                   c = 0;
+
+	memset(&params, 0, sizeof(params));
+	params.path                   = path;
+	params.session.lineLen        = 64;
+	params.session.historyLen     = 16;
+	params.session.autoOrSpace    = CMD_PARSER_TAB_SPACES;
+	params.session.tab.spaces     = 4;
+	params.onOpen                 = benchOpen;
+	benchServer = cmdParserServerNew(&params);
+	if(!benchServer)
+	{
+		fprintf(stderr, "Unable to start the server (errno = %d)\n", errno);
+		return 1;
+	}
+
+	signal(SIGTERM, benchStop);
+
+	// The server listens
+	if(write(ready, &c, 1) != 1)
+	{
+		return 1;
+	}
+	close(ready);
+
+	cmdParserServerRun(benchServer);
+	cmdParserServerDelete(benchServer);
+
+	return 0;
+}
+
+static long benchElapsed(const struct timespec *from, const struct timespec *to)
+{
+	return ((to->tv_sec - from->tv_sec) * 1000000000L) + (to->tv_nsec - from->tv_nsec);
+}
+
+static int benchCmp(const void *a, const void *b)
+{
+	long la = *(const long *)a;
+	long lb = *(const long *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+// type a key on an idle session
+static int benchType(benchConn_t *conns, unsigned int nb)
+{
+	benchConn_t *pConn;
+	unsigned int i;
+	char         key;
+
+	for(i = rand() % nb; conns[i].busy; i = (i + 1) % nb);
+	pConn = &(conns[i]);
+
+	key = (pConn->typed < BENCH_LINE_LEN) ? 'a' + (pConn->typed % 26) : '\r';
+	pConn->typed = (pConn->typed < BENCH_LINE_LEN) ? pConn->typed + 1 : 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &(pConn->sent));
+	if(write(pConn->fd, &key, 1) != 1)
+	{
+		return -1;
+	}
+	pConn->busy = 1;
+
+	return 0;
+}
+
+// connect the sessions and measure the echo of the keystrokes
+static int benchLoad(const char *path, unsigned int sessions, unsigned int keys, unsigned int window)
+{
+	struct sockaddr_un sun;
+	struct epoll_event ev;
+	struct epoll_event events[256];
+	struct timespec    start, now;
+	benchConn_t        *conns;
+	long               *lat;
+	unsigned int       i, done, sent;
+	unsigned int       ready;
+	char               buf[64];
+	int                epfd;
+	int                nb, j;
+	ssize_t            rc;
+
+	conns = (benchConn_t *)calloc(sessions, sizeof(benchConn_t));
+	lat   = (long *)malloc(keys * sizeof(long));
+	epfd  = epoll_create1(0);
+	if(!conns || !lat || (epfd < 0))
+	{
+		fprintf(stderr, "Unable to allocate the clients (errno = %d)\n", errno);
+		return 1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+	for(i = 0; i < sessions; i++)
+	{
+		conns[i].fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if((conns[i].fd < 0) || (0 != connect(conns[i].fd, (struct sockaddr *)&sun, sizeof(sun))))
+		{
+			fprintf(stderr, "Unable to connect the session %u (errno = %d)\n", i, errno);
+			return 1;
+		}
+
+		ev.events   = EPOLLIN;
+		ev.data.u32 = i;
+		if(0 != epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev))
+		{
+			fprintf(stderr, "Unable to watch the session %u (errno = %d)\n", i, errno);
+			return 1;
+		}
+	}
+
+	// Wait for the prompt of every session
+	for(ready = 0; ready < sessions;)
+	{
+		nb = epoll_wait(epfd, events, 256, 10000);
+		if(nb <= 0)
+		{
+			fprintf(stderr, "Sessions not ready (%u/%u)\n", ready, sessions);
+			return 1;
+		}
+		for(j = 0; j < nb; j++)
+		{
+			if(read(conns[events[j].data.u32].fd, buf, sizeof(buf)) > 0)
+			{
+				ready++;
+			}
+		}
+	}
+
+	if(window > sessions)
+	{
+		window = sessions;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(sent = 0; (sent < window) && (sent < keys); sent++)
+	{
+		if(benchType(conns, sessions) < 0)
+		{
+			fprintf(stderr, "Write error (errno = %d)\n", errno);
+			return 1;
+		}
+	}
+
+	// Every keystroke is echoed with a single char
+	for(done = 0; done < keys;)
+	{
+		nb = epoll_wait(epfd, events, 256, 10000);
+		if(nb <= 0)
+		{
+			fprintf(stderr, "Echo lost (%u/%u)\n", done, keys);
+			return 1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for(j = 0; j < nb; j++)
+		{
+			benchConn_t *pConn = &(conns[events[j].data.u32]);
+
+			rc = read(pConn->fd, buf, sizeof(buf));
+			if((rc <= 0) || !(pConn->busy))
+			{
+				fprintf(stderr, "Unexpected data on the session %u\n", events[j].data.u32);
+				return 1;
+			}
+
+			pConn->busy = 0;
+			lat[done++] = benchElapsed(&(pConn->sent), &now);
+
+			if(sent < keys)
+			{
+				if(benchType(conns, sessions) < 0)
+				{
+					fprintf(stderr, "Write error (errno = %d)\n", errno);
+					return 1;
+				}
+				sent++;
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	qsort(lat, keys, sizeof(long), benchCmp);
+	printf("sessions %u keys %u window %u : %.0f keys/s\n", sessions, keys, window, keys / (benchElapsed(&start, &now) / 1e9));
+	printf("latency (us) p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+	       lat[keys / 2] / 1e3, lat[(keys * 9) / 10] / 1e3, lat[(keys * 99) / 100] / 1e3,
+	       lat[(keys * 999) / 1000] / 1e3, lat[keys - 1] / 1e3);
+
+	for(i = 0; i < sessions; i++)
+	{
+		close(conns[i].fd);
+	}
+	close(epfd);
+	free(lat);
+	free(conns);
+
+	return 0;
+}
+
+int main(int ac, char *av[])
+{
+	unsigned int  sessions = 1000;
+	unsigned int  keys = 100000;
+	unsigned int  window = 64;
+	const char    *path = "/tmp/cmd_parser_bench.sock";
+	struct rlimit rl;
+	int           pfd[2];
+	int           opt;
+	int           rc;
+	int           status;
+	pid_t         pid;
+	char          c;
+
+	optind = 0;
+	while ((opt = getopt_long(ac, av, "s:k:w:p:h", benchLongOpts, NULL)) != EOF)
+	{
+  		switch(opt)
+  		{
+    		case 's' : sessions = (unsigned int)atoi(optarg); break;
+    		case 'k' : keys = (unsigned int)atoi(optarg); break;
+    		case 'w' : window = (unsigned int)atoi(optarg); break;
+    		case 'p' : path = optarg; break;
+
+    		case 'h' : // Help
+    		{
+      			benchHelp(av[0]);
+      			exit(0);
+    		}
+    		break;
+
+    		case '?' :
+    		default:
+    		{
+      			benchHelp(av[0]);
+      			exit(1);
+    		}
+  		}
+	}
+
+	if(!sessions || !keys || !window)
+	{
+		benchHelp(av[0]);
+		exit(1);
+	}
+
+	// One descriptor per session on each side
+	if(0 == getrlimit(RLIMIT_NOFILE, &rl))
+	{
+		rl.rlim_cur = rl.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+		if(rl.rlim_cur < (sessions + 16))
+		{
+			fprintf(stderr, "Not enough file descriptors for %u sessions (%lu)\n", sessions, (unsigned long)rl.rlim_cur);
+			exit(1);
+		}
+	}
+
+	if(0 != pipe(pfd))
+	{
+		fprintf(stderr, "pipe() error (errno = %d)\n", errno);
+		exit(1);
+	}
+
+	pid = fork();
+	if(pid < 0)
+	{
+		fprintf(stderr, "fork() error (errno = %d)\n", errno);
+		exit(1);
+	}
+
+	if(0 == pid)
+	{
+		close(pfd[0]);
+		exit(benchServe(path, pfd[1]));
+	}
+
+	// Wait for the server to listen
+	close(pfd[1]);
+	if(read(pfd[0], &c, 1) != 1)
+	{
+		waitpid(pid, &status, 0);
+		exit(1);
+	}
+	close(pfd[0]);
+
+	rc = benchLoad(path, sessions, keys, window);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+
+	return rc;
+}
@@ -2,39 +2,251 @@
 #define CMD_PARSER_PRIV_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "cmd_parser.h"
 
-// instanse of cmd
+// location of a command in the history arena
+typedef struct {
+    unsigned int        off;                // offset of the command
+    unsigned int        len;                // length of the command (without the NUL)
+    unsigned int        grams;              // number of references in the trigram index
+    unsigned int        prefixes;           // number of references in the prefix index
+    unsigned int        seq;                // sequence number of the command
+    time_t              time;               // time when the command was added
+    time_t              since;              // newest time of the commands up to this one (never goes backward)
+    int                 status;             // exit status reported by the caller
+    unsigned int        hits;               // number of times the command was entered (0 = removed duplicate)
+} cmdParserHistoryRec_t;
+
+// command of the history in the table of duplicates
+typedef struct {
+    int                 used;               // bucket in use
+    uint32_t            hash;               // hash of the command
+    unsigned int        seq;                // sequence number of the command
+    unsigned int        slot;               // slot of the command in the history index
+} cmdParserHistoryDup_t;
+
+// header of the file of the persistent history (followed by the records:
+// length, checksum, time, exit status, command padded to 4 bytes and length
+// again)
+typedef struct {
+    char                magic[8];           // CMD_PARSER_LOG_MAGIC
+    uint32_t            version;            // format of the file
+    uint32_t            reserved;
+    uint64_t            end;                // end of the records synced on disk
+} cmdParserLogHdr_t;
+
+// header of the history shared by the processes (followed by the slots)
+typedef struct {
+    char                magic[8];           // CMD_PARSER_SHM_MAGIC
+    uint32_t            state;              // CMD_PARSER_SHM_READY once set up
+    uint32_t            nbSlots;            // number of slots (power of 2)
+    uint64_t            head;               // sequence number of the next command
+} cmdParserShmHdr_t;
+
+// longest command in the shared history
+#define CMD_PARSER_SHM_CMD_LEN  224
+
+// slot of the shared history
 typedef struct {
+    uint64_t            seq;                // 2 * seq + 1 while written, 2 * seq + 2 once published
+    uint64_t            owner;              // instance which published the command
+    uint32_t            len;                // length of the command
+    uint32_t            hash;               // checksum of the command
+    int64_t             time;               // time when the command was added
+    unsigned char       cmd[CMD_PARSER_SHM_CMD_LEN];
+} cmdParserShmSlot_t;
+
+// frecency of a suggested command
+typedef struct {
+    unsigned int        seq;                // newest occurrence of the command (CMD_PARSER_HISTORY_NEWEST = free)
+    double              score;              // sum of the scores of the occurrences
+} cmdParserSuggest_t;
+
+// commands of the history having a key (trigram or prefix)
+typedef struct {
+    uint64_t            key;                // key (0 = free bucket)
+    unsigned int        nb;                 // number of commands in the list
+    unsigned int        max;                // size of the list
+    unsigned int        *seq;               // sequence numbers of the commands
+    unsigned int        id;                 // number of the node (prefix trie)
+    int                 burst;              // the commands are also listed in the children of the node (prefix trie)
+} cmdParserPostings_t;
+
+struct cmdParserInstance;
+
+// index of the history (hash table of the keys)
+typedef struct cmdParserIndex {
+    int                 on;                 // index in use
+    cmdParserPostings_t *buckets;           // hash table
+    unsigned int        sz;                 // number of buckets
+    unsigned int        nb;                 // number of keys in the index
+    unsigned long       live;               // references to the commands of the history
+    unsigned long       stale;              // references to dropped commands
+    int                 (*add)(struct cmdParserInstance *pCtx, struct cmdParserIndex *idx, cmdParserHistoryRec_t *rec);
+} cmdParserIndex_t;
+
+// state of the telnet protocol
+typedef struct {
+    int                 state;              // CMD_PARSER_TELNET_xxx state of the input
+    unsigned char       verb;               // WILL/WONT/DO/DONT being received
+    unsigned char       sb[8];              // subnegotiation being received
+    unsigned int        sbLen;              // length of the subnegotiation
+    int                 cr;                 // CR received (followed by a NUL or LF to drop)
+    int                 willEcho;           // the server echoes the input
+    int                 willSga;            // the server sends no go ahead
+    int                 doNaws;             // the client reports its window size
+    int                 doLinemode;         // the client negotiates the line mode
+    int                 linemodeEdit;       // the line mode lets the client edit the lines
+    unsigned int        cols;               // width of the window of the client (0 = unknown)
+    unsigned int        rows;               // height of the window of the client (0 = unknown)
+} cmdParserTelnet_t;
+
+// instanse of cmd
+typedef struct cmdParserInstance {
     cmdParserParam_t    user;               // user parameters
     int                 dbg;                // debug level
     unsigned char       *cmd;               // command
     unsigned char       *savedCmd;          // saved command
+    unsigned int        savedSz;            // length of the saved command
+    unsigned char       *result;            // command translated in UTF-8
+    unsigned int        resultSz;           // size of the translated command
     int                 echoOn;             // echo activated or not
+    int                 echoWanted;         // echo activated by the user (off while the telnet client edits the lines)
+    int                 promptWidth;        // width of the prompt (-1 if unknown)
     struct termios      origTermSettings;   // Saved terminal settings
     int                 inFlag;             // flag of input descriptor
 
-    unsigned char       storedUngetChar;
+    unsigned char       *inBuf;             // input ring buffer
+    unsigned int        inBufSz;            // size of the input ring
+    unsigned int        inHead;             // index of the next char to get
+    unsigned int        inCount;            // number of chars in the input ring
+    unsigned char       *outBuf;            // output buffer
+    unsigned int        outBufSz;           // size of the output buffer
+    unsigned int        outLen;             // number of chars in the output buffer
+    cmdParserStats_t    stats;              // I/O counters
+
     int                 state;              // state of FSM
     int                 prevState;          // previous of FSM
     int                 cursor;             // cursor position
+    unsigned int        cursorCol;          // display column of the cursor in the line
     unsigned int        lineSz;             // number of chars
+    unsigned int        gapPos;             // position of the gap in cmd
+    unsigned int        cmdSz;              // size of cmd
+    unsigned int        shownSz;            // number of chars of cmd displayed on the terminal
 
     int                 historyOn;          // history activated or not
-    unsigned char       *history;           // history infomation
+    unsigned char       *history;           // history infomation (arena of commands)
+    unsigned int        historyBytes;       // size of the history arena
+    unsigned int        historyHead;        // offset of the next command in the arena
+    cmdParserHistoryRec_t *historyIdx;      // commands in the arena (historySlots entries)
+    unsigned int        historySlots;       // size of the history index
     int                 historyCur;         // currect display index
-    unsigned int        historySz;          // number of history index
+    unsigned int        historySz;          // number of history index (removed duplicates included)
+    unsigned int        historyLive;        // number of commands in the history
     unsigned int        historyInsert;      // insertion index
+    unsigned int        historySeq;         // sequence number of the next command
+
+    cmdParserIndex_t    trigrams;           // trigram index of the history
+    cmdParserIndex_t    prefixes;           // prefix index of the history
+    cmdParserHistoryDup_t *dups;            // commands of the history by content (hash table)
+    unsigned int        dupsSz;             // number of buckets
+
+    unsigned char       *log;               // file of the persistent history mapped in memory
+    int                 logFd;              // file descriptor of the file
+    char                *logPath;           // path of the file
+    size_t              logSize;            // size of the file
+    size_t              logEnd;             // end of the records in the file
+    unsigned int        logPending;         // records appended since the last sync
+    size_t              logLast;            // offset of the newest record
+    unsigned int        logLastSeq;         // command of the newest record appended (CMD_PARSER_HISTORY_NEWEST = none)
+    int                 logLoading;         // the file is not fully loaded in the history
+    size_t              logLoadOff;         // offset of the next record to load (0 = not located yet)
+    unsigned int        logLoadNb;          // number of records to load
+
+    cmdParserShmHdr_t   *shm;               // history shared with the other processes
+    uint64_t            shmSeen;            // sequence number of the next shared command to copy
+    uint64_t            shmOwner;           // identifier of the instance in the shared history
+
+    unsigned int        statusSeq;          // sequence number of the command of the last line
+
+    unsigned int        *suggestSet;        // commands beginning with the line (increasing sequence numbers)
+    unsigned int        suggestNb;          // number of commands in the set
+    unsigned int        suggestPfx;         // length of the line when the set was made (0 = no set)
+    uint32_t            suggestHash;        // hash of the line when the set was made
+    cmdParserSuggest_t  *suggestRank;       // ranking of the commands of the set (hash table)
+    unsigned int        suggestSeq;         // suggested command
+    unsigned int        suggestShown;       // width of the displayed suggestion
+
+    unsigned char       *searchPat;         // pattern of the reverse search
+    unsigned int        searchLen;          // length of the pattern
+    unsigned int        searchSeq;          // sequence number of the matching command
+    int                 searchFound;        // a command matches the pattern
+    int                 searchCursor;       // cursor position before the search
+    unsigned int        searchShown;        // number of columns displayed by the search
 
     cmdParserFnKey_t    functionKey;        // callback
+
+    cmdParserTelnet_t   telnet;             // telnet protocol
+
+    int                 batch;              // lines of a script instead of a terminal
+    unsigned char       *batchBuf;          // input of the script (mapped file or buffer of read())
+    size_t              batchSz;            // size of the buffer of read() (0 = mapped file)
+    size_t              batchHead;          // beginning of the next line
+    size_t              batchLen;           // end of the input in the buffer
+    int                 batchEof;           // end of the script reached
+    int                 batchSkip;          // tail of a line too long being skipped
+    unsigned char       *batchMap;          // mapping of the file (NULL = none)
+    size_t              batchMapLen;        // length of the mapping
+    uint64_t            batchOff;           // offset of the beginning of the input in the file
+    unsigned char       *batchRes;          // line translated or terminated apart
+    size_t              batchResSz;         // size of the line apart
+
+    const unsigned char *feedBuf;           // input handed over by cmdParserFeed()
+    unsigned int        feedLen;            // number of chars of the input left
 } cmdParserInstance_t;
 
 
+struct cmdParserServerInstance;
+
+// connection of a server
+typedef struct cmdParserSession {
+    struct cmdParserSession         *prev;      // list of the sessions
+    struct cmdParserSession         *next;
+    struct cmdParserServerInstance  *srv;       // server of the session
+    cmdParser_t                     *inst;      // instance fed with the input
+    int                             fd;         // connection
+    int                             closing;    // to be closed once the input is processed
+    unsigned char                   *pend;      // output not yet accepted by the connection (NULL = none)
+    unsigned int                    pendLen;    // number of chars of the pending output
+    unsigned int                    pendSz;     // size of the pending output
+} cmdParserSession_t;
+
+// server of sessions
+typedef struct cmdParserServerInstance {
+    int                 epfd;               // epoll instance
+    int                 lfd;                // listening socket
+    int                 wakeFd;             // eventfd to stop the loop
+    int                 stop;               // stop requested
+    int                 paused;             // listening socket out of the epoll instance (no descriptor left)
+    unsigned int        nbSessions;         // number of sessions
+    cmdParserSession_t  *sessions;          // list of the sessions
+    unsigned char       *rdBuf;             // input of the sessions (shared by all of them)
+
+    cmdParserServerParam_t user;
+} cmdParserServerInstance_t;
+
+
 #define CMD_PARSER_USER_TO_INSTANCE(p)   ((cmdParserInstance_t *)   \
                                         ((p) ? (((char *)p - offsetof(cmdParserParam_t, ctx)) - \
                                         offsetof(cmdParserInstance_t, user)) : NULL))
 
 
+#define CMD_PARSER_SERVER_TO_INSTANCE(p)   ((cmdParserServerInstance_t *)   \
+                                        ((p) ? (((char *)p - offsetof(cmdParserServerParam_t, ctx)) - \
+                                        offsetof(cmdParserServerInstance_t, user)) : NULL))
+
+
 #define CMD_PARSER_ERR(pInstance, format, ...)                                  \
     do  {                                                                       \
         if (!pInstance || ((cmdParserInstance_t *)pInstance)->dbg)              \
@@ -0,0 +1,712 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "cmd_parser.h"
+#include "cmd_parser_priv.h"
+
+
+// Number of events handled per epoll_wait()
+#define     CMD_PARSER_SERVER_EVENTS        256
+
+// Size of the input buffer shared by the sessions
+#define     CMD_PARSER_SERVER_RD_LEN        4096
+
+// Default sizes of the buffers of a session (the input is handed over by
+// the server and the output goes to the connection at once)
+#define     CMD_PARSER_SERVER_IN_BUF_LEN    64
+#define     CMD_PARSER_SERVER_OUT_BUF_LEN   256
+
+// A session stops once that much output waits for the connection
+#define     CMD_PARSER_SERVER_PEND_MAX      (1024 * 1024)
+
+// Milliseconds before accepting again once out of descriptors, if no
+// session closes meanwhile
+#define     CMD_PARSER_SERVER_RETRY         1000
+
+
+// (un)subscribe to the connection becoming writable
+static int cmdParserSessionWatch(cmdParserSession_t *pSess, int out)
+{
+    struct epoll_event ev;
+
+    ev.events   = EPOLLIN | (out ? EPOLLOUT : 0);
+    ev.data.ptr = pSess;
+
+    return epoll_ctl(pSess->srv->epfd, EPOLL_CTL_MOD, pSess->fd, &ev);
+}
+
+// write on the connection what it accepts and keep the rest
+static void cmdParserSessionWrite(cmdParserSession_t *pSess, const unsigned char *buf, unsigned int len)
+{
+    ssize_t      rc = 0;
+    unsigned int sz;
+    void         *p;
+
+    if(pSess->closing)
+    {
+        return;
+    }
+
+    // Keep the order of the output
+    if(!(pSess->pendLen))
+    {
+        do
+        {
+            rc = send(pSess->fd, buf, len, MSG_NOSIGNAL);
+        } while((rc < 0) && (EINTR == errno));
+
+        if(rc < 0)
+        {
+            if((EAGAIN != errno) && (EWOULDBLOCK != errno))
+            {
+                pSess->closing = 1;
+                return;
+            }
+
+            rc = 0;
+        }
+
+        if((unsigned int)rc == len)
+        {
+            return;
+        }
+    }
+
+    buf += rc;
+    len -= rc;
+
+    // The client does not read what it is sent
+    if((pSess->pendLen + len) > CMD_PARSER_SERVER_PEND_MAX)
+    {
+        pSess->closing = 1;
+        return;
+    }
+
+    if((pSess->pendLen + len) > pSess->pendSz)
+    {
+        for(sz = pSess->pendSz ? pSess->pendSz : CMD_PARSER_SERVER_OUT_BUF_LEN; sz < (pSess->pendLen + len); sz *= 2);
+        p = realloc(pSess->pend, sz);
+        if(!p)
+        {
+            pSess->closing = 1;
+            return;
+        }
+        pSess->pend   = (unsigned char *)p;
+        pSess->pendSz = sz;
+    }
+
+    // Wait for the connection to drain
+    if(!(pSess->pendLen) && (0 != cmdParserSessionWatch(pSess, 1)))
+    {
+        pSess->closing = 1;
+        return;
+    }
+
+    memcpy(pSess->pend + pSess->pendLen, buf, len);
+    pSess->pendLen += len;
+}
+
+// send the pending output once the connection is writable
+static void cmdParserSessionDrain(cmdParserSession_t *pSess)
+{
+    ssize_t rc;
+
+    do
+    {
+        rc = send(pSess->fd, pSess->pend, pSess->pendLen, MSG_NOSIGNAL);
+    } while((rc < 0) && (EINTR == errno));
+
+    if(rc < 0)
+    {
+        if((EAGAIN != errno) && (EWOULDBLOCK != errno))
+        {
+            pSess->closing = 1;
+        }
+        return;
+    }
+
+    pSess->pendLen -= rc;
+    if(pSess->pendLen)
+    {
+        memmove(pSess->pend, pSess->pend + rc, pSess->pendLen);
+        return;
+    }
+
+    // An idle session keeps no output buffer
+    free(pSess->pend);
+    pSess->pend   = NULL;
+    pSess->pendSz = 0;
+    if(0 != cmdParserSessionWatch(pSess, 0))
+    {
+        pSess->closing = 1;
+    }
+}
+
+// events of the instance of a session
+static void cmdParserSessionEvent(void *ctx, const cmdParserEvent_t *event)
+{
+    cmdParserSession_t        *pSess = (cmdParserSession_t *)ctx;
+    cmdParserServerInstance_t *pSrv  = pSess->srv;
+
+    switch(event->type)
+    {
+        case CMD_PARSER_EVENT_OUTPUT:
+        {
+            cmdParserSessionWrite(pSess, event->data, event->len);
+        }
+        break;
+
+        case CMD_PARSER_EVENT_LINE:
+        {
+            if(!(pSess->closing) && pSrv->user.onLine &&
+               (pSrv->user.onLine(pSrv->user.ctx, pSess->inst, event->data, event->len) < 0))
+            {
+                pSess->closing = 1;
+            }
+        }
+        break;
+
+        case CMD_PARSER_EVENT_EOF:
+        {
+            pSess->closing = 1;
+        }
+        break;
+    }
+}
+
+// release a session
+static void cmdParserServerPause(cmdParserServerInstance_t *pSrv, int pause);
+
+static void cmdParserSessionClose(cmdParserSession_t *pSess)
+{
+    cmdParserServerInstance_t *pSrv = pSess->srv;
+
+    if(pSess->inst)
+    {
+        if(pSrv->user.onClose)
+        {
+            pSrv->user.onClose(pSrv->user.ctx, pSess->inst);
+        }
+        cmdParserDelete(pSess->inst);
+    }
+
+    if(pSess->prev)
+    {
+        pSess->prev->next = pSess->next;
+    }
+    else
+    {
+        pSrv->sessions = pSess->next;
+    }
+    if(pSess->next)
+    {
+        pSess->next->prev = pSess->prev;
+    }
+    pSrv->nbSessions--;
+
+    // Closing the connection removes it from the epoll instance
+    close(pSess->fd);
+    free(pSess->pend);
+    free(pSess);
+
+    // A descriptor is available for the connections waiting in the backlog
+    cmdParserServerPause(pSrv, 0);
+}
+
+// set up a session on an accepted connection
+static void cmdParserSessionOpen(cmdParserServerInstance_t *pSrv, int fd)
+{
+    cmdParserSession_t *pSess;
+    cmdParserParam_t   param;
+    struct epoll_event ev;
+
+    if(pSrv->user.maxSessions && (pSrv->nbSessions >= pSrv->user.maxSessions))
+    {
+        CMD_PARSER_ERR(NULL, "Too many sessions (%u)\n", pSrv->nbSessions);
+        close(fd);
+        return;
+    }
+
+    pSess = (cmdParserSession_t *)calloc(1, sizeof(cmdParserSession_t));
+    if(!pSess)
+    {
+        CMD_PARSER_ERR(NULL, "Error %d while allocating a session\n", errno);
+        close(fd);
+        return;
+    }
+    pSess->srv = pSrv;
+    pSess->fd  = fd;
+
+    pSess->next = pSrv->sessions;
+    if(pSess->next)
+    {
+        pSess->next->prev = pSess;
+    }
+    pSrv->sessions = pSess;
+    pSrv->nbSessions++;
+
+    // The instance is fed with the input of the connection
+    param             = pSrv->user.session;
+    param.fdIn        = -1;
+    param.fdOut       = -1;
+    param.nonBlocking = 0;
+    param.onEvent     = cmdParserSessionEvent;
+    param.ctx         = pSess;
+    if(!(param.inBufLen))
+    {
+        param.inBufLen = CMD_PARSER_SERVER_IN_BUF_LEN;
+    }
+    if(!(param.outBufLen))
+    {
+        param.outBufLen = CMD_PARSER_SERVER_OUT_BUF_LEN;
+    }
+
+    pSess->inst = cmdParserNew(&param);
+    if(!(pSess->inst))
+    {
+        CMD_PARSER_ERR(NULL, "Error %d while allocating the instance of a session\n", errno);
+        cmdParserSessionClose(pSess);
+        return;
+    }
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = pSess;
+    if(0 != epoll_ctl(pSrv->epfd, EPOLL_CTL_ADD, fd, &ev))
+    {
+        CMD_PARSER_ERR(NULL, "Error %d while watching a session\n", errno);
+        cmdParserSessionClose(pSess);
+        return;
+    }
+
+    if(pSrv->user.onOpen)
+    {
+        pSrv->user.onOpen(pSrv->user.ctx, pSess->inst);
+    }
+
+    if(pSess->closing)
+    {
+        cmdParserSessionClose(pSess);
+    }
+}
+
+// hand over the input of a connection to its instance
+static void cmdParserSessionInput(cmdParserServerInstance_t *pSrv, cmdParserSession_t *pSess)
+{
+    ssize_t rc;
+
+    // Level triggered: what remains is read on the next round
+    do
+    {
+        rc = read(pSess->fd, pSrv->rdBuf, CMD_PARSER_SERVER_RD_LEN);
+    } while((rc < 0) && (EINTR == errno));
+
+    if(rc < 0)
+    {
+        if((EAGAIN != errno) && (EWOULDBLOCK != errno))
+        {
+            pSess->closing = 1;
+        }
+        return;
+    }
+
+    // Connection closed by the client
+    if(0 == rc)
+    {
+        pSess->closing = 1;
+        return;
+    }
+
+    if(0 != cmdParserFeed(pSess->inst, pSrv->rdBuf, (unsigned int)rc))
+    {
+        pSess->closing = 1;
+    }
+}
+
+// stop (or resume) watching the listening socket
+static void cmdParserServerPause(cmdParserServerInstance_t *pSrv, int pause)
+{
+    struct epoll_event ev;
+
+    if(pause == pSrv->paused)
+    {
+        return;
+    }
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &(pSrv->lfd);
+    if(0 == epoll_ctl(pSrv->epfd, pause ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, pSrv->lfd, &ev))
+    {
+        pSrv->paused = pause;
+    }
+}
+
+// accept the pending connections
+static void cmdParserServerAccept(cmdParserServerInstance_t *pSrv)
+{
+    int fd;
+
+    for(;;)
+    {
+        fd = accept4(pSrv->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0)
+        {
+            if((EINTR == errno) || (ECONNABORTED == errno))
+            {
+                continue;
+            }
+
+            // Out of descriptors: the connections stay in the backlog until
+            // a session closes (the level triggered listening socket would
+            // wake up the loop at once meanwhile)
+            if((EAGAIN != errno) && (EWOULDBLOCK != errno))
+            {
+                CMD_PARSER_ERR(NULL, "Error %d while accepting a connection\n", errno);
+                cmdParserServerPause(pSrv, 1);
+            }
+            return;
+        }
+
+        cmdParserSessionOpen(pSrv, fd);
+    }
+}
+
+// remove the socket at a path (anything else is kept)
+static void cmdParserServerUnlink(const char *path)
+{
+    struct stat st;
+
+    if((0 == lstat(path, &st)) && S_ISSOCK(st.st_mode))
+    {
+        (void)unlink(path);
+    }
+}
+
+// open the listening socket
+static int cmdParserServerListen(cmdParserServerInstance_t *pSrv)
+{
+    struct sockaddr_un sun;
+    struct sockaddr_in sin;
+    int                on = 1;
+    int                rc;
+
+    if(pSrv->user.path)
+    {
+        if(strlen(pSrv->user.path) >= sizeof(sun.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, pSrv->user.path);
+
+        pSrv->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(pSrv->lfd < 0)
+        {
+            return -1;
+        }
+
+        // A socket left by a previous server is replaced
+        cmdParserServerUnlink(pSrv->user.path);
+        rc = bind(pSrv->lfd, (struct sockaddr *)&sun, sizeof(sun));
+    }
+    else
+    {
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family      = AF_INET;
+        sin.sin_port        = htons(pSrv->user.port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        pSrv->lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(pSrv->lfd < 0)
+        {
+            return -1;
+        }
+
+        (void)setsockopt(pSrv->lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        rc = bind(pSrv->lfd, (struct sockaddr *)&sin, sizeof(sin));
+    }
+
+    if(0 != rc)
+    {
+        return -1;
+    }
+
+    return listen(pSrv->lfd, SOMAXCONN);
+}
+
+// release a server and its sessions
+static void cmdParserServerFree(cmdParserServerInstance_t *pSrv)
+{
+    while(pSrv->sessions)
+    {
+        cmdParserSessionClose(pSrv->sessions);
+    }
+
+    if(pSrv->lfd >= 0)
+    {
+        close(pSrv->lfd);
+        if(pSrv->user.path)
+        {
+            cmdParserServerUnlink(pSrv->user.path);
+        }
+    }
+    if(pSrv->wakeFd >= 0)
+    {
+        close(pSrv->wakeFd);
+    }
+    if(pSrv->epfd >= 0)
+    {
+        close(pSrv->epfd);
+    }
+
+    free(pSrv->rdBuf);
+    free(pSrv);
+}
+
+// allocate a server
+cmdParserServer_t *cmdParserServerNew(cmdParserServerParam_t *param)
+{
+    cmdParserServerInstance_t *pSrv;
+    struct epoll_event        ev;
+    int                       errSav;
+
+    errno = 0;
+
+    if(!param || (!(param->path) && !(param->port)) || !(param->session.lineLen))
+    {
+        CMD_PARSER_ERR(NULL, "Invalid parameters\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pSrv = (cmdParserServerInstance_t *)calloc(1, sizeof(cmdParserServerInstance_t));
+    if(!pSrv)
+    {
+        errSav = errno;
+        CMD_PARSER_ERR(NULL, "Error %d while allocating the server\n", errno);
+        errno = errSav;
+        return NULL;
+    }
+    pSrv->user   = *param;
+    pSrv->epfd   = -1;
+    pSrv->lfd    = -1;
+    pSrv->wakeFd = -1;
+
+    pSrv->rdBuf = (unsigned char *)malloc(CMD_PARSER_SERVER_RD_LEN);
+    if(!(pSrv->rdBuf))
+    {
+        errSav = errno;
+        CMD_PARSER_ERR(NULL, "Error %d while allocating the input buffer\n", errno);
+        goto error;
+    }
+
+    pSrv->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(pSrv->epfd < 0)
+    {
+        errSav = errno;
+        CMD_PARSER_ERR(NULL, "Error %d while creating the epoll instance\n", errno);
+        goto error;
+    }
+
+    pSrv->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(pSrv->wakeFd < 0)
+    {
+        errSav = errno;
+        CMD_PARSER_ERR(NULL, "Error %d while creating the eventfd\n", errno);
+        goto error;
+    }
+
+    if(0 != cmdParserServerListen(pSrv))
+    {
+        errSav = errno;
+        CMD_PARSER_ERR(NULL, "Error %d while listening on '%s' (port %u)\n", errno, param->path ? param->path : "", param->port);
+        goto error;
+    }
+
+    // The listening socket and the eventfd are told apart from the sessions
+    // by their address
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &(pSrv->lfd);
+    if(0 != epoll_ctl(pSrv->epfd, EPOLL_CTL_ADD, pSrv->lfd, &ev))
+    {
+        errSav = errno;
+        CMD_PARSER_ERR(NULL, "Error %d while watching the listening socket\n", errno);
+        goto error;
+    }
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &(pSrv->wakeFd);
+    if(0 != epoll_ctl(pSrv->epfd, EPOLL_CTL_ADD, pSrv->wakeFd, &ev))
+    {
+        errSav = errno;
+        CMD_PARSER_ERR(NULL, "Error %d while watching the eventfd\n", errno);
+        goto error;
+    }
+
+    return (cmdParserServer_t *)&(pSrv->user.ctx);
+
+    error:
+
+    cmdParserServerFree(pSrv);
+    errno = errSav;
+    return NULL;
+}
+
+// delete a server (the sessions are closed)
+void cmdParserServerDelete(cmdParserServer_t *pServer)
+{
+    cmdParserServerInstance_t *pSrv = CMD_PARSER_SERVER_TO_INSTANCE(pServer);
+
+    errno = 0;
+
+    if(!pServer)
+    {
+        CMD_PARSER_ERR(NULL, "NULL parameter\n");
+        errno = EINVAL;
+        return;
+    }
+
+    cmdParserServerFree(pSrv);
+}
+
+// serve the sessions up to cmdParserServerStop()
+int cmdParserServerRun(cmdParserServer_t *pServer)
+{
+    cmdParserServerInstance_t *pSrv = CMD_PARSER_SERVER_TO_INSTANCE(pServer);
+    struct epoll_event        events[CMD_PARSER_SERVER_EVENTS];
+    cmdParserSession_t        *pSess;
+    uint64_t                  val;
+    int                       nb;
+    int                       i;
+
+    errno = 0;
+
+    if(!pServer)
+    {
+        CMD_PARSER_ERR(NULL, "NULL parameter\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    pSrv->stop = 0;
+    while(!(pSrv->stop))
+    {
+        nb = epoll_wait(pSrv->epfd, events, CMD_PARSER_SERVER_EVENTS, pSrv->paused ? CMD_PARSER_SERVER_RETRY : -1);
+        if(nb < 0)
+        {
+            if(EINTR == errno)
+            {
+                continue;
+            }
+
+            CMD_PARSER_ERR(NULL, "Error %d while waiting for events\n", errno);
+            return -1;
+        }
+
+        // No session closed for a while: the descriptors may have been
+        // released elsewhere
+        if(0 == nb)
+        {
+            cmdParserServerPause(pSrv, 0);
+        }
+
+        for(i = 0; i < nb; i++)
+        {
+            if(events[i].data.ptr == &(pSrv->lfd))
+            {
+                cmdParserServerAccept(pSrv);
+                continue;
+            }
+
+            if(events[i].data.ptr == &(pSrv->wakeFd))
+            {
+                (void)read(pSrv->wakeFd, &val, sizeof(val));
+                pSrv->stop = 1;
+                continue;
+            }
+
+            pSess = (cmdParserSession_t *)(events[i].data.ptr);
+
+            if((events[i].events & EPOLLOUT) && pSess->pendLen)
+            {
+                cmdParserSessionDrain(pSess);
+            }
+
+            if(!(pSess->closing) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            {
+                cmdParserSessionInput(pSrv, pSess);
+            }
+
+            if(pSess->closing)
+            {
+                cmdParserSessionClose(pSess);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// stop cmdParserServerRun() (from any thread or a signal handler)
+int cmdParserServerStop(cmdParserServer_t *pServer)
+{
+    cmdParserServerInstance_t *pSrv = CMD_PARSER_SERVER_TO_INSTANCE(pServer);
+    uint64_t                  val = 1;
+
+    if(!pServer)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(write(pSrv->wakeFd, &val, sizeof(val)) != sizeof(val))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// send data to a session (from the callbacks of the server)
+int cmdParserServerSend(cmdParser_t *pInst, const void *buf, unsigned int len)
+{
+    cmdParserSession_t *pSess;
+
+    errno = 0;
+
+    if(!pInst || !(pInst->ctx) || (!buf && len))
+    {
+        CMD_PARSER_ERR(NULL, "Invalid parameters\n");
+        errno = EINVAL;
+        return -1;
+    }
+    pSess = (cmdParserSession_t *)(pInst->ctx);
+
+    // Through the output of the instance to be encoded like the echo
+    (void)cmdParserPrint(pInst, buf, len);
+    if(pSess->closing)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    return 0;
+}
@@ -90,7 +90,7 @@ int main(int ac, char *av[])
 	int               rc;
 	int               dbg = 0;
 	cmdParserParam_t  params;
-	unsigned char    *p;
+	cmdParserView_t   line;
 
 	options = 0;
 
@@ -159,10 +159,10 @@ int main(int ac, char *av[])
   		// Display the prompt
   		printf("%s ", cmdPrompt);
   		fflush(stdout);
-  		p = cmdParserInteract(cmdInstance);
-  		if(p)
+  		rc = cmdParserInteractView(cmdInstance, &line);
+  		if(0 == rc)
   		{
-    		printf("The command line is: <%s>\n", p);
+    		printf("The command line is: <%.*s>\n", (int)(line.len), line.data);
   		}
   		else
   		{
@@ -176,7 +176,7 @@ int main(int ac, char *av[])
     		rc = 1;
     		break;
   		}
-	}while(p);
+	}while(0 == rc);
 
 	// Deallocate the command line instance
 	cmdParserDelete(cmdInstance);